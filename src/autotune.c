@@ -0,0 +1,344 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * autotune.c -
+ *    Calibrating thread count, transaction size and compression on a sample
+ *    of the map, and saving the result as a profile for later runs
+ */
+
+#include "mcconvert.h"
+#include "autotune.h"
+#include "workpool.h"
+#include "db.h"
+
+typedef struct _TUNETRIAL {
+	MCCPROFILE p;
+	double seconds;
+	unsigned long long nbytes;
+	unsigned long nblocks;
+} TUNETRIAL, *LPTUNETRIAL;
+
+static const struct {
+	const char *name;
+	int strategy;
+} strategy_names[] = {
+	{"default",  Z_DEFAULT_STRATEGY},
+	{"filtered", Z_FILTERED},
+	{"huffman",  Z_HUFFMAN_ONLY},
+	{"rle",      Z_RLE},
+	{"fixed",    Z_FIXED}
+};
+
+// Compression settings tried, roughly from cheapest to tightest
+static const int tune_compression[][2] = {
+	{1, Z_HUFFMAN_ONLY},
+	{1, Z_RLE},
+	{1, Z_DEFAULT_STRATEGY},
+	{3, Z_DEFAULT_STRATEGY},
+	{6, Z_DEFAULT_STRATEGY},
+	{6, Z_FILTERED},
+	{9, Z_DEFAULT_STRATEGY},
+	{9, Z_FILTERED}
+};
+
+static const int tune_batch_sizes[] = {64, 256, 1024, 4096, 16384};
+
+static void AutotuneSampleBox(const BLOCKBOX *box, LPBLOCKBOX sample);
+static int AutotuneTrial(LPMCCONTEXT ctx, const MCVOLUME *vol, LPTUNETRIAL trial);
+static int AutotuneClear(LPMCCONTEXT ctx);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Tunes one setting at a time, each at the best found so far: threads with
+// the compression as it is, then compression, then the transaction size.
+// Output size only depends on the compression, so the goal only matters there.
+int AutotuneRun(LPMCCONTEXT ctx, const MCVOLUME *vol) {
+	TUNETRIAL best, trial, tried[ARRAYLEN(tune_compression)];
+	BLOCKBOX outbox = ctx->outbox;
+	MCCSINKPROC sink = ctx->sink;
+	void *sink_arg = ctx->sink_arg;
+	char *filename = ctx->output_filename;
+	int merge = ctx->merge, spawn_first = ctx->spawn_first, ntargets = ctx->ntargets;
+	double rate_blocks = ctx->rate_blocks, rate_bytes = ctx->rate_bytes;
+	double txn_budget = ctx->txn_budget;
+	double fastest = 0.0, slack;
+	int maxthreads, n, i, chosen, success = 1;
+	
+	memset(&best, 0, sizeof(best));
+	MCCGetProfile(ctx, &best.p);
+	
+	// Trials go straight into a private temporary database, with nothing
+	// else holding them back.  Extra targets are left out; they add about
+	// the same serializing work per block whatever the settings.
+	DBClose(ctx);
+	ctx->output_filename = "";
+	ctx->sink        = DBSinkProc;
+	ctx->sink_arg    = ctx;
+	ctx->merge       = 0;
+	ctx->spawn_first = 0;
+	ctx->ntargets    = 0;
+	ctx->rate_blocks = 0.0;
+	ctx->rate_bytes  = 0.0;
+	ctx->txn_budget  = 0.0;
+	AutotuneSampleBox(&outbox, &ctx->outbox);
+	
+	maxthreads = WorkPoolDefaultThreads();
+	if (maxthreads > MCC_MAX_THREADS)
+		maxthreads = MCC_MAX_THREADS;
+	for (n = 1; success; n *= 2) {
+		if (n > maxthreads)
+			n = maxthreads;
+		trial.p = best.p;
+		trial.p.nthreads = n;
+		success = AutotuneTrial(ctx, vol, &trial);
+		if (success && (n == 1 || trial.seconds < best.seconds * (1.0 - AUTOTUNE_MIN_GAIN)))
+			best = trial;
+		if (n == maxthreads)
+			break;
+	}
+	
+	for (i = 0; i != ARRAYLEN(tune_compression) && success; i++) {
+		tried[i].p = best.p;
+		tried[i].p.level    = tune_compression[i][0];
+		tried[i].p.strategy = tune_compression[i][1];
+		success = AutotuneTrial(ctx, vol, &tried[i]);
+		if (success && (!i || tried[i].seconds < fastest))
+			fastest = tried[i].seconds;
+	}
+	
+	// Settings within timing noise of the fastest count as just as fast
+	slack = (ctx->autotune == MCC_TUNE_SMALLEST) ? ctx->autotune_slack / 100.0 : AUTOTUNE_MIN_GAIN;
+	chosen = -1;
+	for (i = 0; i != ARRAYLEN(tune_compression) && success; i++) {
+		if (tried[i].seconds > fastest * (1.0 + slack))
+			continue;
+		if (chosen == -1 || tried[i].nbytes < tried[chosen].nbytes)
+			chosen = i;
+	}
+	if (chosen != -1)
+		best = tried[chosen];
+	
+	for (i = 0; i != ARRAYLEN(tune_batch_sizes) && success; i++) {
+		trial.p = best.p;
+		trial.p.batch_size = tune_batch_sizes[i];
+		if (trial.p.batch_size == best.p.batch_size)
+			continue;
+		success = AutotuneTrial(ctx, vol, &trial);
+		if (success && trial.seconds < best.seconds * (1.0 - AUTOTUNE_MIN_GAIN))
+			best = trial;
+	}
+	
+	DBClose(ctx);
+	ctx->output_filename = filename;
+	ctx->sink        = sink;
+	ctx->sink_arg    = sink_arg;
+	ctx->merge       = merge;
+	ctx->spawn_first = spawn_first;
+	ctx->ntargets    = ntargets;
+	ctx->rate_blocks = rate_blocks;
+	ctx->rate_bytes  = rate_bytes;
+	ctx->txn_budget  = txn_budget;
+	ctx->outbox      = outbox;
+	
+	if (!success) {
+		fprintf(stderr, "Autotune failed\n");
+		return 0;
+	}
+	
+	if (!MCCSetThreads(ctx, best.p.nthreads) ||
+		!MCCSetCompression(ctx, best.p.level, best.p.strategy))
+		return 0;
+	ctx->batch_size = best.p.batch_size;
+	
+	ctx->profile = best.p;
+	ctx->profile.blocks_per_sec  = best.nblocks / best.seconds;
+	ctx->profile.bytes_per_block = (double)best.nbytes / best.nblocks;
+	return 1;
+}
+
+
+int ProfileRead(const char *filename, MCCPROFILE *profile) {
+	char line[256], key[64], value[64];
+	int lineno = 0;
+	FILE *f;
+	
+	f = fopen(filename, "r");
+	if (!f) {
+		perror("Could not open profile");
+		return 0;
+	}
+	
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (sscanf(line, "%63s %63s", key, value) != 2 || key[0] == '#')
+			continue;
+		
+		if (!strcmp(key, "threads"))
+			profile->nthreads = atoi(value);
+		else if (!strcmp(key, "batch"))
+			profile->batch_size = atoi(value);
+		else if (!strcmp(key, "level"))
+			profile->level = atoi(value);
+		else if (!strcmp(key, "strategy"))
+			profile->strategy = ProfileStrategyByName(value);
+		else if (!strcmp(key, "blocks_per_sec"))
+			profile->blocks_per_sec = atof(value);
+		else if (!strcmp(key, "bytes_per_block"))
+			profile->bytes_per_block = atof(value);
+		else
+			fprintf(stderr, "WARNING: %s:%d: unknown setting '%s'\n", filename, lineno, key);
+	}
+	
+	fclose(f);
+	
+	if (profile->batch_size <= 0 || profile->strategy < 0) {
+		fprintf(stderr, "Profile %s has unusable settings\n", filename);
+		return 0;
+	}
+	return 1;
+}
+
+
+int ProfileWrite(const char *filename, const MCCPROFILE *profile) {
+	FILE *f;
+	int success;
+	
+	f = fopen(filename, "w");
+	if (!f) {
+		perror("Could not open profile for write");
+		return 0;
+	}
+	
+	fprintf(f, "# mcconvert settings, from --autotune\n");
+	fprintf(f, "threads %d\n", profile->nthreads);
+	fprintf(f, "batch %d\n", profile->batch_size);
+	fprintf(f, "level %d\n", profile->level);
+	fprintf(f, "strategy %s\n", ProfileStrategyName(profile->strategy));
+	if (profile->blocks_per_sec > 0.0) {
+		fprintf(f, "blocks_per_sec %.1f\n", profile->blocks_per_sec);
+		fprintf(f, "bytes_per_block %.1f\n", profile->bytes_per_block);
+	}
+	
+	success = !ferror(f);
+	success &= !fclose(f);
+	if (!success)
+		fprintf(stderr, "Failed to write profile %s\n", filename);
+	return success;
+}
+
+
+const char *ProfileStrategyName(int strategy) {
+	int i;
+	
+	for (i = 0; i != ARRAYLEN(strategy_names); i++) {
+		if (strategy_names[i].strategy == strategy)
+			return strategy_names[i].name;
+	}
+	
+	return "default";
+}
+
+
+// Returns -1 for an unknown name
+int ProfileStrategyByName(const char *name) {
+	int i;
+	
+	for (i = 0; i != ARRAYLEN(strategy_names); i++) {
+		if (!strcmp(strategy_names[i].name, name))
+			return strategy_names[i].strategy;
+	}
+	
+	return -1;
+}
+
+
+// A full-height column from the middle of the box, about AUTOTUNE_BLOCKS
+// blocks in all
+static void AutotuneSampleBox(const BLOCKBOX *box, LPBLOCKBOX sample) {
+	int ny = box->max.Y - box->min.Y + 1;
+	int side = 1;
+	
+	while ((side + 1) * (side + 1) * ny <= AUTOTUNE_BLOCKS)
+		side++;
+	
+	*sample = *box;
+	if (box->max.X - box->min.X + 1 > side) {
+		sample->min.X = (box->min.X + box->max.X + 1 - side) / 2;
+		sample->max.X = sample->min.X + side - 1;
+	}
+	if (box->max.Z - box->min.Z + 1 > side) {
+		sample->min.Z = (box->min.Z + box->max.Z + 1 - side) / 2;
+		sample->max.Z = sample->min.Z + side - 1;
+	}
+}
+
+
+static int AutotuneTrial(LPMCCONTEXT ctx, const MCVOLUME *vol, LPTUNETRIAL trial) {
+	double start, elapsed;
+	int i;
+	
+	if (!MCCSetThreads(ctx, trial->p.nthreads) ||
+		!MCCSetCompression(ctx, trial->p.level, trial->p.strategy))
+		return 0;
+	ctx->batch_size = trial->p.batch_size;
+	
+	for (i = 0; i != AUTOTUNE_REPEATS; i++) {
+		if (!DBVerify(ctx) || !AutotuneClear(ctx))
+			return 0;
+		
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+		start = TimeNow();
+		if (!ConvertMCToMT(ctx, vol) || !DBCommit(ctx))
+			return 0;
+		elapsed = TimeNow() - start;
+		
+		if (!i || elapsed < trial->seconds)
+			trial->seconds = elapsed;
+	}
+	trial->nbytes  = ctx->stats.nbytes;
+	trial->nblocks = ctx->stats.nblocks;
+	
+	printf("Autotune: %2d thread%s, batch %5d, level %d %-8s  %8.0f blocks/s  %6.0f bytes/block\n",
+		trial->p.nthreads, (trial->p.nthreads == 1) ? " " : "s", trial->p.batch_size,
+		trial->p.level, ProfileStrategyName(trial->p.strategy),
+		trial->nblocks / trial->seconds, (double)trial->nbytes / trial->nblocks);
+	return 1;
+}
+
+
+// Trials all start from an empty table, outside the timing
+static int AutotuneClear(LPMCCONTEXT ctx) {
+	const char *sql = ctx->summary ?
+		"DELETE FROM `blocks`; DELETE FROM `block_summary`; DELETE FROM `block_nodes`;" :
+		"DELETE FROM `blocks`;";
+	
+	if (sqlite3_exec(ctx->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Could not clear autotune database: %s\n", sqlite3_errmsg(ctx->db));
+		return 0;
+	}
+	
+	return 1;
+}
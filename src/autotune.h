@@ -0,0 +1,47 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUTOTUNE_HEADER
+#define AUTOTUNE_HEADER
+
+// Blocks converted by each trial, taken as a full-height column through the
+// middle of the map so terrain, caves and sky are all represented
+#define AUTOTUNE_BLOCKS 2048
+
+// Each trial is run this many times and the fastest kept; the first run also
+// pays for building the templates
+#define AUTOTUNE_REPEATS 3
+
+// More threads or another batch size have to be this much faster to be
+// taken, and compression settings this close to the fastest are taken as
+// equally fast, so timing noise doesn't decide
+#define AUTOTUNE_MIN_GAIN 0.03
+
+int AutotuneRun(LPMCCONTEXT ctx, const MCVOLUME *vol);
+
+int ProfileRead(const char *filename, MCCPROFILE *profile);
+int ProfileWrite(const char *filename, const MCCPROFILE *profile);
+const char *ProfileStrategyName(int strategy);
+int ProfileStrategyByName(const char *name);
+
+#endif // AUTOTUNE_HEADER
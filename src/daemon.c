@@ -0,0 +1,370 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * daemon.c -
+ *    Long-running conversion service.  Jobs arrive over a local Unix socket,
+ *    one request line per connection:
+ *
+ *        CONVERT <priority> <input> <output> [minimap]
+ *        STATS
+ *
+ *    Jobs are run by a fixed pool of workers, highest priority first and in
+ *    arrival order within a priority.  Each worker keeps its converter
+ *    context, and with it the zlib stream, scratch buffers and serialized
+ *    template blocks, alive between jobs.  The connection stays open until
+ *    the job finishes and is answered with a single OK or ERR line.
+ *
+ *    Each connection's request is read on a thread of its own, so a client
+ *    that connects and says nothing can't hold up anyone else; it's dropped
+ *    after DAEMON_REQUEST_TIMEOUT.
+ */
+
+#include "mcconvert.h"
+#include "daemon.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond  = PTHREAD_COND_INITIALIZER;
+static LPDAEMONJOB queue_head;
+static unsigned long queue_seq;
+static unsigned long jobs_done, jobs_failed;
+static int nqueued, nrunning;
+static volatile sig_atomic_t shutting_down;
+
+static void DaemonSignalHandler(int sig);
+static void *DaemonWorkerProc(void *arg);
+static void *DaemonConnectionProc(void *arg);
+static void DaemonHandleConnection(int fd);
+static int DaemonEnqueue(LPDAEMONJOB job);
+static LPDAEMONJOB DaemonDequeue(void);
+static void DaemonFreeJob(LPDAEMONJOB job);
+static int DaemonReadLine(int fd, char *buf, size_t buflen);
+static void DaemonReply(int fd, const char *fmt, ...);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+int DaemonRun(const char *sockpath, int nworkers) {
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	sigset_t sigs;
+	pthread_t *workers, conn;
+	pthread_attr_t attr;
+	int sfd, fd, i;
+	
+	if (nworkers <= 0)
+		nworkers = DAEMON_DEFAULT_WORKERS;
+	
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return 0;
+	}
+	
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd == -1) {
+		perror("socket");
+		return 0;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sockpath);
+	unlink(sockpath);
+	
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sfd, 64) == -1) {
+		perror("Could not listen on socket");
+		close(sfd);
+		return 0;
+	}
+	
+	// No SA_RESTART, so that accept() returns once we're told to stop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = DaemonSignalHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Workers inherit a mask without the stop signals so they're always
+	// delivered to the accept loop
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	
+	workers = malloc(nworkers * sizeof(pthread_t));
+	for (i = 0; i != nworkers; i++) {
+		if (pthread_create(&workers[i], NULL, DaemonWorkerProc, NULL)) {
+			fprintf(stderr, "Failed to start worker %d\n", i);
+			nworkers = i;
+			break;
+		}
+	}
+	
+	pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	
+	printf("Listening on %s with %d workers\n", sockpath, nworkers);
+	
+	while (!shutting_down) {
+		fd = accept(sfd, NULL, NULL);
+		if (fd == -1) {
+			if (errno != EINTR)
+				perror("accept");
+			continue;
+		}
+		
+		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+		if (pthread_create(&conn, &attr, DaemonConnectionProc, (void *)(intptr_t)fd)) {
+			DaemonReply(fd, "ERR busy\n");
+			close(fd);
+		}
+		pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+	}
+	
+	pthread_attr_destroy(&attr);
+	
+	printf("Shutting down, finishing %d queued jobs\n", nqueued);
+	
+	pthread_mutex_lock(&queue_lock);
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	
+	for (i = 0; i != nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	
+	close(sfd);
+	unlink(sockpath);
+	return 1;
+}
+
+
+static void DaemonSignalHandler(int sig) {
+	shutting_down = 1;
+}
+
+
+static void *DaemonConnectionProc(void *arg) {
+	DaemonHandleConnection((int)(intptr_t)arg);
+	return NULL;
+}
+
+
+static void DaemonHandleConnection(int fd) {
+	char line[DAEMON_MAX_REQUEST];
+	char input[DAEMON_MAX_REQUEST], output[DAEMON_MAX_REQUEST];
+	char minimap[DAEMON_MAX_REQUEST];
+	LPDAEMONJOB job;
+	int priority, nfields;
+	
+	if (!DaemonReadLine(fd, line, sizeof(line))) {
+		DaemonReply(fd, "ERR bad request\n");
+		close(fd);
+		return;
+	}
+	
+	if (!strcmp(line, "STATS")) {
+		pthread_mutex_lock(&queue_lock);
+		DaemonReply(fd, "OK queued=%d running=%d done=%lu failed=%lu\n",
+			nqueued, nrunning, jobs_done, jobs_failed);
+		pthread_mutex_unlock(&queue_lock);
+		close(fd);
+		return;
+	}
+	
+	nfields = sscanf(line, "CONVERT %d %4095s %4095s %4095s",
+		&priority, input, output, minimap);
+	if (nfields < 3) {
+		DaemonReply(fd, "ERR usage: CONVERT <priority> <input> <output> [minimap]\n");
+		close(fd);
+		return;
+	}
+	
+	job = calloc(1, sizeof(DAEMONJOB));
+	job->fd       = fd;
+	job->priority = priority;
+	job->queued   = TimeNow();
+	job->input    = strdup(input);
+	job->output   = strdup(output);
+	job->minimap  = (nfields == 4) ? strdup(minimap) : NULL;
+	
+	if (!DaemonEnqueue(job)) {
+		DaemonReply(fd, "ERR shutting down\n");
+		DaemonFreeJob(job);
+	}
+}
+
+
+static void *DaemonWorkerProc(void *arg) {
+	LPMCCONTEXT ctx;
+	LPDAEMONJOB job;
+	MCCSTATS stats;
+	double started;
+	int success;
+	
+	ctx = MCCContextCreate();
+	if (!ctx) {
+		fprintf(stderr, "Worker failed to create converter context\n");
+		return NULL;
+	}
+	
+	while ((job = DaemonDequeue())) {
+		started = TimeNow();
+		
+		MCCSetOutputFile(ctx, job->output);
+		MCCSetMinimap(ctx, job->minimap);
+		success = MCCConvertFile(ctx, job->input);
+		MCCFinish(ctx);
+		MCCGetStats(ctx, &stats);
+		
+		if (success) {
+			DaemonReply(job->fd, "OK blocks=%lu bytes=%llu queued_ms=%.1f convert_ms=%.1f\n",
+				stats.nblocks, stats.nbytes,
+				(started - job->queued) * 1000.0, (TimeNow() - started) * 1000.0);
+		} else {
+			DaemonReply(job->fd, "ERR conversion failed\n");
+		}
+		
+		pthread_mutex_lock(&queue_lock);
+		nrunning--;
+		if (success)
+			jobs_done++;
+		else
+			jobs_failed++;
+		pthread_mutex_unlock(&queue_lock);
+		
+		DaemonFreeJob(job);
+	}
+	
+	MCCContextDestroy(ctx);
+	return NULL;
+}
+
+
+// Fails once the daemon is stopping, as the workers may already be gone
+static int DaemonEnqueue(LPDAEMONJOB job) {
+	LPDAEMONJOB *pp;
+	
+	pthread_mutex_lock(&queue_lock);
+	if (shutting_down) {
+		pthread_mutex_unlock(&queue_lock);
+		return 0;
+	}
+	
+	job->seq = queue_seq++;
+	for (pp = &queue_head; *pp && (*pp)->priority >= job->priority; pp = &(*pp)->next)
+		;
+	job->next = *pp;
+	*pp = job;
+	nqueued++;
+	
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return 1;
+}
+
+
+static LPDAEMONJOB DaemonDequeue(void) {
+	LPDAEMONJOB job;
+	
+	pthread_mutex_lock(&queue_lock);
+	while (!queue_head && !shutting_down)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	
+	job = queue_head;
+	if (job) {
+		queue_head = job->next;
+		nqueued--;
+		nrunning++;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	
+	return job;
+}
+
+
+static void DaemonFreeJob(LPDAEMONJOB job) {
+	close(job->fd);
+	free(job->input);
+	free(job->output);
+	free(job->minimap);
+	free(job);
+}
+
+
+// Gives up on clients that haven't sent a whole line by the deadline
+static int DaemonReadLine(int fd, char *buf, size_t buflen) {
+	double deadline = TimeNow() + DAEMON_REQUEST_TIMEOUT / 1000.0;
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t n;
+	int wait;
+	
+	pfd.fd     = fd;
+	pfd.events = POLLIN;
+	
+	while (len < buflen - 1) {
+		wait = (int)((deadline - TimeNow()) * 1000.0);
+		if (wait <= 0 || poll(&pfd, 1, wait) <= 0)
+			break;
+		
+		n = read(fd, buf + len, 1);
+		if (n <= 0)
+			break;
+		if (buf[len] == '\n') {
+			if (len && buf[len - 1] == '\r')
+				len--;
+			buf[len] = 0;
+			return 1;
+		}
+		len++;
+	}
+	
+	return 0;
+}
+
+
+static void DaemonReply(int fd, const char *fmt, ...) {
+	char buf[512];
+	va_list ap;
+	int len;
+	
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	
+	if (len > 0 && write(fd, buf, len) != len)
+		fprintf(stderr, "WARNING: failed to send reply\n");
+}
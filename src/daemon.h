@@ -0,0 +1,44 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DAEMON_HEADER
+#define DAEMON_HEADER
+
+#define DAEMON_DEFAULT_WORKERS 2
+#define DAEMON_MAX_REQUEST     4096
+#define DAEMON_REQUEST_TIMEOUT 5000 // ms to send the request line
+
+typedef struct _DAEMONJOB {
+	struct _DAEMONJOB *next;
+	int fd;
+	int priority;
+	unsigned long seq;
+	double queued;
+	char *input;
+	char *output;
+	char *minimap;
+} DAEMONJOB, *LPDAEMONJOB;
+
+int DaemonRun(const char *sockpath, int nworkers);
+
+#endif // DAEMON_HEADER
@@ -28,19 +28,21 @@
 
 #include "mcconvert.h"
 #include "mapcontent.h"
+#include "merge.h"
 #include "db.h"
- 
-sqlite3 *m_database = NULL;
-sqlite3_stmt *m_database_read  = NULL;
-sqlite3_stmt *m_database_write = NULL;
-sqlite3_stmt *m_database_list  = NULL;
+#include "vfsbuf.h"
+
+#include <errno.h>
+
+static int DBExecRetry(LPMCCONTEXT ctx, const char *sql);
+static void SleepSeconds(double secs);
 
 
 ///////////////////////////////////////////////////////////////////////////////
 
 
-void DBCreate() {
-	int e = sqlite3_exec(m_database,
+void DBCreate(LPMCCONTEXT ctx) {
+	int e = sqlite3_exec(ctx->db,
 		"CREATE TABLE IF NOT EXISTS `blocks` ("
 			"`pos` INT NOT NULL PRIMARY KEY,"
 			"`data` BLOB"
@@ -49,43 +51,114 @@ void DBCreate() {
 		fprintf(stderr, "Could not create database structure\n");
 	else
 		printf("Database structure was created\n");
+	
+	if (!ctx->summary)
+		return;
+	
+	// Companion tables describing each block, kept small enough to scan
+	// or query by node name without touching `blocks`
+	e = sqlite3_exec(ctx->db,
+		"CREATE TABLE IF NOT EXISTS `block_summary` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`min_y` INT,"
+			"`max_y` INT,"
+			"`nsolid` INT NOT NULL"
+		");"
+		"CREATE INDEX IF NOT EXISTS `block_summary_max_y` ON `block_summary` (`max_y`);"
+		"CREATE TABLE IF NOT EXISTS `block_nodes` ("
+			"`name` TEXT NOT NULL,"
+			"`pos` INT NOT NULL,"
+			"`count` INT NOT NULL,"
+			"PRIMARY KEY (`name`, `pos`)"
+		") WITHOUT ROWID;"
+		"CREATE INDEX IF NOT EXISTS `block_nodes_pos` ON `block_nodes` (`pos`);",
+		NULL, NULL, NULL);
+	if (e != SQLITE_OK)
+		fprintf(stderr, "Could not create summary tables: %s\n", sqlite3_errmsg(ctx->db));
 }
 
 
-int DBVerify() {
-	if (!m_database) {
+int DBVerify(LPMCCONTEXT ctx) {
+	if (!ctx->db) {
+		const char *vfs = NULL;
 		int needs_create;
 		int d;
 
-		needs_create = 1; //!stat(OUTPUT_FILENAME, NULL);
+		needs_create = 1; //!stat(ctx->output_filename, NULL);
 
-		d = sqlite3_open_v2(OUTPUT_FILENAME, &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+		// A server reading the world must see each commit on disk
+		if (ctx->vfs_buffer && !ctx->live) {
+			vfs = VfsBufRegister();
+			if (!vfs)
+				fprintf(stderr, "WARNING: Buffered VFS unavailable, writing through the default\n");
+		}
+
+		d = sqlite3_open_v2(ctx->output_filename, &ctx->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs);
 		if (d != SQLITE_OK) {
-			fprintf(stderr, "WARNING: Database failed to open: %s\n", sqlite3_errmsg(m_database));
+			fprintf(stderr, "WARNING: Database failed to open: %s\n", sqlite3_errmsg(ctx->db));
+			sqlite3_close(ctx->db);
+			ctx->db = NULL;
 			return 0;
 		}
 
+		if (ctx->busy_timeout)
+			sqlite3_busy_timeout(ctx->db, ctx->busy_timeout);
+		
+		if (ctx->live) {
+			const char *mode = "unknown";
+			sqlite3_stmt *stmt;
+			
+			// Leave the journal mode to whoever owns the world, but say what
+			// it is; without WAL every batch blocks the server's readers.
+			if (sqlite3_prepare_v2(ctx->db, "PRAGMA journal_mode;", -1, &stmt, NULL) == SQLITE_OK) {
+				if (sqlite3_step(stmt) == SQLITE_ROW)
+					mode = (const char *)sqlite3_column_text(stmt, 0);
+				printf("Live import: journal mode %s, %d ms busy timeout, "
+					"%d blocks / %.0f ms per transaction\n", mode, ctx->busy_timeout,
+					ctx->batch_size, ctx->txn_budget * 1000.0);
+				sqlite3_finalize(stmt);
+			}
+		}
+
 		if (needs_create)
-			DBCreate();
+			DBCreate(ctx);
+
+		d = sqlite3_prepare(ctx->db, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &ctx->db_read, NULL);
+		if (d != SQLITE_OK) {
+			fprintf(stderr, "WARNING: Database read statment failed to prepare: %s\n", sqlite3_errmsg(ctx->db));
+			return 0;
+		}
 
-		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+		d = sqlite3_prepare(ctx->db, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` BETWEEN ? AND ?", -1, &ctx->db_read_range, NULL);
 		if (d != SQLITE_OK) {
-			fprintf(stderr, "WARNING: Database read statment failed to prepare: %s\n", sqlite3_errmsg(m_database));
+			fprintf(stderr, "WARNING: Database range read statment failed to prepare: %s\n", sqlite3_errmsg(ctx->db));
 			return 0;
 		}
 
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+		d = sqlite3_prepare(ctx->db, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &ctx->db_write, NULL);
 		if (d != SQLITE_OK) {
-			fprintf(stderr, "WARNING: Database write statment failed to prepare: %s\n", sqlite3_errmsg(m_database));
+			fprintf(stderr, "WARNING: Database write statment failed to prepare: %s\n", sqlite3_errmsg(ctx->db));
 			return 0;
 		}
 
-		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+		d = sqlite3_prepare(ctx->db, "SELECT `pos` FROM `blocks`", -1, &ctx->db_list, NULL);
 		if (d != SQLITE_OK) {
-			fprintf(stderr, "WARNING: Database list statment failed to prepare: %s\n", sqlite3_errmsg(m_database));
+			fprintf(stderr, "WARNING: Database list statment failed to prepare: %s\n", sqlite3_errmsg(ctx->db));
 			return 0;
 		}
 		
+		if (ctx->summary) {
+			d = sqlite3_prepare(ctx->db, "REPLACE INTO `block_summary` VALUES(?, ?, ?, ?)", -1, &ctx->db_summary_write, NULL);
+			if (d == SQLITE_OK)
+				d = sqlite3_prepare(ctx->db, "DELETE FROM `block_nodes` WHERE `pos`=?", -1, &ctx->db_nodes_clear, NULL);
+			if (d == SQLITE_OK)
+				d = sqlite3_prepare(ctx->db, "INSERT INTO `block_nodes` VALUES(?, ?, ?)", -1, &ctx->db_nodes_write, NULL);
+			if (d != SQLITE_OK) {
+				fprintf(stderr, "WARNING: Database summary statments failed to prepare: %s\n", sqlite3_errmsg(ctx->db));
+				return 0;
+			}
+		}
+		
 		printf("Database opened\n");
 	}
 	
@@ -93,40 +166,265 @@ int DBVerify() {
 }
 
 
-int DBSaveMapBlock(MapBlock *block) {
-	DBVerify();
+void DBClose(LPMCCONTEXT ctx) {
+	if (ctx->db)
+		DBCommit(ctx);
+	
+	if (ctx->db_read)
+		sqlite3_finalize(ctx->db_read);
+	if (ctx->db_read_range)
+		sqlite3_finalize(ctx->db_read_range);
+	if (ctx->db_write)
+		sqlite3_finalize(ctx->db_write);
+	if (ctx->db_list)
+		sqlite3_finalize(ctx->db_list);
+	if (ctx->db_summary_write)
+		sqlite3_finalize(ctx->db_summary_write);
+	if (ctx->db_nodes_clear)
+		sqlite3_finalize(ctx->db_nodes_clear);
+	if (ctx->db_nodes_write)
+		sqlite3_finalize(ctx->db_nodes_write);
+	if (ctx->db)
+		sqlite3_close(ctx->db);
+	
+	ctx->db_read  = NULL;
+	ctx->db_read_range = NULL;
+	ctx->db_write = NULL;
+	ctx->db_list  = NULL;
+	ctx->db_summary_write = NULL;
+	ctx->db_nodes_clear   = NULL;
+	ctx->db_nodes_write   = NULL;
+	ctx->db       = NULL;
+	
+	// Cached blocks describe the database just closed
+	MergeCacheClear(&ctx->cache);
+}
+
+
+// Hands every stored block with a key from first to last to proc.  A single
+// key goes through the point lookup instead.
+int DBReadRange(LPMCCONTEXT ctx, sqlite3_int64 first, sqlite3_int64 last,
+				DBREADPROC proc, void *arg) {
+	sqlite3_stmt *stmt;
+	int e, col;
+	
+	if (!DBVerify(ctx))
+		return 0;
+	
+	if (first == last) {
+		stmt = ctx->db_read;
+		sqlite3_bind_int64(stmt, 1, first);
+		col = 0;
+	} else {
+		stmt = ctx->db_read_range;
+		sqlite3_bind_int64(stmt, 1, first);
+		sqlite3_bind_int64(stmt, 2, last);
+		col = 1;
+	}
+	
+	while ((e = sqlite3_step(stmt)) == SQLITE_ROW) {
+		proc(arg, col ? sqlite3_column_int64(stmt, 0) : first,
+			sqlite3_column_blob(stmt, col), sqlite3_column_bytes(stmt, col));
+	}
+	sqlite3_reset(stmt);
+	
+	if (e != SQLITE_DONE) {
+		fprintf(stderr, "ERROR: Blocks failed to read (%lld to %lld) %s\n",
+				first, last, sqlite3_errmsg(ctx->db));
+		return 0;
+	}
+	
+	return 1;
+}
+
 
-	// To make things easy, just guess the needed size of the buffer.
-	// This seems like a generous enough amount.
-	u8 *output = malloc(0x20000);
-	size_t outlen = MapBlockSerialize(block, output);
-	if (outlen > 0x20000) {
-		fprintf(stderr, "UH OH, serialized output was too big\n");
-		exit(0);
+int DBSaveBlob(LPMCCONTEXT ctx, v3s16 pos, const u8 *data, size_t len,
+				LPBLOCKSUMMARY summary) {
+	int success;
+	
+	ctx->cur_summary = summary;
+	success = ctx->sink(ctx->sink_arg, MapBlockPosToInteger(pos), data, len);
+	ctx->cur_summary = NULL;
+	
+	if (!success) {
+		fprintf(stderr, "ERROR: Block sink rejected (%d, %d, %d)\n",
+				pos.X, pos.Y, pos.Z);
+		return 0;
 	}
+	
+	ctx->stats.nblocks++;
+	ctx->stats.nbytes += len;
+	
+	if (ctx->rate_blocks > 0.0 || ctx->rate_bytes > 0.0)
+		DBThrottle(ctx);
+	return 1;
+}
 
-	int success = 0;
-	if (sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		fprintf(stderr, "WARNING: begin save failed, saving might be slow.\n");
 
-	if (sqlite3_bind_int64(m_database_write, 1, MapBlockPosToInteger(block->pos)) != SQLITE_OK)
-		fprintf(stderr, "WARNING: Block position failed to bind: %s\n", sqlite3_errmsg(m_database));
-		
-	if (sqlite3_bind_blob(m_database_write, 2, output, outlen, NULL) != SQLITE_OK)
-		fprintf(stderr, "WARNING: Block data failed to bind: %s\n", sqlite3_errmsg(m_database));
+int DBSinkProc(void *arg, long long pos, const unsigned char *data, size_t len) {
+	LPMCCONTEXT ctx = arg;
+	int written, tries;
+	
+	if (!DBVerify(ctx))
+		return 0;
+
+	if (!ctx->txn_open && !DBBegin(ctx))
+		return 0;
+
+	if (sqlite3_bind_int64(ctx->db_write, 1, pos) != SQLITE_OK)
+		fprintf(stderr, "WARNING: Block position failed to bind: %s\n", sqlite3_errmsg(ctx->db));
 		
-	int written = sqlite3_step(m_database_write);
-	if (written != SQLITE_DONE)
-		fprintf(stderr, "ERROR: Block failed to save (%d, %d, %d) %s\n",
-				block->pos.X, block->pos.Y, block->pos.Z, sqlite3_errmsg(m_database));
+	if (sqlite3_bind_blob(ctx->db_write, 2, data, len, NULL) != SQLITE_OK)
+		fprintf(stderr, "WARNING: Block data failed to bind: %s\n", sqlite3_errmsg(ctx->db));
+	
+	// The busy handler has already waited out busy_timeout by the time
+	// SQLITE_BUSY comes back, so only retry a few more times.
+	for (tries = 0; ; tries++) {
+		written = sqlite3_step(ctx->db_write);
+		sqlite3_reset(ctx->db_write);
+		if ((written != SQLITE_BUSY && written != SQLITE_LOCKED) || tries == DB_BUSY_RETRIES)
+			break;
+		ctx->stats.nbusy++;
+		SleepSeconds(0.001 * (1 << tries));
+	}
+	
+	if (written != SQLITE_DONE) {
+		fprintf(stderr, "ERROR: Block failed to save (%lld) %s\n",
+				pos, sqlite3_errmsg(ctx->db));
+		return 0;
+	}
+	
+	if (ctx->cur_summary && ctx->summary)
+		DBSaveSummary(ctx, pos, ctx->cur_summary);
+	
+	ctx->txn_nblocks++;
+	if (ctx->txn_nblocks >= ctx->batch_size ||
+		(ctx->txn_budget > 0 && TimeNow() - ctx->txn_started >= ctx->txn_budget))
+		return DBCommit(ctx);
+
+	return 1;
+}
+
+
+int DBBegin(LPMCCONTEXT ctx) {
+	double wait;
+	
+	// Leave a gap after the last commit, or a writer waiting in its busy
+	// handler would keep finding the lock taken again
+	if (ctx->live) {
+		wait = ctx->txn_ended + DB_LIVE_YIELD - TimeNow();
+		if (wait > 0.0)
+			SleepSeconds(wait);
+	}
+	
+	// IMMEDIATE takes the write lock up front, so a concurrent writer makes
+	// us wait in the busy handler here instead of deadlocking on upgrade
+	if (!DBExecRetry(ctx, ctx->live ? "BEGIN IMMEDIATE;" : "BEGIN;")) {
+		fprintf(stderr, "WARNING: begin save failed: %s\n", sqlite3_errmsg(ctx->db));
+		return 0;
+	}
+	
+	ctx->txn_open     = 1;
+	ctx->txn_nblocks  = 0;
+	ctx->txn_started  = TimeNow();
+	return 1;
+}
+
+
+int DBCommit(LPMCCONTEXT ctx) {
+	if (!ctx->txn_open)
+		return 1;
+	
+	ctx->txn_open = 0;
+	ctx->stats.ntransactions++;
+	if (!DBExecRetry(ctx, "COMMIT;")) {
+		fprintf(stderr, "WARNING: end save failed, map might not have saved: %s\n",
+			sqlite3_errmsg(ctx->db));
+		sqlite3_exec(ctx->db, "ROLLBACK;", NULL, NULL, NULL);
+		return 0;
+	}
+	
+	ctx->txn_ended = TimeNow();
+	return 1;
+}
+
+
+void DBThrottle(LPMCCONTEXT ctx) {
+	double target = 0.0, t, elapsed;
+	
+	if (ctx->rate_blocks > 0.0)
+		target = ctx->stats.nblocks / ctx->rate_blocks;
+	if (ctx->rate_bytes > 0.0) {
+		t = ctx->stats.nbytes / ctx->rate_bytes;
+		if (t > target)
+			target = t;
+	}
+	
+	elapsed = TimeNow() - ctx->throttle_start;
+	if (elapsed >= target)
+		return;
+	
+	// Never sleep while holding the write lock
+	if (ctx->txn_open)
+		DBCommit(ctx);
+	SleepSeconds(target - elapsed);
+}
+
+
+static int DBExecRetry(LPMCCONTEXT ctx, const char *sql) {
+	int e, tries;
 	
-	success = 1;
+	for (tries = 0; ; tries++) {
+		e = sqlite3_exec(ctx->db, sql, NULL, NULL, NULL);
+		if ((e != SQLITE_BUSY && e != SQLITE_LOCKED) || tries == DB_BUSY_RETRIES)
+			break;
+		ctx->stats.nbusy++;
+		SleepSeconds(0.001 * (1 << tries));
+	}
+	
+	return e == SQLITE_OK;
+}
+
+
+static void SleepSeconds(double secs) {
+	struct timespec ts;
 	
-	sqlite3_reset(m_database_write);
-	if (sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		fprintf(stderr, "WARNING: end save failed, map might not have saved.\n");
+	ts.tv_sec  = (time_t)secs;
+	ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
 
-	free(output);
 
-	return success;
+void DBSaveSummary(LPMCCONTEXT ctx, sqlite3_int64 pos, LPBLOCKSUMMARY summary) {
+	s16 base_y = MapBlockIntegerToPos(pos).Y * MAP_BLOCKSIZE;
+	int i;
+	
+	sqlite3_bind_int64(ctx->db_summary_write, 1, pos);
+	if (summary->nsolid) {
+		sqlite3_bind_int(ctx->db_summary_write, 2, base_y + summary->min_y);
+		sqlite3_bind_int(ctx->db_summary_write, 3, base_y + summary->max_y);
+	} else {
+		sqlite3_bind_null(ctx->db_summary_write, 2);
+		sqlite3_bind_null(ctx->db_summary_write, 3);
+	}
+	sqlite3_bind_int(ctx->db_summary_write, 4, summary->nsolid);
+	if (sqlite3_step(ctx->db_summary_write) != SQLITE_DONE)
+		fprintf(stderr, "ERROR: Block summary failed to save (%lld) %s\n",
+				pos, sqlite3_errmsg(ctx->db));
+	sqlite3_reset(ctx->db_summary_write);
+	
+	sqlite3_bind_int64(ctx->db_nodes_clear, 1, pos);
+	sqlite3_step(ctx->db_nodes_clear);
+	sqlite3_reset(ctx->db_nodes_clear);
+	
+	for (i = 0; i != summary->nnames; i++) {
+		sqlite3_bind_text(ctx->db_nodes_write, 1, summary->names[i], -1, SQLITE_STATIC);
+		sqlite3_bind_int64(ctx->db_nodes_write, 2, pos);
+		sqlite3_bind_int(ctx->db_nodes_write, 3, summary->counts[i]);
+		if (sqlite3_step(ctx->db_nodes_write) != SQLITE_DONE)
+			fprintf(stderr, "ERROR: Block node list failed to save (%lld) %s\n",
+					pos, sqlite3_errmsg(ctx->db));
+		sqlite3_reset(ctx->db_nodes_write);
+	}
 }
@@ -24,13 +24,26 @@
 #ifndef DB_HEADER
 #define DB_HEADER
 
-extern sqlite3 *m_database;
-extern sqlite3_stmt *m_database_read;
-extern sqlite3_stmt *m_database_write;
-extern sqlite3_stmt *m_database_list;
+#define DB_BATCH_BLOCKS       1024
+#define DB_LIVE_BATCH_BLOCKS  64
+#define DB_LIVE_TXN_BUDGET    0.050
+#define DB_LIVE_BUSY_TIMEOUT  5000
+#define DB_BUSY_RETRIES       6
+#define DB_LIVE_YIELD         0.001
 
-void DBCreate();
-int DBVerify();
-int DBSaveMapBlock(MapBlock *block);
+typedef void (*DBREADPROC)(void *arg, sqlite3_int64 pos, const u8 *data, size_t len);
+
+void DBCreate(LPMCCONTEXT ctx);
+int DBVerify(LPMCCONTEXT ctx);
+void DBClose(LPMCCONTEXT ctx);
+int DBSaveBlob(LPMCCONTEXT ctx, v3s16 pos, const u8 *data, size_t len,
+				LPBLOCKSUMMARY summary);
+int DBReadRange(LPMCCONTEXT ctx, sqlite3_int64 first, sqlite3_int64 last,
+				DBREADPROC proc, void *arg);
+int DBBegin(LPMCCONTEXT ctx);
+int DBCommit(LPMCCONTEXT ctx);
+void DBThrottle(LPMCCONTEXT ctx);
+void DBSaveSummary(LPMCCONTEXT ctx, sqlite3_int64 pos, LPBLOCKSUMMARY summary);
+int DBSinkProc(void *arg, long long pos, const unsigned char *data, size_t len);
 
 #endif // DB_HEADER
@@ -0,0 +1,208 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * estimate.c -
+ *    Predicting the size and duration of a conversion from a random sample
+ *    of its blocks, serialized and inserted into a scratch database
+ */
+
+#include "mcconvert.h"
+#include "mapcontent.h"
+#include "estimate.h"
+#include "db.h"
+
+#include <math.h>
+
+// Running mean and variance
+typedef struct _SAMPLESTATS {
+	unsigned long n;
+	double mean;
+	double m2;
+} SAMPLESTATS;
+
+static void SampleAdd(SAMPLESTATS *s, double x);
+static double SampleVariance(const SAMPLESTATS *s);
+static double RandomUnit(u64 *state);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+int EstimateConversion(LPMCCONTEXT ctx, const MCVOLUME *vol, MCCESTIMATE *est) {
+	const BLOCKBOX *box = &ctx->outbox;
+	LPSERIALIZER ser = &ctx->ser[0];
+	SAMPLESTATS bytes, ser_time, ins_time;
+	LPTEMPLATEBLOB tmpl;
+	int wall_counts[WALL_COUNT];
+	double fraction, nmap, fpc, t0, t1, t2, wall_bytes = 0.0, commit_time;
+	char *filename;
+	const u8 *blob;
+	size_t len;
+	v3s16 pos;
+	int bx, by, bz, uniform, i, nthreads, success = 1;
+	u64 seed = 1;
+	
+	memset(est, 0, sizeof(MCCESTIMATE));
+	memset(&bytes, 0, sizeof(bytes));
+	memset(&ser_time, 0, sizeof(ser_time));
+	memset(&ins_time, 0, sizeof(ins_time));
+	
+	nmap = (double)(box->max.X - box->min.X + 1) *
+		   (box->max.Y - box->min.Y + 1) *
+		   (box->max.Z - box->min.Z + 1);
+	fraction = ctx->estimate;
+	if (fraction * nmap < ESTIMATE_MIN_SAMPLES)
+		fraction = ESTIMATE_MIN_SAMPLES / nmap;
+	
+	// Every wall block of a side is the same, so walls are counted exactly
+	if (ctx->walls) {
+		est->nwalls = CountWallBlocks(ctx, wall_counts);
+		for (i = 0; i != WALL_COUNT && success; i++) {
+			tmpl = GetWallTemplate(ctx, i);
+			if (tmpl)
+				wall_bytes += (double)wall_counts[i] * tmpl->len;
+			else
+				success = 0;
+		}
+	}
+	
+	// An empty filename has SQLite open a private temporary database, which
+	// goes away when closed
+	DBClose(ctx);
+	filename = ctx->output_filename;
+	ctx->output_filename = "";
+	
+	for (by = box->min.Y; by <= box->max.Y && success; by++) {
+		for (bz = box->min.Z; bz <= box->max.Z && success; bz++) {
+			for (bx = box->min.X; bx <= box->max.X && success; bx++) {
+				if (fraction < 1.0 && RandomUnit(&seed) >= fraction)
+					continue;
+				
+				pos.X = bx;
+				pos.Y = by;
+				pos.Z = bz;
+				
+				t0 = TimeNow();
+				uniform = GetUniformSource(vol, ctx->scale, bx, by, bz);
+				if (uniform >= 0) {
+					tmpl = GetUniformTemplate(ctx, uniform);
+					if (!tmpl) {
+						success = 0;
+						break;
+					}
+					blob = tmpl->blob;
+					len  = tmpl->len;
+					ctx->cur_summary = &tmpl->summary;
+				} else {
+					ser->block.pos = pos;
+					if (ctx->scale == 1)
+						CopyMapBlockFromMC(vol, bx, by, bz, ser->block.data);
+					else
+						CopyScaledMapBlockFromMC(vol, ctx->scale, bx, by, bz, ser->block.data);
+					if (vol->param2)
+						CopyParam2FromMC(vol, ctx->scale, bx, by, bz, ser->block.data);
+					len  = MapBlockSerialize(ctx, ser, &ser->block);
+					blob = ser->outbuf;
+					ctx->cur_summary = &ser->summary;
+				}
+				t1 = TimeNow();
+				
+				if (!len) {
+					success = 0;
+					break;
+				}
+				
+				// Straight into the SQLite sink, whatever sink is set, and
+				// without rate limiting
+				if (!ctx->summary)
+					ctx->cur_summary = NULL;
+				success = DBSinkProc(ctx, MapBlockPosToInteger(pos), blob, len);
+				ctx->cur_summary = NULL;
+				t2 = TimeNow();
+				
+				SampleAdd(&bytes, len);
+				SampleAdd(&ser_time, t1 - t0);
+				SampleAdd(&ins_time, t2 - t1);
+			}
+		}
+	}
+	
+	t0 = TimeNow();
+	if (ctx->db && !DBCommit(ctx))
+		success = 0;
+	commit_time = TimeNow() - t0;
+	
+	DBClose(ctx);
+	ctx->output_filename = filename;
+	
+	if (!success || !bytes.n)
+		return 0;
+	
+	// The last commit belongs to the inserts as a whole
+	ins_time.mean += commit_time / ins_time.n;
+	
+	// Projected for the thread count set, which may be meant for another
+	// machine than this one
+	nthreads = ctx->nthreads;
+	
+	// Sampling without replacement from a finite set of blocks
+	fpc = (nmap > 1.0) ? (nmap - bytes.n) / (nmap - 1.0) : 0.0;
+	
+	// Serialization is split across the threads, inserts all happen on the
+	// calling thread, and walls only cost an insert
+	est->nsampled  = bytes.n;
+	est->nblocks   = (unsigned long)nmap + est->nwalls;
+	est->nthreads  = nthreads;
+	est->nbytes    = bytes.mean * nmap + wall_bytes;
+	est->nbytes_ci = ESTIMATE_Z95 * nmap * sqrt(SampleVariance(&bytes) / bytes.n * fpc);
+	est->serialize_seconds = ser_time.mean * nmap / nthreads;
+	est->insert_seconds    = ins_time.mean * est->nblocks;
+	est->seconds    = est->serialize_seconds + est->insert_seconds;
+	est->seconds_ci = ESTIMATE_Z95 * sqrt(fpc * (
+		SampleVariance(&ser_time) / ser_time.n * (nmap / nthreads) * (nmap / nthreads) +
+		SampleVariance(&ins_time) / ins_time.n * est->nblocks * est->nblocks));
+	
+	return 1;
+}
+
+
+static void SampleAdd(SAMPLESTATS *s, double x) {
+	double delta = x - s->mean;
+	
+	s->n++;
+	s->mean += delta / s->n;
+	s->m2   += delta * (x - s->mean);
+}
+
+
+static double SampleVariance(const SAMPLESTATS *s) {
+	return (s->n > 1) ? s->m2 / (s->n - 1) : 0.0;
+}
+
+
+// Fixed seed, so the same map and fraction always sample the same blocks
+static double RandomUnit(u64 *state) {
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
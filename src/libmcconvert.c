@@ -0,0 +1,1110 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * libmcconvert.c -
+ *    Converter context management and the embeddable conversion entry points
+ */
+
+#include "mcconvert.h"
+#include "mapcontent.h"
+#include "merge.h"
+#include "workpool.h"
+#include "estimate.h"
+#include "autotune.h"
+#include "liquid.h"
+#include "lod.h"
+#include "mapheader.h"
+#include "db.h"
+#include "minimap.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Map headers are read this much at a time until the node array is found
+#define MCC_HEADER_CHUNK 0x8000
+
+// Hands out bytes already read before going back to the underlying reader
+typedef struct _PREFIXREADER {
+	const u8 *buf;
+	size_t len;
+	MCCREADPROC reader;
+	void *arg;
+} PREFIXREADER;
+
+static int MCCCheckHeader(const u8 *header);
+static int MCCReadMapInfo(LPMCCONTEXT ctx, const u8 *header, size_t len, int complete);
+static size_t MCCMapNodes(LPMCCONTEXT ctx);
+static long MCCPrefixReadProc(void *arg, void *buf, size_t len);
+static int MCCSelectBlocks(LPMCCONTEXT ctx);
+static void MCCSelectSpawn(LPMCCONTEXT ctx);
+static int MCCReadFile(LPMCCONTEXT ctx, const char *filename, LPMCVOLUME vol);
+static int MCCConvertNodes(LPMCCONTEXT ctx, LPMCVOLUME vol, const MCVOLUME *prev, int sync);
+static int MCCReadFully(MCCREADPROC reader, void *arg, u8 *buf, size_t len);
+static s16 NodeToBlock(int n);
+static void MCCFreeThreads(LPMCCONTEXT ctx);
+static void MCCFreeTemplates(LPMCCONTEXT ctx);
+static void MCCFreeSynced(LPMCCONTEXT ctx);
+static int MCCSameLayout(const MCVOLUME *a, const MCVOLUME *b);
+static int MCCSyncChild(LPMCCONTEXT ctx, LPMCCONTEXT child);
+static int MCCSyncTargets(LPMCCONTEXT ctx);
+static int MCCSyncLod(LPMCCONTEXT ctx, LPMCCONTEXT lod, const MCVOLUME *vol, int level);
+static int MCCConvertLods(LPMCCONTEXT ctx, const MCVOLUME *vol, int sync);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+LPMCCONTEXT MCCContextCreate(void) {
+	LPMCCONTEXT ctx = calloc(1, sizeof(MCCONTEXT));
+	if (!ctx)
+		return NULL;
+	
+	ctx->output_filename = strdup(OUTPUT_FILENAME);
+	ctx->walls    = 1;
+	ctx->scale    = 1;
+	ctx->batch_size = DB_BATCH_BLOCKS;
+	ctx->sink     = DBSinkProc;
+	ctx->sink_arg = ctx;
+	ctx->deflate_level    = Z_DEFAULT_COMPRESSION;
+	ctx->deflate_strategy = Z_DEFAULT_STRATEGY;
+	ctx->names    = node_names;
+	if (!MCCSetThreads(ctx, 1)) {
+		MCCContextDestroy(ctx);
+		return NULL;
+	}
+	
+	// Node metadata is always empty, so compress it once for every block
+	u8 meta_version = 0; //version 1 for real data, 0 for "go away"
+	ctx->meta_len = ZLibDeflaterCompress(&ctx->ser[0].deflater, &meta_version, 1,
+		ctx->meta_blob, sizeof(ctx->meta_blob));
+	if (!ctx->meta_len || !MapNodeInitPlaneTail(&ctx->plane_tail)) {
+		MCCContextDestroy(ctx);
+		return NULL;
+	}
+	
+	return ctx;
+}
+
+
+void MCCContextDestroy(LPMCCONTEXT ctx) {
+	int i;
+	
+	if (!ctx)
+		return;
+	
+	for (i = 0; i != ctx->ntargets; i++)
+		MCCContextDestroy(ctx->targets[i]);
+	for (i = 0; i != ctx->nlods; i++)
+		MCCContextDestroy(ctx->lods[i]);
+	DBClose(ctx);
+	MCCFreeThreads(ctx);
+	MCCFreeTemplates(ctx);
+	MCCFreeSynced(ctx);
+	free(ctx->minimap_filename);
+	free(ctx->ready_filename);
+	free(ctx->output_filename);
+	free(ctx->mapping);
+	free(ctx);
+}
+
+
+void MCCSetOutputFile(LPMCCONTEXT ctx, const char *filename) {
+	DBClose(ctx);
+	free(ctx->output_filename);
+	ctx->output_filename = strdup(filename);
+}
+
+
+void MCCSetSink(LPMCCONTEXT ctx, MCCSINKPROC sink, void *arg) {
+	if (sink) {
+		ctx->sink     = sink;
+		ctx->sink_arg = arg;
+	} else {
+		ctx->sink     = DBSinkProc;
+		ctx->sink_arg = ctx;
+	}
+}
+
+
+void MCCSetWalls(LPMCCONTEXT ctx, int enable) {
+	ctx->walls = enable;
+}
+
+
+// Only takes effect with the default SQLite sink
+void MCCSetSummary(LPMCCONTEXT ctx, int enable) {
+	DBClose(ctx);
+	ctx->summary = enable;
+}
+
+
+// budget_ms of 0 means batches are bounded by size only
+void MCCSetBatch(LPMCCONTEXT ctx, int nblocks, double budget_ms) {
+	DBCommit(ctx);
+	ctx->batch_size = (nblocks > 0) ? nblocks : 1;
+	ctx->txn_budget = budget_ms / 1000.0;
+}
+
+
+// Import alongside a running server: wait on its locks, take the write lock
+// up front, and keep transactions short.  A timeout of 0 disables live mode.
+void MCCSetLive(LPMCCONTEXT ctx, int busy_timeout_ms) {
+	DBClose(ctx);
+	ctx->live         = busy_timeout_ms > 0;
+	ctx->busy_timeout = busy_timeout_ms;
+	if (ctx->live) {
+		ctx->batch_size = DB_LIVE_BATCH_BLOCKS;
+		ctx->txn_budget = DB_LIVE_TXN_BUDGET;
+	} else {
+		ctx->batch_size = DB_BATCH_BLOCKS;
+		ctx->txn_budget = 0.0;
+	}
+}
+
+
+// Writes the database through a VFS that gathers writes into large pieces
+// and only syncs when the database is closed.  A conversion cut short by a
+// crash or power loss may leave the world corrupt.  Ignored in live mode.
+void MCCSetVfsBuffer(LPMCCONTEXT ctx, int enable) {
+	DBClose(ctx);
+	ctx->vfs_buffer = enable;
+}
+
+
+void MCCSetRateLimit(LPMCCONTEXT ctx, double blocks_per_sec, double bytes_per_sec) {
+	ctx->rate_blocks = blocks_per_sec;
+	ctx->rate_bytes  = bytes_per_sec;
+}
+
+
+// Restricts conversion to the blocks overlapping the given box, inclusive, in
+// output node coordinates or, if in_blocks is set, block coordinates
+void MCCSetRegion(LPMCCONTEXT ctx, int x0, int y0, int z0,
+				int x1, int y1, int z1, int in_blocks) {
+	int t;
+	
+	if (x0 > x1) { t = x0; x0 = x1; x1 = t; }
+	if (y0 > y1) { t = y0; y0 = y1; y1 = t; }
+	if (z0 > z1) { t = z0; z0 = z1; z1 = t; }
+	
+	if (in_blocks) {
+		ctx->region.min.X = x0;
+		ctx->region.min.Y = y0;
+		ctx->region.min.Z = z0;
+		ctx->region.max.X = x1;
+		ctx->region.max.Y = y1;
+		ctx->region.max.Z = z1;
+	} else {
+		ctx->region.min.X = NodeToBlock(x0);
+		ctx->region.min.Y = NodeToBlock(y0);
+		ctx->region.min.Z = NodeToBlock(z0);
+		ctx->region.max.X = NodeToBlock(x1);
+		ctx->region.max.Y = NodeToBlock(y1);
+		ctx->region.max.Z = NodeToBlock(z1);
+	}
+	ctx->has_region = 1;
+}
+
+
+void MCCClearRegion(LPMCCONTEXT ctx) {
+	ctx->has_region = 0;
+}
+
+
+// Overrides the map size given by the file header, or used when it has none.
+// All zeros goes back to the header.
+void MCCSetMapSize(LPMCCONTEXT ctx, int cx, int cy, int cz) {
+	if (cx <= 0 || cy <= 0 || cz <= 0)
+		cx = cy = cz = 0;
+	
+	ctx->size_cx = cx;
+	ctx->size_cy = cy;
+	ctx->size_cz = cz;
+}
+
+
+// Region coordinates are always given unscaled
+int MCCSetScale(LPMCCONTEXT ctx, int scale) {
+	if (scale < 1 || scale > MCC_MAX_SCALE)
+		return 0;
+	
+	ctx->scale = scale;
+	return 1;
+}
+
+
+// Overlays converted nodes onto the blocks already in the output database
+// rather than replacing them.  Air never overwrites anything.
+void MCCSetMerge(LPMCCONTEXT ctx, int enable) {
+	ctx->merge = enable;
+}
+
+
+// Names written for each Classic node ID, as read by MapNodeLoadNames.  NULL
+// goes back to the built-in minetest_game names.
+int MCCSetMapping(LPMCCONTEXT ctx, const char *filename) {
+	const char **mapping = NULL;
+	
+	if (filename) {
+		mapping = MapNodeLoadNames(filename);
+		if (!mapping)
+			return 0;
+	}
+	
+	free(ctx->mapping);
+	ctx->mapping = mapping;
+	ctx->names   = mapping ? mapping : node_names;
+	MCCFreeTemplates(ctx);
+	return 1;
+}
+
+
+// Also writes the map to filename with the names from mapping (NULL for the
+// built-in ones).  Blocks are extracted once and serialized for every target;
+// each target takes the scale, region, walls, summaries, compression and
+// transaction settings of ctx, and has its own database.  Only the database
+// sink is supported and targets can't be merged into.
+int MCCAddTarget(LPMCCONTEXT ctx, const char *filename, const char *mapping) {
+	LPMCCONTEXT target;
+	
+	if (ctx->ntargets == MCC_MAX_TARGETS) {
+		fprintf(stderr, "No more than %d extra targets are supported\n", MCC_MAX_TARGETS);
+		return 0;
+	}
+	
+	target = MCCContextCreate();
+	if (!target)
+		return 0;
+	MCCSetOutputFile(target, filename);
+	if (!MCCSetMapping(target, mapping)) {
+		MCCContextDestroy(target);
+		return 0;
+	}
+	
+	ctx->targets[ctx->ntargets++] = target;
+	return 1;
+}
+
+
+// Also writes the map at half its size to filename, and on each further call
+// at half the size of the last.  The levels are downsampled one from the
+// next once the map is converted, and each is written as a world of its own
+// with the settings of ctx and the built-in or MCCSetMapping names.  They
+// need the whole map at scale 1, and MCCSyncFile only writes them on a full
+// conversion.
+int MCCAddLod(LPMCCONTEXT ctx, const char *filename) {
+	LPMCCONTEXT lod;
+	
+	if (ctx->nlods == MCC_MAX_LODS) {
+		fprintf(stderr, "No more than %d levels of detail are supported\n", MCC_MAX_LODS);
+		return 0;
+	}
+	
+	lod = MCCContextCreate();
+	if (!lod)
+		return 0;
+	MCCSetOutputFile(lod, filename);
+	
+	ctx->lods[ctx->nlods++] = lod;
+	return 1;
+}
+
+
+// Before converting, turn enclosed flowing water and lava into sources and
+// let the rest flow to a standstill, so the server doesn't have to.  The
+// caller's buffer is copied rather than changed.
+void MCCSetSettleLiquids(LPMCCONTEXT ctx, int enable) {
+	ctx->settle_liquids = enable;
+}
+
+
+// Keeps the node array read by MCCConvertReader and MCCConvertFile at 6 bits
+// per node instead of 8, so a map a third larger fits in the same memory.
+// Buffers passed to MCCConvertBuffer are always used as they are.
+void MCCSetPacked(LPMCCONTEXT ctx, int enable) {
+	ctx->packed = enable;
+}
+
+
+// Threads serializing (and, when merging, decoding) blocks; 0 uses one per
+// online CPU.  Blocks are still handed to the sink from the calling thread.
+int MCCSetThreads(LPMCCONTEXT ctx, int nthreads) {
+	LPSERIALIZER ser;
+	int i;
+	
+	if (nthreads <= 0)
+		nthreads = WorkPoolDefaultThreads();
+	if (nthreads > MCC_MAX_THREADS)
+		nthreads = MCC_MAX_THREADS;
+	if (nthreads == ctx->nthreads)
+		return 1;
+	
+	ser = calloc(nthreads, sizeof(SERIALIZER));
+	if (!ser)
+		return 0;
+	for (i = 0; i != nthreads; i++) {
+		if (!SerializerInit(&ser[i])) {
+			while (i >= 0)
+				SerializerFree(&ser[i--]);
+			free(ser);
+			return 0;
+		}
+		ZLibDeflaterSetParams(&ser[i].deflater, ctx->deflate_level, ctx->deflate_strategy);
+		ZLibDeflaterSetParams(&ser[i].rawdeflater, ctx->deflate_level, ctx->deflate_strategy);
+	}
+	
+	// The meta blob outlives the serializer that compressed it
+	MCCFreeThreads(ctx);
+	ctx->ser      = ser;
+	ctx->nthreads = nthreads;
+	return 1;
+}
+
+
+// zlib level (0-9, or -1 for zlib's default) and strategy for node data.
+// Blocks already templated are compressed again with the new settings.
+int MCCSetCompression(LPMCCONTEXT ctx, int level, int strategy) {
+	int i;
+	
+	if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION ||
+		strategy < Z_DEFAULT_STRATEGY || strategy > Z_FIXED)
+		return 0;
+	if (level == ctx->deflate_level && strategy == ctx->deflate_strategy)
+		return 1;
+	
+	ctx->deflate_level    = level;
+	ctx->deflate_strategy = strategy;
+	for (i = 0; i != ctx->nthreads; i++) {
+		ZLibDeflaterSetParams(&ctx->ser[i].deflater, level, strategy);
+		ZLibDeflaterSetParams(&ctx->ser[i].rawdeflater, level, strategy);
+	}
+	MCCFreeTemplates(ctx);
+	
+	return 1;
+}
+
+
+// Before converting, tries thread counts, compression settings and batch
+// sizes on a sample of the map and keeps the best for the goal.
+// MCC_TUNE_SMALLEST takes the smallest output no more than slack_percent
+// slower than the fastest.
+void MCCSetAutotune(LPMCCONTEXT ctx, int goal, double slack_percent) {
+	ctx->autotune       = goal;
+	ctx->autotune_slack = (slack_percent > 0.0) ? slack_percent : 0.0;
+}
+
+
+void MCCGetProfile(LPMCCONTEXT ctx, MCCPROFILE *profile) {
+	*profile = ctx->profile;
+	profile->nthreads   = ctx->nthreads;
+	profile->batch_size = ctx->batch_size;
+	profile->level      = ctx->deflate_level;
+	profile->strategy   = ctx->deflate_strategy;
+}
+
+
+// Applies the settings saved by MCCSaveProfile, typically after an autotune
+int MCCLoadProfile(LPMCCONTEXT ctx, const char *filename) {
+	MCCPROFILE profile;
+	
+	MCCGetProfile(ctx, &profile);
+	if (!ProfileRead(filename, &profile))
+		return 0;
+	
+	if (!MCCSetThreads(ctx, profile.nthreads) ||
+		!MCCSetCompression(ctx, profile.level, profile.strategy)) {
+		fprintf(stderr, "Profile %s has unusable settings\n", filename);
+		return 0;
+	}
+	ctx->batch_size = profile.batch_size;
+	
+	return 1;
+}
+
+
+int MCCSaveProfile(LPMCCONTEXT ctx, const char *filename) {
+	MCCPROFILE profile;
+	
+	MCCGetProfile(ctx, &profile);
+	return ProfileWrite(filename, &profile);
+}
+
+
+// Converts blocks in shells of growing distance from the spawn point instead
+// of plane by plane, so the part of the world players arrive in is written
+// first.  The spawn is the one set with MCCSetSpawn, else the map's own, else
+// the middle of the map.
+void MCCSetSpawnFirst(LPMCCONTEXT ctx, int enable) {
+	ctx->spawn_first = enable;
+}
+
+
+// In output node coordinates
+void MCCSetSpawn(LPMCCONTEXT ctx, int x, int y, int z) {
+	ctx->has_spawn = 1;
+	ctx->spawn_x = x;
+	ctx->spawn_y = y;
+	ctx->spawn_z = z;
+}
+
+
+// Once every block within radius blocks of the spawn is committed, filename
+// is created, so a server waiting on it can start while the rest is written.
+// Without spawn-first ordering that is only known at the end.
+void MCCSetReady(LPMCCONTEXT ctx, const char *filename, int radius) {
+	free(ctx->ready_filename);
+	ctx->ready_filename = filename ? strdup(filename) : NULL;
+	ctx->ready_radius   = (radius > 0) ? radius : 0;
+}
+
+
+// Makes conversions sample this fraction of the blocks and project the full
+// run from them, rather than writing anything.  0 converts as normal.
+void MCCSetEstimate(LPMCCONTEXT ctx, double fraction) {
+	if (fraction > 1.0)
+		fraction = 1.0;
+	ctx->estimate = (fraction > 0.0) ? fraction : 0.0;
+}
+
+
+void MCCGetEstimate(LPMCCONTEXT ctx, MCCESTIMATE *est) {
+	*est = ctx->est;
+}
+
+
+void MCCSetMinimap(LPMCCONTEXT ctx, const char *filename) {
+	free(ctx->minimap_filename);
+	ctx->minimap_filename = filename ? strdup(filename) : NULL;
+}
+
+
+void MCCFinish(LPMCCONTEXT ctx) {
+	int i;
+	
+	for (i = 0; i != ctx->ntargets; i++)
+		DBClose(ctx->targets[i]);
+	for (i = 0; i != ctx->nlods; i++)
+		DBClose(ctx->lods[i]);
+	DBClose(ctx);
+}
+
+
+void MCCGetStats(LPMCCONTEXT ctx, MCCSTATS *stats) {
+	*stats = ctx->stats;
+}
+
+
+int MCCConvertBuffer(LPMCCONTEXT ctx, const void *buf, size_t len) {
+	MCVOLUME vol;
+	int success;
+	
+	if (MCCReadMapInfo(ctx, buf, len, 1) != 1)
+		return 0;
+	
+	if (len < ctx->map.data_offset + MCCMapNodes(ctx)) {
+		fprintf(stderr, "Map buffer too short (%lu bytes)\n", (unsigned long)len);
+		return 0;
+	}
+	
+	// Conversion only writes to the node data when settling liquids, and
+	// then to a copy, so use it in place
+	VolumeWrap(&vol, (const u8 *)buf + ctx->map.data_offset, &ctx->map);
+	success = MCCConvertNodes(ctx, &vol, NULL, 0);
+	VolumeFree(&vol);
+	
+	return success;
+}
+
+
+int MCCConvertReader(LPMCCONTEXT ctx, MCCREADPROC reader, void *arg) {
+	PREFIXREADER prefix;
+	u8 *header = NULL;
+	size_t len = 0, want;
+	MCVOLUME vol;
+	long n = 1;
+	int success;
+	
+	// Read until the header says where the node array starts
+	do {
+		header = realloc(header, len + MCC_HEADER_CHUNK);
+		for (want = len + MCC_HEADER_CHUNK; len != want; len += n) {
+			n = reader(arg, header + len, want - len);
+			if (n <= 0)
+				break;
+		}
+		success = MCCReadMapInfo(ctx, header, len, n <= 0);
+	} while (success == -1);
+	
+	if (success && len < ctx->map.data_offset) {
+		header = realloc(header, ctx->map.data_offset);
+		if (!MCCReadFully(reader, arg, header + len, ctx->map.data_offset - len)) {
+			fprintf(stderr, "Failed to read map header\n");
+			success = 0;
+		}
+		len = ctx->map.data_offset;
+	}
+	
+	if (!success) {
+		free(header);
+		return 0;
+	}
+	
+	// Whatever was read past the header is the start of the node data
+	prefix.buf    = header + ctx->map.data_offset;
+	prefix.len    = len - ctx->map.data_offset;
+	prefix.reader = reader;
+	prefix.arg    = arg;
+	success = VolumeReadStream(&vol, MCCPrefixReadProc, &prefix,
+		&ctx->map, &ctx->box, ctx->packed);
+	free(header);
+	if (!success)
+		return 0;
+	
+	success = MCCConvertNodes(ctx, &vol, NULL, 0);
+	VolumeFree(&vol);
+	
+	return success;
+}
+
+
+int MCCConvertFile(LPMCCONTEXT ctx, const char *filename) {
+	MCVOLUME vol;
+	int success;
+	
+	if (!MCCReadFile(ctx, filename, &vol))
+		return 0;
+	
+	success = MCCConvertNodes(ctx, &vol, NULL, 0);
+	VolumeFree(&vol);
+	
+	return success;
+}
+
+
+// Converts filename in full the first time, and after that rewrites only the
+// blocks whose nodes differ from the map as it was at the last sync, so a
+// world can follow a map file that keeps being saved.  The map is held
+// between calls, so syncing needs memory for two maps.  A map whose size
+// changed is converted in full again; the scale, region, mapping and liquid
+// settings should otherwise stay as they were.  Levels of detail are synced
+// the same way, each level against its own previous downsample.
+int MCCSyncFile(LPMCCONTEXT ctx, const char *filename) {
+	const MCVOLUME *prev = ctx->synced;
+	LPMCVOLUME vol;
+	int i, success;
+	
+	if (ctx->merge || ctx->estimate > 0.0) {
+		fprintf(stderr, "Syncing can't be combined with merging or estimating\n");
+		return 0;
+	}
+	
+	vol = malloc(sizeof(MCVOLUME));
+	if (!vol || !MCCReadFile(ctx, filename, vol)) {
+		free(vol);
+		return 0;
+	}
+	
+	if (prev && !MCCSameLayout(prev, vol))
+		prev = NULL;
+	success = MCCConvertNodes(ctx, vol, prev, 1);
+	
+	// After a failure the world is in no known state, so the next sync
+	// starts over
+	MCCFreeSynced(ctx);
+	if (success) {
+		ctx->synced = vol;
+	} else {
+		VolumeFree(vol);
+		free(vol);
+		for (i = 0; i != ctx->nlods; i++)
+			MCCFreeSynced(ctx->lods[i]);
+	}
+	
+	return success;
+}
+
+
+static int MCCReadFile(LPMCCONTEXT ctx, const char *filename, LPMCVOLUME vol) {
+	struct stat st;
+	u8 *header = NULL;
+	size_t len = 0, want = MCC_HEADER_CHUNK;
+	ssize_t n = 1;
+	int fd, success;
+	
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		perror("Could not open input file for read");
+		return 0;
+	}
+	
+	if (fstat(fd, &st) == -1) {
+		perror("Could not stat input file");
+		close(fd);
+		return 0;
+	}
+	
+	do {
+		if (want > (size_t)st.st_size)
+			want = st.st_size;
+		header = realloc(header, want ? want : 1);
+		while (len != want) {
+			n = pread(fd, header + len, want - len, len);
+			if (n <= 0)
+				break;
+			len += n;
+		}
+		success = MCCReadMapInfo(ctx, header, len, len == (size_t)st.st_size || n <= 0);
+		want *= 2;
+	} while (success == -1);
+	free(header);
+	
+	if (success && (size_t)st.st_size < ctx->map.data_offset + MCCMapNodes(ctx)) {
+		fprintf(stderr, "Map file too short for %dx%dx%d nodes\n",
+			ctx->map.cx, ctx->map.cy, ctx->map.cz);
+		success = 0;
+	}
+	
+	// Files can seek, so only the rows overlapping the region are read
+	success = success && VolumeReadFile(vol, fd, &ctx->map, &ctx->box, ctx->packed);
+	close(fd);
+	
+	return success;
+}
+
+
+static int MCCCheckHeader(const u8 *header) {
+	u32 magic = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+	
+	if (magic != MCC_MAP_MAGIC) {
+		fprintf(stderr, "Header mismatch, invalid Minecraft Classic map file\n");
+		return 0;
+	}
+	
+	if (header[4] != MCC_MAP_VERSION) {
+		fprintf(stderr, "Unhandled map file version\n");
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+// Works out the map layout from the len bytes of the file in header and
+// picks the blocks to convert.  Returns -1 if more of the file is needed,
+// unless complete says that's all there is.
+static int MCCReadMapInfo(LPMCCONTEXT ctx, const u8 *header, size_t len, int complete) {
+	int found;
+	
+	if (len < 5) {
+		if (complete) {
+			fprintf(stderr, "Failed to read map header\n");
+			return 0;
+		}
+		return -1;
+	}
+	
+	if (!MCCCheckHeader(header))
+		return 0;
+	
+	found = MapHeaderParse(header, len, &ctx->map);
+	if (found == -1 && !complete && len < MAPHEADER_MAX)
+		return -1;
+	if (found != 1)
+		MapHeaderDefaults(&ctx->map);
+	
+	if (ctx->size_cx) {
+		ctx->map.cx = ctx->size_cx;
+		ctx->map.cy = ctx->size_cy;
+		ctx->map.cz = ctx->size_cz;
+	}
+	
+	if (ctx->map.cx < MAP_BLOCKSIZE || ctx->map.cy < MAP_BLOCKSIZE ||
+		ctx->map.cz < MAP_BLOCKSIZE) {
+		fprintf(stderr, "Map is smaller than a block (%dx%dx%d)\n",
+			ctx->map.cx, ctx->map.cy, ctx->map.cz);
+		return 0;
+	}
+	if (ctx->map.cx % MAP_BLOCKSIZE || ctx->map.cy % MAP_BLOCKSIZE ||
+		ctx->map.cz % MAP_BLOCKSIZE) {
+		fprintf(stderr, "WARNING: Map size %dx%dx%d isn't a multiple of %d, "
+			"leaving out the partial blocks\n", ctx->map.cx, ctx->map.cy,
+			ctx->map.cz, MAP_BLOCKSIZE);
+	}
+	
+	return MCCSelectBlocks(ctx);
+}
+
+
+static size_t MCCMapNodes(LPMCCONTEXT ctx) {
+	return (size_t)ctx->map.cx * ctx->map.cy * ctx->map.cz;
+}
+
+
+static long MCCPrefixReadProc(void *arg, void *buf, size_t len) {
+	PREFIXREADER *prefix = arg;
+	
+	if (!prefix->len)
+		return prefix->reader(prefix->arg, buf, len);
+	
+	if (len > prefix->len)
+		len = prefix->len;
+	memcpy(buf, prefix->buf, len);
+	prefix->buf += len;
+	prefix->len -= len;
+	return len;
+}
+
+
+static int MCCSelectBlocks(LPMCCONTEXT ctx) {
+	if (!ctx->has_region) {
+		VolumeFullBox(&ctx->box, &ctx->map);
+	} else {
+		ctx->box = ctx->region;
+		if (!VolumeClipBox(&ctx->box, &ctx->map)) {
+			fprintf(stderr, "Region does not overlap the map\n");
+			return 0;
+		}
+	}
+	
+	ctx->outbox.min.X = ctx->box.min.X * ctx->scale;
+	ctx->outbox.min.Y = ctx->box.min.Y * ctx->scale;
+	ctx->outbox.min.Z = ctx->box.min.Z * ctx->scale;
+	ctx->outbox.max.X = (ctx->box.max.X + 1) * ctx->scale - 1;
+	ctx->outbox.max.Y = (ctx->box.max.Y + 1) * ctx->scale - 1;
+	ctx->outbox.max.Z = (ctx->box.max.Z + 1) * ctx->scale - 1;
+	
+	// Block positions are 12 bit signed in the database key, and walls go
+	// one block past the box
+	if (ctx->outbox.max.X >= MAP_MAX_BLOCKPOS ||
+		ctx->outbox.max.Y >= MAP_MAX_BLOCKPOS ||
+		ctx->outbox.max.Z >= MAP_MAX_BLOCKPOS) {
+		fprintf(stderr, "Scaled map is too large for the world\n");
+		return 0;
+	}
+	
+	MCCSelectSpawn(ctx);
+	return 1;
+}
+
+
+static void MCCSelectSpawn(LPMCCONTEXT ctx) {
+	const MAPINFO *map = &ctx->map;
+	const BLOCKBOX *box = &ctx->outbox;
+	int x, y, z;
+	
+	// Source X runs opposite to output X; see CopyMapBlockFromMC
+	if (ctx->has_spawn) {
+		x = ctx->spawn_x;
+		y = ctx->spawn_y;
+		z = ctx->spawn_z;
+	} else if (map->has_spawn) {
+		x = (map->cx - 1 - map->spawn_x) * ctx->scale + ctx->scale / 2;
+		y = map->spawn_y * ctx->scale + ctx->scale / 2;
+		z = map->spawn_z * ctx->scale + ctx->scale / 2;
+	} else {
+		x = map->cx * ctx->scale / 2;
+		y = map->cy * ctx->scale / 2;
+		z = map->cz * ctx->scale / 2;
+	}
+	
+	ctx->spawn_block.X = NodeToBlock(x);
+	ctx->spawn_block.Y = NodeToBlock(y);
+	ctx->spawn_block.Z = NodeToBlock(z);
+	
+	// A spawn outside the region grows from the nearest block in it
+	if (ctx->spawn_block.X < box->min.X) ctx->spawn_block.X = box->min.X;
+	if (ctx->spawn_block.Y < box->min.Y) ctx->spawn_block.Y = box->min.Y;
+	if (ctx->spawn_block.Z < box->min.Z) ctx->spawn_block.Z = box->min.Z;
+	if (ctx->spawn_block.X > box->max.X) ctx->spawn_block.X = box->max.X;
+	if (ctx->spawn_block.Y > box->max.Y) ctx->spawn_block.Y = box->max.Y;
+	if (ctx->spawn_block.Z > box->max.Z) ctx->spawn_block.Z = box->max.Z;
+}
+
+
+// With prev, only the blocks that changed since it was converted are written.
+// With sync, the levels of detail are kept for the next sync to compare with.
+static int MCCConvertNodes(LPMCCONTEXT ctx, LPMCVOLUME vol, const MCVOLUME *prev, int sync) {
+	MINIMAP minimap;
+	unsigned long nliquid;
+	int i, success;
+	double start = TimeNow();
+	
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	ctx->throttle_start = start;
+	ctx->ready_done = 0;
+	
+	if (ctx->merge && ctx->sink != DBSinkProc) {
+		fprintf(stderr, "Merging needs the database sink\n");
+		return 0;
+	}
+	if (ctx->merge && ctx->ntargets) {
+		fprintf(stderr, "Merging can't be combined with extra targets\n");
+		return 0;
+	}
+	if (ctx->nlods && (ctx->has_region || ctx->scale != 1)) {
+		fprintf(stderr, "Levels of detail need the whole map at scale 1\n");
+		return 0;
+	}
+	
+	if (ctx->settle_liquids && !LiquidSettle(ctx, vol))
+		return 0;
+	
+	if (ctx->autotune != MCC_TUNE_OFF && !prev) {
+		if (!AutotuneRun(ctx, vol))
+			return 0;
+		nliquid = ctx->stats.nliquid;
+		memset(&ctx->stats, 0, sizeof(ctx->stats));
+		ctx->stats.nliquid = nliquid;
+		start = TimeNow();
+		ctx->throttle_start = start;
+	}
+	
+	if (ctx->estimate > 0.0) {
+		success = EstimateConversion(ctx, vol, &ctx->est);
+		ctx->stats.elapsed = TimeNow() - start;
+		return success;
+	}
+	
+	if (!MCCSyncTargets(ctx))
+		return 0;
+	
+	// The cache is only trusted while this context is the sole writer
+	if (!ctx->merge || ctx->live)
+		MergeCacheClear(&ctx->cache);
+	
+	if (ctx->minimap_filename)
+		MinimapStart(&minimap, vol, ctx->minimap_filename);
+	
+	if (prev) {
+		success = ConvertChangedBlocks(ctx, vol, prev);
+	} else {
+		success = ConvertMCToMT(ctx, vol);
+		if (success && ctx->walls)
+			success = CreateWalls(ctx);
+	}
+	
+	if (ctx->db && !DBCommit(ctx))
+		success = 0;
+	for (i = 0; i != ctx->ntargets; i++) {
+		if (ctx->targets[i]->db && !DBCommit(ctx->targets[i]))
+			success = 0;
+	}
+	if (success && ctx->ready_filename && !ctx->ready_done && !prev)
+		success = SignalReady(ctx);
+	if (success && ctx->nlods)
+		success = MCCConvertLods(ctx, vol, sync);
+	
+	if (ctx->minimap_filename && !MinimapFinish(&minimap))
+		fprintf(stderr, "WARNING: Minimap was not written\n");
+	
+	ctx->stats.elapsed = TimeNow() - start;
+	return success;
+}
+
+
+static int MCCReadFully(MCCREADPROC reader, void *arg, u8 *buf, size_t len) {
+	while (len) {
+		long nread = reader(arg, buf, len);
+		if (nread <= 0)
+			return 0;
+		
+		buf += nread;
+		len -= nread;
+	}
+	
+	return 1;
+}
+
+
+static void MCCFreeThreads(LPMCCONTEXT ctx) {
+	int i;
+	
+	WorkPoolDestroy(ctx->pool);
+	ctx->pool = NULL;
+	
+	for (i = 0; i != ctx->nthreads; i++)
+		SerializerFree(&ctx->ser[i]);
+	free(ctx->ser);
+	ctx->ser      = NULL;
+	ctx->nthreads = 0;
+}
+
+
+// Templates hold blocks compressed with the settings of the time
+static void MCCFreeTemplates(LPMCCONTEXT ctx) {
+	int i;
+	
+	for (i = 0; i != WALL_COUNT; i++) {
+		FreeTemplate(ctx->wall_templates[i]);
+		ctx->wall_templates[i] = NULL;
+	}
+	for (i = 0; i != ARRAYLEN(ctx->uniform_templates); i++) {
+		FreeTemplate(ctx->uniform_templates[i]);
+		ctx->uniform_templates[i] = NULL;
+	}
+}
+
+
+static void MCCFreeSynced(LPMCCONTEXT ctx) {
+	if (!ctx->synced)
+		return;
+	
+	VolumeFree(ctx->synced);
+	free(ctx->synced);
+	ctx->synced = NULL;
+}
+
+
+static int MCCSameLayout(const MCVOLUME *a, const MCVOLUME *b) {
+	return a->map_cx == b->map_cx && a->map_cy == b->map_cy && a->map_cz == b->map_cz &&
+		   a->ox == b->ox && a->oy == b->oy && a->oz == b->oz &&
+		   a->cx == b->cx && a->cy == b->cy && a->cz == b->cz;
+}
+
+
+// Targets and levels of detail follow the settings of the context they were
+// added to, as they stand when a conversion starts
+static int MCCSyncChild(LPMCCONTEXT ctx, LPMCCONTEXT child) {
+	if (child->summary != ctx->summary || child->live != ctx->live ||
+		child->busy_timeout != ctx->busy_timeout ||
+		child->vfs_buffer != ctx->vfs_buffer)
+		DBClose(child);
+	
+	child->walls        = ctx->walls;
+	child->summary      = ctx->summary;
+	child->live         = ctx->live;
+	child->busy_timeout = ctx->busy_timeout;
+	child->vfs_buffer   = ctx->vfs_buffer;
+	child->batch_size   = ctx->batch_size;
+	child->txn_budget   = ctx->txn_budget;
+	child->rate_blocks  = ctx->rate_blocks;
+	child->rate_bytes   = ctx->rate_bytes;
+	child->throttle_start = ctx->throttle_start;
+	child->scale        = ctx->scale;
+	child->map          = ctx->map;
+	child->box          = ctx->box;
+	child->outbox       = ctx->outbox;
+	if (!MCCSetCompression(child, ctx->deflate_level, ctx->deflate_strategy))
+		return 0;
+	memset(&child->stats, 0, sizeof(child->stats));
+	
+	return 1;
+}
+
+
+static int MCCSyncTargets(LPMCCONTEXT ctx) {
+	int i;
+	
+	for (i = 0; i != ctx->ntargets; i++) {
+		if (!MCCSyncChild(ctx, ctx->targets[i]))
+			return 0;
+	}
+	
+	return 1;
+}
+
+
+// Level 1 is half the size of the map.  Unlike targets, levels serialize
+// their own blocks, so they get as many threads.
+static int MCCSyncLod(LPMCCONTEXT ctx, LPMCCONTEXT lod, const MCVOLUME *vol, int level) {
+	if (vol->cx < MAP_BLOCKSIZE || vol->cy < MAP_BLOCKSIZE || vol->cz < MAP_BLOCKSIZE) {
+		fprintf(stderr, "Map is too small for a 1/%d level of detail\n", 1 << level);
+		return 0;
+	}
+	
+	if (!MCCSyncChild(ctx, lod) || !MCCSetThreads(lod, ctx->nthreads))
+		return 0;
+	
+	lod->scale          = 1;
+	lod->has_region     = 0;
+	lod->spawn_first    = ctx->spawn_first;
+	lod->settle_liquids = ctx->settle_liquids;
+	if (lod->names != ctx->names) {
+		lod->names = ctx->names;
+		MCCFreeTemplates(lod);
+	}
+	
+	memset(&lod->map, 0, sizeof(lod->map));
+	lod->map.cx = vol->cx;
+	lod->map.cy = vol->cy;
+	lod->map.cz = vol->cz;
+	if (ctx->map.has_spawn) {
+		lod->map.has_spawn = 1;
+		lod->map.spawn_x = ctx->map.spawn_x >> level;
+		lod->map.spawn_y = ctx->map.spawn_y >> level;
+		lod->map.spawn_z = ctx->map.spawn_z >> level;
+	}
+	
+	return MCCSelectBlocks(lod);
+}
+
+
+// Each level is downsampled from the one before and converted as a map of
+// its own, so only two levels are held at once.  When syncing, every level is
+// kept in its context as well, and only its changed blocks are written.
+static int MCCConvertLods(LPMCCONTEXT ctx, const MCVOLUME *vol, int sync) {
+	LPMCCONTEXT lod;
+	const MCVOLUME *prev;
+	LPMCVOLUME cur = NULL, next;
+	int i, success = 1;
+	
+	for (i = 0; i != ctx->nlods && success; i++) {
+		lod  = ctx->lods[i];
+		next = malloc(sizeof(MCVOLUME));
+		success = next && LodDownsample(ctx, cur ? cur : vol, next);
+		if (cur && !sync) {
+			VolumeFree(cur);
+			free(cur);
+		}
+		if (!success) {
+			free(next);
+			cur = NULL;
+			break;
+		}
+		cur = next;
+		
+		prev = lod->synced;
+		if (!sync || (prev && !MCCSameLayout(prev, cur)))
+			prev = NULL;
+		success = MCCSyncLod(ctx, lod, cur, i + 1) &&
+			MCCConvertNodes(lod, cur, prev, sync);
+		
+		if (sync) {
+			MCCFreeSynced(lod);
+			lod->synced = cur;
+		}
+	}
+	
+	if (cur && !sync) {
+		VolumeFree(cur);
+		free(cur);
+	}
+	return success;
+}
+
+
+static s16 NodeToBlock(int n) {
+	return (n >= 0) ? n / MAP_BLOCKSIZE : -((-n + MAP_BLOCKSIZE - 1) / MAP_BLOCKSIZE);
+}
@@ -0,0 +1,130 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * libmcconvert.h -
+ *    Public interface for embedding the converter.  All state lives in the
+ *    converter context, so any number of contexts may be converting at once
+ *    as long as each is only used by one thread at a time.
+ */
+
+#ifndef LIBMCCONVERT_HEADER
+#define LIBMCCONVERT_HEADER
+
+#include <stddef.h>
+
+typedef struct _MCCONTEXT MCCONTEXT, *LPMCCONTEXT;
+
+// Reads up to len bytes of the map file into buf.  Returns the number of bytes
+// read, 0 at end of file, or -1 on error.
+typedef long (*MCCREADPROC)(void *arg, void *buf, size_t len);
+
+// Receives each serialized block along with its position key as used by the
+// Minetest `blocks` table.  Returns nonzero on success; a zero return aborts
+// the conversion.
+typedef int (*MCCSINKPROC)(void *arg, long long pos, const unsigned char *data, size_t len);
+
+typedef struct _MCCSTATS {
+	unsigned long nblocks;     // blocks handed to the sink
+	unsigned long long nbytes; // serialized bytes handed to the sink
+	double elapsed;            // seconds spent in the last conversion
+	unsigned long ntransactions;
+	unsigned long nbusy;       // writes retried after the database was busy
+	unsigned long nmerged;     // blocks overlaid onto existing ones
+	unsigned long nliquid;     // liquid nodes changed while settling
+} MCCSTATS;
+
+// Projection of a full conversion from a sample of blocks.  The _ci fields
+// are half the width of the 95% confidence interval.
+typedef struct _MCCESTIMATE {
+	unsigned long nsampled;
+	unsigned long nblocks;  // blocks that would be written, walls included
+	unsigned long nwalls;
+	double nbytes;
+	double nbytes_ci;
+	double seconds;         // wall-clock for serializing and inserting
+	double seconds_ci;
+	double serialize_seconds;
+	double insert_seconds;
+	int nthreads;
+} MCCESTIMATE;
+
+// Goals for MCCSetAutotune
+#define MCC_TUNE_OFF      0
+#define MCC_TUNE_FASTEST  1 // most blocks per second
+#define MCC_TUNE_SMALLEST 2 // smallest output not too much slower than the fastest
+
+// Settings worth choosing per host and map.  level and strategy are zlib's;
+// the rates are from the calibration sample, or 0 if none was run.
+typedef struct _MCCPROFILE {
+	int nthreads;
+	int batch_size;
+	int level;
+	int strategy;
+	double blocks_per_sec;
+	double bytes_per_block;
+} MCCPROFILE;
+
+LPMCCONTEXT MCCContextCreate(void);
+void MCCContextDestroy(LPMCCONTEXT ctx);
+
+void MCCSetOutputFile(LPMCCONTEXT ctx, const char *filename);
+void MCCSetSink(LPMCCONTEXT ctx, MCCSINKPROC sink, void *arg);
+void MCCSetWalls(LPMCCONTEXT ctx, int enable);
+void MCCSetMinimap(LPMCCONTEXT ctx, const char *filename);
+void MCCSetSummary(LPMCCONTEXT ctx, int enable);
+void MCCSetRegion(LPMCCONTEXT ctx, int x0, int y0, int z0,
+				int x1, int y1, int z1, int in_blocks);
+void MCCClearRegion(LPMCCONTEXT ctx);
+int MCCSetScale(LPMCCONTEXT ctx, int scale);
+void MCCSetMapSize(LPMCCONTEXT ctx, int cx, int cy, int cz);
+void MCCSetBatch(LPMCCONTEXT ctx, int nblocks, double budget_ms);
+void MCCSetLive(LPMCCONTEXT ctx, int busy_timeout_ms);
+void MCCSetVfsBuffer(LPMCCONTEXT ctx, int enable);
+void MCCSetRateLimit(LPMCCONTEXT ctx, double blocks_per_sec, double bytes_per_sec);
+void MCCSetMerge(LPMCCONTEXT ctx, int enable);
+void MCCSetPacked(LPMCCONTEXT ctx, int enable);
+void MCCSetSettleLiquids(LPMCCONTEXT ctx, int enable);
+int MCCSetMapping(LPMCCONTEXT ctx, const char *filename);
+int MCCAddTarget(LPMCCONTEXT ctx, const char *filename, const char *mapping);
+int MCCAddLod(LPMCCONTEXT ctx, const char *filename);
+int MCCSetThreads(LPMCCONTEXT ctx, int nthreads);
+int MCCSetCompression(LPMCCONTEXT ctx, int level, int strategy);
+void MCCSetAutotune(LPMCCONTEXT ctx, int goal, double slack_percent);
+void MCCGetProfile(LPMCCONTEXT ctx, MCCPROFILE *profile);
+int MCCLoadProfile(LPMCCONTEXT ctx, const char *filename);
+int MCCSaveProfile(LPMCCONTEXT ctx, const char *filename);
+void MCCSetSpawnFirst(LPMCCONTEXT ctx, int enable);
+void MCCSetSpawn(LPMCCONTEXT ctx, int x, int y, int z);
+void MCCSetReady(LPMCCONTEXT ctx, const char *filename, int radius);
+void MCCSetEstimate(LPMCCONTEXT ctx, double fraction);
+void MCCGetEstimate(LPMCCONTEXT ctx, MCCESTIMATE *est);
+
+int MCCConvertBuffer(LPMCCONTEXT ctx, const void *buf, size_t len);
+int MCCConvertReader(LPMCCONTEXT ctx, MCCREADPROC reader, void *arg);
+int MCCConvertFile(LPMCCONTEXT ctx, const char *filename);
+int MCCSyncFile(LPMCCONTEXT ctx, const char *filename);
+void MCCFinish(LPMCCONTEXT ctx);
+void MCCGetStats(LPMCCONTEXT ctx, MCCSTATS *stats);
+
+#endif // LIBMCCONVERT_HEADER
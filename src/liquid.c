@@ -0,0 +1,506 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * liquid.c -
+ *    Settling Classic's flowing water and lava before conversion, so the
+ *    server has no liquid left to transform when the world is first loaded
+ */
+
+#include "mcconvert.h"
+#include "liquid.h"
+#include "workpool.h"
+
+// Source nodes outside the volume are taken as the bedrock walls around it
+#define LIQUID_OUTSIDE 7
+
+// The volume is split into slabs of whole param2 pages along Y, one per
+// thread.  A slab only changes its own nodes; the planes just above and below
+// it are read from halo copies, which are brought up to date between passes,
+// waking any node next to a halo node that changed.
+typedef struct _LIQUIDSLAB {
+	LPMCVOLUME vol;
+	int y0, y1;      // source planes owned, y1 excluded
+	u8 *halo[2];     // planes y0 - 1 and y1 as of the last exchange, NULL at the volume's ends
+	u8 *halo2[2];    // and their param2
+	u8 *planes[4];   // scratch for LiquidSettleProc
+	
+	u32 *queue;      // slab-local indices of nodes to evaluate in this pass
+	u32 *next;       // and in the next
+	size_t nqueue, nnext, maxqueue;
+	u8 *queued;      // bit per slab node, set while it's in next
+	
+	unsigned long nsettled; // flows that became sources
+	unsigned long nchanged; // nodes the transform changed
+	int failed;
+} LIQUIDSLAB, *LPLIQUIDSLAB;
+
+typedef struct _LIQUIDPASS {
+	LPLIQUIDSLAB slabs;
+	int nslabs;
+} LIQUIDPASS, *LPLIQUIDPASS;
+
+// Neighbours in the order Minetest's liquid transform visits them, the one
+// above first and the one below last
+static const int liquid_dirs[6][3] = {
+	{0, 1, 0}, {0, 0, 1}, {1, 0, 0}, {0, 0, -1}, {-1, 0, 0}, {0, -1, 0}
+};
+
+static void LiquidExchangeProc(void *arg, int item, int worker);
+static void LiquidSettleProc(void *arg, int item, int worker);
+static void LiquidDrainProc(void *arg, int item, int worker);
+static u8 LiquidTransform(LPLIQUIDSLAB slab, int x, int y, int z, u8 id, u8 *param2);
+static u8 SlabNode(LPLIQUIDSLAB slab, int x, int y, int z, u8 *param2);
+static void SlabPush(LPLIQUIDSLAB slab, int x, int y, int z);
+static void ReadPlane(const MCVOLUME *vol, int y, u8 *ids);
+static int PlaneHas(const u8 *ids, size_t n, u8 a, u8 b);
+static int SlabInit(LPLIQUIDSLAB slab, LPMCVOLUME vol, int y0, int y1);
+static void SlabFree(LPLIQUIDSLAB slab);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Flowing liquid with nothing but solid or liquid beside and below it can't
+// go anywhere, so it becomes a source; the rest is drained to air.  Liquid
+// is then left to flow from the sources by Minetest's own rules until nothing
+// changes, leaving param2 with the levels and falling flags the server would
+// arrive at.  Runs across the context's threads.
+int LiquidSettle(LPMCCONTEXT ctx, LPMCVOLUME vol) {
+	LIQUIDPASS pass;
+	int npages, i, round, pending, success = 1;
+	
+	if (!VolumeMakeWritable(vol))
+		return 0;
+	if (!ctx->pool)
+		ctx->pool = WorkPoolCreate(ctx->nthreads);
+	if (!ctx->pool) {
+		fprintf(stderr, "Out of memory settling liquids\n");
+		return 0;
+	}
+	
+	// Slabs are whole pages high, so no two threads share a param2 page or,
+	// in a packed volume, a byte
+	npages = (vol->cy + VOLUME_PAGE_SIZE - 1) / VOLUME_PAGE_SIZE;
+	pass.nslabs = (ctx->nthreads < npages) ? ctx->nthreads : npages;
+	pass.slabs  = calloc(pass.nslabs, sizeof(LIQUIDSLAB));
+	if (!pass.slabs)
+		return 0;
+	
+	for (i = 0; i != pass.nslabs && success; i++) {
+		int y0 = npages * i / pass.nslabs * VOLUME_PAGE_SIZE;
+		int y1 = npages * (i + 1) / pass.nslabs * VOLUME_PAGE_SIZE;
+		
+		success = SlabInit(&pass.slabs[i], vol, vol->oy + y0,
+			vol->oy + ((y1 < vol->cy) ? y1 : vol->cy));
+	}
+	if (!success) {
+		fprintf(stderr, "Out of memory settling liquids\n");
+		goto done;
+	}
+	
+	WorkPoolRun(ctx->pool, LiquidExchangeProc, &pass, pass.nslabs);
+	WorkPoolRun(ctx->pool, LiquidSettleProc, &pass, pass.nslabs);
+	for (round = 0; ; round++) {
+		WorkPoolRun(ctx->pool, LiquidExchangeProc, &pass, pass.nslabs);
+		
+		pending = 0;
+		for (i = 0; i != pass.nslabs; i++) {
+			pending |= (pass.slabs[i].nnext != 0);
+			success &= !pass.slabs[i].failed;
+		}
+		if (!success) {
+			fprintf(stderr, "Out of memory settling liquids\n");
+			break;
+		}
+		if (!pending)
+			break;
+		if (round == LIQUID_MAX_ROUNDS) {
+			fprintf(stderr, "WARNING: Liquids still changing after %d passes, left as they are\n",
+				LIQUID_MAX_ROUNDS);
+			break;
+		}
+		
+		WorkPoolRun(ctx->pool, LiquidDrainProc, &pass, pass.nslabs);
+	}
+	
+	for (i = 0; i != pass.nslabs; i++)
+		ctx->stats.nliquid += pass.slabs[i].nsettled + pass.slabs[i].nchanged;
+
+done:
+	for (i = 0; i != pass.nslabs; i++)
+		SlabFree(&pass.slabs[i]);
+	free(pass.slabs);
+	return success;
+}
+
+
+// Brings the halo planes up to date and wakes the slab's nodes next to any
+// halo node that changed.  The first exchange fills the halos.
+static void LiquidExchangeProc(void *arg, int item, int worker) {
+	LPLIQUIDSLAB slab = &((LPLIQUIDPASS)arg)->slabs[item];
+	LPMCVOLUME vol = slab->vol;
+	u8 *plane = slab->planes[0];
+	int h, x, y, z, edge;
+	size_t i;
+	u8 p2;
+	
+	for (h = 0; h != 2; h++) {
+		if (!slab->halo[h])
+			continue;
+		
+		y    = h ? slab->y1 : slab->y0 - 1;
+		edge = h ? slab->y1 - 1 : slab->y0;
+		ReadPlane(vol, y, plane);
+		
+		i = 0;
+		for (z = vol->oz; z != vol->oz + vol->cz; z++) {
+			for (x = vol->ox; x != vol->ox + vol->cx; x++, i++) {
+				p2 = VolumeParam2(vol, x, y, z);
+				if (plane[i] == slab->halo[h][i] && p2 == slab->halo2[h][i])
+					continue;
+				
+				slab->halo[h][i]  = plane[i];
+				slab->halo2[h][i] = p2;
+				SlabPush(slab, x, edge, z);
+			}
+		}
+	}
+}
+
+
+// Decides each flowing node from the nodes around it as read, working down
+// from the top plane so the plane below is still as read when it's needed.
+// Air that a source could flow into is queued along the way.
+static void LiquidSettleProc(void *arg, int item, int worker) {
+	LPLIQUIDSLAB slab = &((LPLIQUIDPASS)arg)->slabs[item];
+	LPMCVOLUME vol = slab->vol;
+	size_t plane = (size_t)vol->cx * vol->cz;
+	u8 *up, *cur, *dec, *below, *tmp;
+	int x, y, z, open, up_sources, sources;
+	size_t i;
+	u8 id;
+	
+	up    = slab->halo[1];
+	up_sources = up && PlaneHas(up, plane, LIQUID_WATER_SOURCE, LIQUID_LAVA_SOURCE);
+	cur   = slab->planes[0];
+	dec   = slab->planes[1];
+	below = slab->planes[2];
+	ReadPlane(vol, slab->y1 - 1, cur);
+	
+	for (y = slab->y1 - 1; y >= slab->y0; y--) {
+		if (y - 1 < vol->oy)
+			memset(below, LIQUID_OUTSIDE, plane);
+		else if (y - 1 < slab->y0)
+			memcpy(below, slab->halo[0], plane);
+		else
+			ReadPlane(vol, y - 1, below);
+		
+		// Most planes are all rock or all sky, and are passed over
+		memcpy(dec, cur, plane);
+		i = PlaneHas(cur, plane, LIQUID_WATER_FLOWING, LIQUID_LAVA_FLOWING) ? 0 : plane;
+		for (z = vol->oz; z != vol->oz + vol->cz && i != plane; z++) {
+			for (x = vol->ox; x != vol->ox + vol->cx; x++, i++) {
+				id = cur[i];
+				if (!LiquidIsFlowing(id))
+					continue;
+				
+				open = !below[i] ||
+					(x != vol->ox && !cur[i - 1]) ||
+					(x != vol->ox + vol->cx - 1 && !cur[i + 1]) ||
+					(z != vol->oz && !cur[i - vol->cx]) ||
+					(z != vol->oz + vol->cz - 1 && !cur[i + vol->cx]);
+				if (open) {
+					dec[i] = 0;
+					VolumeSetNode(vol, x, y, z, 0);
+					SlabPush(slab, x, y, z);
+				} else {
+					dec[i] = id + 1; // the source
+					VolumeSetNode(vol, x, y, z, id + 1);
+					slab->nsettled++;
+				}
+			}
+		}
+		
+		// Sources only fill air beside and below them
+		sources = PlaneHas(dec, plane, LIQUID_WATER_SOURCE, LIQUID_LAVA_SOURCE);
+		i = (sources || up_sources) ? 0 : plane;
+		for (z = vol->oz; z != vol->oz + vol->cz && i != plane; z++) {
+			for (x = vol->ox; x != vol->ox + vol->cx; x++, i++) {
+				if (dec[i])
+					continue;
+				if ((up && LiquidIsSource(up[i])) ||
+					(x != vol->ox && LiquidIsSource(dec[i - 1])) ||
+					(x != vol->ox + vol->cx - 1 && LiquidIsSource(dec[i + 1])) ||
+					(z != vol->oz && LiquidIsSource(dec[i - vol->cx])) ||
+					(z != vol->oz + vol->cz - 1 && LiquidIsSource(dec[i + vol->cx])))
+					SlabPush(slab, x, y, z);
+			}
+		}
+		
+		// This plane as decided is above the next, and the plane below is
+		// next.  The plane above is done with, unless it's the halo.
+		tmp   = (up && up != slab->halo[1]) ? up : slab->planes[3];
+		up    = dec;
+		up_sources = sources;
+		dec   = tmp;
+		tmp   = cur;
+		cur   = below;
+		below = tmp;
+	}
+}
+
+
+// Evaluates queued nodes until the slab has nothing left to do on its own
+static void LiquidDrainProc(void *arg, int item, int worker) {
+	LPLIQUIDSLAB slab = &((LPLIQUIDPASS)arg)->slabs[item];
+	LPMCVOLUME vol = slab->vol;
+	size_t plane = (size_t)vol->cx * vol->cz;
+	size_t i;
+	u32 *tmp, idx;
+	int d, x, y, z;
+	u8 id, p2, new_id, new_p2;
+	
+	while (slab->nnext && !slab->failed) {
+		tmp = slab->queue;
+		slab->queue  = slab->next;
+		slab->next   = tmp;
+		slab->nqueue = slab->nnext;
+		slab->nnext  = 0;
+		
+		for (i = 0; i != slab->nqueue; i++) {
+			idx = slab->queue[i];
+			slab->queued[idx >> 3] &= ~(1 << (idx & 7));
+			
+			x = vol->ox + idx % vol->cx;
+			z = vol->oz + (idx % plane) / vol->cx;
+			y = slab->y0 + idx / plane;
+			
+			// Sources and solid nodes never change
+			id = VolumeNode(vol, x, y, z);
+			if (id && !LiquidIsFlowing(id))
+				continue;
+			
+			p2 = VolumeParam2(vol, x, y, z);
+			new_id = LiquidTransform(slab, x, y, z, id, &new_p2);
+			if (new_id == id && new_p2 == p2)
+				continue;
+			
+			VolumeSetNode(vol, x, y, z, new_id);
+			if (!VolumeSetParam2(vol, x, y, z, new_p2)) {
+				slab->failed = 1;
+				return;
+			}
+			slab->nchanged++;
+			if (LiquidIsSource(new_id))
+				slab->nsettled++;
+			
+			for (d = 0; d != 6; d++)
+				SlabPush(slab, x + liquid_dirs[d][0], y + liquid_dirs[d][1], z + liquid_dirs[d][2]);
+		}
+	}
+}
+
+
+// One step of Minetest's liquid transform (transformLiquids in map.cpp) for
+// air or flowing liquid, with minetest_game's range of 8 for both liquids and
+// only water renewable.  Viscosity is left out; it only sets the pace.
+static u8 LiquidTransform(LPLIQUIDSLAB slab, int x, int y, int z, u8 id, u8 *param2) {
+	int kind = LiquidIsFlowing(id) ? id : 0;
+	int nsources = 0, flowing_down = 0, level = -1;
+	int d, upper, lower, nlevel;
+	u8 nid, np2;
+	
+	for (d = 0; d != 6; d++) {
+		upper = (d == 0);
+		lower = (d == 5);
+		nid = SlabNode(slab, x + liquid_dirs[d][0], y + liquid_dirs[d][1],
+			z + liquid_dirs[d][2], &np2);
+		
+		if (!nid) {
+			if (lower)
+				flowing_down = 1;
+		} else if (LiquidIsSource(nid)) {
+			if (!kind)
+				kind = nid - 1;
+			if (nid - 1 == kind && !lower)
+				nsources++;
+		} else if (LiquidIsFlowing(nid)) {
+			// Liquid falling past on the same level can't flow in here
+			if (!kind && (!upper && !lower) && (np2 & LIQUID_FLOW_DOWN))
+				continue;
+			if (!kind)
+				kind = nid;
+			if (nid != kind)
+				continue;
+			
+			nlevel = np2 & LIQUID_LEVEL_MASK;
+			if (lower) {
+				flowing_down = 1;
+			} else if (upper) {
+				if (nlevel + LIQUID_DROP_BOOST > level)
+					level = (nlevel + LIQUID_DROP_BOOST < LIQUID_LEVEL_MAX) ?
+						nlevel + LIQUID_DROP_BOOST : LIQUID_LEVEL_MAX;
+			} else if (!(np2 & LIQUID_FLOW_DOWN) && nlevel > 0 && nlevel - 1 > level) {
+				level = nlevel - 1;
+			}
+		}
+	}
+	
+	*param2 = 0;
+	if (!kind)
+		return 0;
+	if (nsources >= 2 && kind == LIQUID_WATER_FLOWING)
+		return LIQUID_WATER_SOURCE;
+	if (nsources >= 1)
+		level = LIQUID_LEVEL_MAX;
+	if (level < 0)
+		return 0;
+	
+	*param2 = (flowing_down ? LIQUID_FLOW_DOWN : 0) | level;
+	return kind;
+}
+
+
+// The node as this slab sees it: its own planes from the volume, the planes
+// beyond them from the halo, and bedrock outside the volume
+static u8 SlabNode(LPLIQUIDSLAB slab, int x, int y, int z, u8 *param2) {
+	LPMCVOLUME vol = slab->vol;
+	size_t i;
+	int h;
+	
+	*param2 = 0;
+	if (x < vol->ox || x >= vol->ox + vol->cx ||
+		y < vol->oy || y >= vol->oy + vol->cy ||
+		z < vol->oz || z >= vol->oz + vol->cz)
+		return LIQUID_OUTSIDE;
+	
+	if (y < slab->y0 || y >= slab->y1) {
+		h = (y >= slab->y1);
+		i = (size_t)(z - vol->oz) * vol->cx + (x - vol->ox);
+		*param2 = slab->halo2[h][i];
+		return slab->halo[h][i];
+	}
+	
+	*param2 = VolumeParam2(vol, x, y, z);
+	return VolumeNode(vol, x, y, z);
+}
+
+
+// Queues a node of this slab for the next pass, once
+static void SlabPush(LPLIQUIDSLAB slab, int x, int y, int z) {
+	LPMCVOLUME vol = slab->vol;
+	u32 idx, *next;
+	
+	if (x < vol->ox || x >= vol->ox + vol->cx ||
+		y < slab->y0 || y >= slab->y1 ||
+		z < vol->oz || z >= vol->oz + vol->cz)
+		return;
+	
+	idx = ((u32)(y - slab->y0) * vol->cz + (z - vol->oz)) * vol->cx + (x - vol->ox);
+	if (slab->queued[idx >> 3] & (1 << (idx & 7)))
+		return;
+	
+	if (slab->nnext == slab->maxqueue) {
+		next = realloc(slab->next, 2 * slab->maxqueue * sizeof(u32));
+		if (!next) {
+			slab->failed = 1;
+			return;
+		}
+		slab->next = next;
+		slab->maxqueue *= 2;
+		
+		// Both queues are swapped back and forth, so keep them the same size
+		next = realloc(slab->queue, slab->maxqueue * sizeof(u32));
+		if (!next) {
+			slab->failed = 1;
+			return;
+		}
+		slab->queue = next;
+	}
+	
+	slab->queued[idx >> 3] |= 1 << (idx & 7);
+	slab->next[slab->nnext++] = idx;
+}
+
+
+static void ReadPlane(const MCVOLUME *vol, int y, u8 *ids) {
+	size_t first = VolumeIndex(vol, vol->ox, y, vol->oz);
+	size_t n = (size_t)vol->cx * vol->cz;
+	
+	if (vol->packed)
+		VolumeUnpack(vol->alloc, first, n, ids);
+	else
+		memcpy(ids, vol->data + first, n);
+}
+
+
+static int PlaneHas(const u8 *ids, size_t n, u8 a, u8 b) {
+	return memchr(ids, a, n) || memchr(ids, b, n);
+}
+
+
+static int SlabInit(LPLIQUIDSLAB slab, LPMCVOLUME vol, int y0, int y1) {
+	size_t plane = (size_t)vol->cx * vol->cz;
+	int h, i;
+	
+	slab->vol = vol;
+	slab->y0  = y0;
+	slab->y1  = y1;
+	
+	for (h = 0; h != 2; h++) {
+		if (h ? (y1 == vol->oy + vol->cy) : (y0 == vol->oy))
+			continue;
+		slab->halo[h]  = calloc(plane, 1);
+		slab->halo2[h] = calloc(plane, 1);
+		if (!slab->halo[h] || !slab->halo2[h])
+			return 0;
+	}
+	for (i = 0; i != 4; i++) {
+		slab->planes[i] = malloc(plane);
+		if (!slab->planes[i])
+			return 0;
+	}
+	
+	slab->maxqueue = 4096;
+	slab->queue  = malloc(slab->maxqueue * sizeof(u32));
+	slab->next   = malloc(slab->maxqueue * sizeof(u32));
+	slab->queued = calloc(plane * (y1 - y0) / 8 + 1, 1);
+	
+	return slab->queue && slab->next && slab->queued;
+}
+
+
+static void SlabFree(LPLIQUIDSLAB slab) {
+	int i;
+	
+	for (i = 0; i != 2; i++) {
+		free(slab->halo[i]);
+		free(slab->halo2[i]);
+	}
+	for (i = 0; i != 4; i++)
+		free(slab->planes[i]);
+	free(slab->queue);
+	free(slab->next);
+	free(slab->queued);
+}
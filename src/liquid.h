@@ -0,0 +1,57 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIQUID_HEADER
+#define LIQUID_HEADER
+
+// Classic liquids; the flowing kinds are what a neighbouring source or flow
+// turns air into
+#define LIQUID_WATER_FLOWING 8
+#define LIQUID_WATER_SOURCE  9
+#define LIQUID_LAVA_FLOWING  10
+#define LIQUID_LAVA_SOURCE   11
+
+// Minetest's layout of a flowing liquid's param2
+#define LIQUID_LEVEL_MASK 0x07
+#define LIQUID_LEVEL_MAX  7
+#define LIQUID_FLOW_DOWN  0x08
+
+// Flowing liquid falling onto liquid gains this many levels, as with
+// WATER_DROP_BOOST in Minetest
+#define LIQUID_DROP_BOOST 4
+
+// Passes of halo exchange between slabs before giving up on liquid that
+// keeps changing
+#define LIQUID_MAX_ROUNDS 4096
+
+static inline int LiquidIsFlowing(u8 id) {
+	return id == LIQUID_WATER_FLOWING || id == LIQUID_LAVA_FLOWING;
+}
+
+static inline int LiquidIsSource(u8 id) {
+	return id == LIQUID_WATER_SOURCE || id == LIQUID_LAVA_SOURCE;
+}
+
+int LiquidSettle(LPMCCONTEXT ctx, LPMCVOLUME vol);
+
+#endif // LIQUID_HEADER
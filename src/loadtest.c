@@ -0,0 +1,493 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * loadtest.c - 
+ *    mcloadtest, which reads a converted world back the way a server loads
+ *    it, following players walking about, joining at spawn or teleporting,
+ *    and reports how long each block took to fetch and decode.
+ */
+
+#include "mcconvert.h"
+#include "mapcontent.h"
+#include "merge.h"
+
+#include <getopt.h>
+#include <pthread.h>
+
+#define LOADTEST_THREADS 4
+#define LOADTEST_STEPS   200 // per thread: steps walked, joins or teleports
+#define LOADTEST_RADIUS  3   // blocks loaded around a player, in every direction
+
+// Chance per step of a walking player turning
+#define LOADTEST_TURN_CHANCE 0.125
+
+enum {
+	PATTERN_WALK,
+	PATTERN_RADIUS,
+	PATTERN_TELEPORT
+};
+
+typedef struct _LOADTEST {
+	const char *filename;
+	int pattern;
+	int nthreads;
+	int nsteps;
+	int radius;
+	int cache_kib;   // SQLite page cache per connection, 0 for its default
+	u64 seed;
+	BLOCKBOX extent; // of the blocks in the world
+	v3s16 spawn;
+} LOADTEST, *LPLOADTEST;
+
+// One simulated player, on its own connection
+typedef struct _LOADWORKER {
+	const LOADTEST *test;
+	pthread_t thread;
+	sqlite3 *db;
+	sqlite3_stmt *read;
+	SERIALIZER ser;
+	u64 rng;
+	double *latency; // seconds for each block loaded
+	size_t nloads;
+	size_t maxloads;
+	unsigned long nmissing;
+	unsigned long nundecoded;
+	unsigned long long nbytes;
+	int status;
+} LOADWORKER, *LPLOADWORKER;
+
+static const char *pattern_names[] = {"walk", "radius", "teleport"};
+
+static const struct option long_options[] = {
+	{"pattern", required_argument, NULL, 'p'},
+	{"threads", required_argument, NULL, 't'},
+	{"steps",   required_argument, NULL, 'n'},
+	{"radius",  required_argument, NULL, 'r'},
+	{"spawn",   required_argument, NULL, 's'},
+	{"cache",   required_argument, NULL, 'c'},
+	{"seed",    required_argument, NULL, 'S'},
+	{NULL, 0, NULL, 0}
+};
+
+static void Usage(const char *progname);
+static int FindExtent(LPLOADTEST test);
+static void *WorkerProc(void *arg);
+static int WorkerOpen(LPLOADWORKER w);
+static void WorkerClose(LPLOADWORKER w);
+static int LoadAround(LPLOADWORKER w, v3s16 at, const v3s16 *prev);
+static int LoadBlock(LPLOADWORKER w, s16 x, s16 y, s16 z);
+static int RandomInt(u64 *state, int n);
+static int CompareDouble(const void *a, const void *b);
+static void Report(const LOADTEST *test, LPLOADWORKER workers, double elapsed);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[]) {
+	LOADTEST test;
+	LPLOADWORKER workers;
+	int c, i, x, y, z, nstarted, has_spawn = 0, success = 1;
+	double start;
+	char end;
+	
+	memset(&test, 0, sizeof(test));
+	test.pattern  = PATTERN_WALK;
+	test.nthreads = LOADTEST_THREADS;
+	test.nsteps   = LOADTEST_STEPS;
+	test.radius   = LOADTEST_RADIUS;
+	test.seed     = 1;
+	
+	while ((c = getopt_long(argc, argv, "p:t:n:r:s:c:S:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'p':
+				for (i = 0; i != ARRAYLEN(pattern_names); i++) {
+					if (!strcmp(optarg, pattern_names[i]))
+						break;
+				}
+				if (i == ARRAYLEN(pattern_names)) {
+					fprintf(stderr, "Unknown pattern '%s'\n", optarg);
+					return 1;
+				}
+				test.pattern = i;
+				break;
+			case 't':
+				test.nthreads = atoi(optarg);
+				break;
+			case 'n':
+				test.nsteps = atoi(optarg);
+				break;
+			case 'r':
+				test.radius = atoi(optarg);
+				break;
+			case 's':
+				if (sscanf(optarg, "%d,%d,%d%c", &x, &y, &z, &end) != 3) {
+					fprintf(stderr, "Invalid spawn '%s', expected x,y,z\n", optarg);
+					return 1;
+				}
+				test.spawn.X = x;
+				test.spawn.Y = y;
+				test.spawn.Z = z;
+				has_spawn = 1;
+				break;
+			case 'c':
+				test.cache_kib = atoi(optarg);
+				break;
+			case 'S':
+				test.seed = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				Usage(argv[0]);
+				return 1;
+		}
+	}
+	
+	if (optind >= argc) {
+		Usage(argv[0]);
+		return 1;
+	}
+	test.filename = argv[optind];
+	if (test.nthreads < 1 || test.nsteps < 1 || test.radius < 0) {
+		fprintf(stderr, "Threads and steps must be positive, radius not negative\n");
+		return 1;
+	}
+	
+	if (!FindExtent(&test))
+		return 1;
+	if (!has_spawn) {
+		test.spawn.X = (test.extent.min.X + test.extent.max.X) / 2;
+		test.spawn.Y = (test.extent.min.Y + test.extent.max.Y) / 2;
+		test.spawn.Z = (test.extent.min.Z + test.extent.max.Z) / 2;
+	}
+	
+	workers = calloc(test.nthreads, sizeof(LOADWORKER));
+	for (i = 0; i != test.nthreads; i++) {
+		workers[i].test = &test;
+		workers[i].rng  = test.seed + i * 0x9E3779B97F4A7C15ULL;
+		if (!WorkerOpen(&workers[i])) {
+			while (i >= 0)
+				WorkerClose(&workers[i--]);
+			free(workers);
+			return 1;
+		}
+	}
+	
+	// Connections are all open before the clock starts
+	start = TimeNow();
+	for (nstarted = 0; nstarted != test.nthreads; nstarted++) {
+		if (pthread_create(&workers[nstarted].thread, NULL, WorkerProc, &workers[nstarted])) {
+			fprintf(stderr, "Failed to start load thread\n");
+			success = 0;
+			break;
+		}
+	}
+	for (i = 0; i != nstarted; i++) {
+		pthread_join(workers[i].thread, NULL);
+		success &= workers[i].status;
+	}
+	
+	if (success)
+		Report(&test, workers, TimeNow() - start);
+	
+	for (i = 0; i != test.nthreads; i++)
+		WorkerClose(&workers[i]);
+	free(workers);
+	
+	return !success;
+}
+
+
+static void Usage(const char *progname) {
+	fprintf(stderr, "usage: %s [options] <world.sqlite>\n"
+		"  -p, --pattern <p>     walk (default), radius (joins at spawn) or teleport\n"
+		"  -t, --threads <n>     players loading at once (default %d)\n"
+		"  -n, --steps <n>       steps, joins or teleports per player (default %d)\n"
+		"  -r, --radius <n>      blocks loaded around a player (default %d)\n"
+		"  -s, --spawn <x,y,z>   spawn block (default: middle of the world)\n"
+		"  -c, --cache <KiB>     SQLite page cache per connection\n"
+		"  -S, --seed <n>        random seed\n",
+		progname, LOADTEST_THREADS, LOADTEST_STEPS, LOADTEST_RADIUS);
+}
+
+
+static int FindExtent(LPLOADTEST test) {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	BLOCKBOX *e = &test->extent;
+	unsigned long n = 0;
+	v3s16 pos;
+	
+	if (sqlite3_open_v2(test->filename, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "SELECT `pos` FROM `blocks`", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Could not read %s: %s\n", test->filename, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return 0;
+	}
+	
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		pos = MapBlockIntegerToPos(sqlite3_column_int64(stmt, 0));
+		if (!n++) {
+			e->min = pos;
+			e->max = pos;
+			continue;
+		}
+		if (pos.X < e->min.X) e->min.X = pos.X;
+		if (pos.Y < e->min.Y) e->min.Y = pos.Y;
+		if (pos.Z < e->min.Z) e->min.Z = pos.Z;
+		if (pos.X > e->max.X) e->max.X = pos.X;
+		if (pos.Y > e->max.Y) e->max.Y = pos.Y;
+		if (pos.Z > e->max.Z) e->max.Z = pos.Z;
+	}
+	
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	
+	if (!n) {
+		fprintf(stderr, "%s has no blocks\n", test->filename);
+		return 0;
+	}
+	
+	printf("%lu blocks from (%d, %d, %d) to (%d, %d, %d)\n", n,
+		e->min.X, e->min.Y, e->min.Z, e->max.X, e->max.Y, e->max.Z);
+	return 1;
+}
+
+
+static void *WorkerProc(void *arg) {
+	LPLOADWORKER w = arg;
+	const LOADTEST *test = w->test;
+	const BLOCKBOX *e = &test->extent;
+	v3s16 at = test->spawn, prev;
+	int step, dir = 0, success = 1;
+	
+	for (step = 0; step != test->nsteps && success; step++) {
+		switch (test->pattern) {
+			case PATTERN_WALK:
+				// Only the blocks coming into range are loaded; the rest
+				// are still in the server's memory
+				if (!step) {
+					success = LoadAround(w, at, NULL);
+					break;
+				}
+				if (RandomInt(&w->rng, 1000) < LOADTEST_TURN_CHANCE * 1000)
+					dir = RandomInt(&w->rng, 4);
+				prev = at;
+				switch (dir) {
+					case 0: at.X++; break;
+					case 1: at.X--; break;
+					case 2: at.Z++; break;
+					case 3: at.Z--; break;
+				}
+				// Turn around at the edge of the world
+				if (at.X < e->min.X || at.X > e->max.X || at.Z < e->min.Z || at.Z > e->max.Z) {
+					at  = prev;
+					dir ^= 1;
+					break;
+				}
+				success = LoadAround(w, at, &prev);
+				break;
+			case PATTERN_RADIUS:
+				success = LoadAround(w, test->spawn, NULL);
+				break;
+			case PATTERN_TELEPORT:
+				at.X = e->min.X + RandomInt(&w->rng, e->max.X - e->min.X + 1);
+				at.Y = e->min.Y + RandomInt(&w->rng, e->max.Y - e->min.Y + 1);
+				at.Z = e->min.Z + RandomInt(&w->rng, e->max.Z - e->min.Z + 1);
+				success = LoadAround(w, at, NULL);
+				break;
+		}
+	}
+	
+	w->status = success;
+	return NULL;
+}
+
+
+static int WorkerOpen(LPLOADWORKER w) {
+	char pragma[64];
+	
+	if (sqlite3_open_v2(w->test->filename, &w->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+			NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(w->db, "SELECT `data` FROM `blocks` WHERE `pos`=?", -1,
+			&w->read, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Could not open %s: %s\n", w->test->filename, sqlite3_errmsg(w->db));
+		return 0;
+	}
+	
+	if (w->test->cache_kib > 0) {
+		snprintf(pragma, sizeof(pragma), "PRAGMA cache_size=-%d;", w->test->cache_kib);
+		sqlite3_exec(w->db, pragma, NULL, NULL, NULL);
+	}
+	
+	w->maxloads = 4096;
+	w->latency  = malloc(w->maxloads * sizeof(double));
+	return w->latency && SerializerInit(&w->ser);
+}
+
+
+static void WorkerClose(LPLOADWORKER w) {
+	if (w->read)
+		sqlite3_finalize(w->read);
+	sqlite3_close(w->db);
+	SerializerFree(&w->ser);
+	free(w->latency);
+	w->read    = NULL;
+	w->db      = NULL;
+	w->latency = NULL;
+}
+
+
+// The cube of blocks around at, nearest first, leaving out any that were
+// already in the cube around prev
+static int LoadAround(LPLOADWORKER w, v3s16 at, const v3s16 *prev) {
+	int r = w->test->radius;
+	int d, x, y, z;
+	
+	for (d = 0; d <= r; d++) {
+		for (y = at.Y - d; y <= at.Y + d; y++) {
+			for (z = at.Z - d; z <= at.Z + d; z++) {
+				for (x = at.X - d; x <= at.X + d; x++) {
+					if (abs(x - at.X) != d && abs(y - at.Y) != d && abs(z - at.Z) != d)
+						continue;
+					if (prev && abs(x - prev->X) <= r && abs(y - prev->Y) <= r &&
+						abs(z - prev->Z) <= r)
+						continue;
+					if (!LoadBlock(w, x, y, z))
+						return 0;
+				}
+			}
+		}
+	}
+	
+	return 1;
+}
+
+
+// Fetches a block and decodes it as far as a server would before using it
+static int LoadBlock(LPLOADWORKER w, s16 x, s16 y, s16 z) {
+	LPDECODEDBLOCK blk;
+	const u8 *data;
+	v3s16 pos;
+	sqlite3_int64 key;
+	double start = TimeNow();
+	size_t len;
+	int rc, nomem;
+	
+	pos.X = x;
+	pos.Y = y;
+	pos.Z = z;
+	key = MapBlockPosToInteger(pos);
+	
+	sqlite3_bind_int64(w->read, 1, key);
+	rc = sqlite3_step(w->read);
+	if (rc == SQLITE_ROW) {
+		data = sqlite3_column_blob(w->read, 0);
+		len  = sqlite3_column_bytes(w->read, 0);
+		w->nbytes += len;
+		
+		if (len && data[0] >= MERGE_MIN_VERSION && data[0] <= MERGE_MAX_VERSION) {
+			blk = MergeDecode(&w->ser, key, data, len, &nomem);
+			if (blk)
+				MergeFreeBlock(blk);
+			else
+				w->nundecoded++;
+		} else {
+			w->nundecoded++;
+		}
+	} else if (rc == SQLITE_DONE) {
+		w->nmissing++;
+	} else {
+		fprintf(stderr, "Block read failed: %s\n", sqlite3_errmsg(w->db));
+		sqlite3_reset(w->read);
+		return 0;
+	}
+	sqlite3_reset(w->read);
+	
+	if (w->nloads == w->maxloads) {
+		double *latency = realloc(w->latency, w->maxloads * 2 * sizeof(double));
+		if (!latency)
+			return 0;
+		w->latency  = latency;
+		w->maxloads *= 2;
+	}
+	w->latency[w->nloads++] = TimeNow() - start;
+	
+	return 1;
+}
+
+
+// Uniform in [0, n)
+static int RandomInt(u64 *state, int n) {
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (int)((*state >> 33) % (u64)n);
+}
+
+
+static int CompareDouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	
+	return (x > y) - (x < y);
+}
+
+
+static void Report(const LOADTEST *test, LPLOADWORKER workers, double elapsed) {
+	unsigned long nmissing = 0, nundecoded = 0;
+	unsigned long long nbytes = 0;
+	size_t nloads = 0, n;
+	double *all, total = 0.0;
+	int i;
+	
+	for (i = 0; i != test->nthreads; i++) {
+		nloads     += workers[i].nloads;
+		nmissing   += workers[i].nmissing;
+		nundecoded += workers[i].nundecoded;
+		nbytes     += workers[i].nbytes;
+	}
+	if (!nloads) {
+		printf("No blocks loaded\n");
+		return;
+	}
+	
+	all = malloc(nloads * sizeof(double));
+	for (i = 0, n = 0; i != test->nthreads; i++) {
+		memcpy(all + n, workers[i].latency, workers[i].nloads * sizeof(double));
+		n += workers[i].nloads;
+	}
+	qsort(all, nloads, sizeof(double), CompareDouble);
+	for (n = 0; n != nloads; n++)
+		total += all[n];
+	
+	printf("%s, %d thread%s, radius %d, spawn (%d, %d, %d)\n",
+		pattern_names[test->pattern], test->nthreads, (test->nthreads == 1) ? "" : "s",
+		test->radius, test->spawn.X, test->spawn.Y, test->spawn.Z);
+	printf("  loads       %lu (%lu missing, %lu not decoded)\n",
+		(unsigned long)nloads, nmissing, nundecoded);
+	printf("  throughput  %.0f blocks/s, %.2f MiB/s\n",
+		nloads / elapsed, nbytes / elapsed / 1048576.0);
+	printf("  latency     mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		total / nloads * 1e6, all[nloads / 2] * 1e6,
+		all[(size_t)(nloads * 0.99)] * 1e6, all[nloads - 1] * 1e6);
+	
+	free(all);
+}
@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * lod.c -
+ *    Halves a volume along every axis for the level-of-detail worlds.  Each
+ *    2x2x2 cell of the source becomes the node most of it is made of, ties
+ *    going to the more solid node so that surfaces and thin walls survive.
+ *    Cells that are all one node, which is most of any map, are found with a
+ *    branch-free pass over whole rows that the compiler vectorizes; only the
+ *    rest are voted on.
+ */
+
+#include "mcconvert.h"
+#include "workpool.h"
+#include "lod.h"
+
+typedef struct _LODJOB {
+	const MCVOLUME *src;
+	LPMCVOLUME dst;
+	int failed;
+} LODJOB;
+
+static void LodPlaneProc(void *arg, int item, int worker);
+static void LodRow(const u8 **rows, u8 *out, u8 *mixed, int n);
+static u8 LodVote(const u8 *cell);
+
+// By Classic ID
+static const u8 lod_rank[256] = {
+	[0]  = LOD_RANK_AIR,
+	[6]  = LOD_RANK_DECOR,
+	[8]  = LOD_RANK_LIQUID,
+	[9]  = LOD_RANK_LIQUID,
+	[10] = LOD_RANK_LIQUID,
+	[11] = LOD_RANK_LIQUID,
+	[18] = LOD_RANK_DECOR,
+	[20] = LOD_RANK_DECOR,
+	[37] = LOD_RANK_DECOR,
+	[38] = LOD_RANK_DECOR,
+	[39] = LOD_RANK_DECOR,
+	[40] = LOD_RANK_DECOR
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Fills dst with src at half the size, rounding down.  src must hold the
+// whole map.
+int LodDownsample(LPMCCONTEXT ctx, const MCVOLUME *src, LPMCVOLUME dst) {
+	LODJOB job;
+	
+	memset(dst, 0, sizeof(MCVOLUME));
+	dst->cx = dst->map_cx = src->map_cx / 2;
+	dst->cy = dst->map_cy = src->map_cy / 2;
+	dst->cz = dst->map_cz = src->map_cz / 2;
+	dst->alloc = malloc((size_t)dst->cx * dst->cy * dst->cz);
+	if (!dst->alloc) {
+		fprintf(stderr, "Out of memory for a %dx%dx%d level of detail\n",
+			dst->cx, dst->cy, dst->cz);
+		return 0;
+	}
+	dst->data = dst->alloc;
+	
+	job.src    = src;
+	job.dst    = dst;
+	if (!ctx->pool)
+		ctx->pool = WorkPoolCreate(ctx->nthreads);
+	job.failed = !ctx->pool;
+	if (ctx->pool)
+		WorkPoolRun(ctx->pool, LodPlaneProc, &job, dst->cy);
+	
+	if (job.failed) {
+		fprintf(stderr, "Out of memory downsampling the map\n");
+		VolumeFree(dst);
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+static void LodPlaneProc(void *arg, int item, int worker) {
+	LODJOB *job = arg;
+	const MCVOLUME *src = job->src;
+	LPMCVOLUME dst = job->dst;
+	const u8 *rows[4];
+	u8 *scratch;
+	int n = dst->cx, z, i;
+	
+	// Room to unpack four source rows, and a flag per cell
+	scratch = malloc(8 * (size_t)n + n);
+	if (!scratch) {
+		job->failed = 1;
+		return;
+	}
+	
+	for (z = 0; z != dst->cz; z++) {
+		for (i = 0; i != 4; i++) {
+			rows[i] = VolumeRow(src, src->ox, item * 2 + (i >> 1), z * 2 + (i & 1),
+				2 * n, scratch + i * 2 * (size_t)n);
+		}
+		LodRow(rows, dst->alloc + VolumeIndex(dst, 0, item, z), scratch + 8 * (size_t)n, n);
+	}
+	
+	free(scratch);
+}
+
+
+// One row of cells from the four source rows over it
+static void LodRow(const u8 **rows, u8 *out, u8 *mixed, int n) {
+	const u8 *r0 = rows[0], *r1 = rows[1], *r2 = rows[2], *r3 = rows[3];
+	u8 cell[8];
+	int x;
+	
+	for (x = 0; x != n; x++) {
+		u8 a = r0[2 * x];
+		
+		out[x] = a;
+		mixed[x] = (a ^ r0[2 * x + 1]) |
+				   (a ^ r1[2 * x]) | (a ^ r1[2 * x + 1]) |
+				   (a ^ r2[2 * x]) | (a ^ r2[2 * x + 1]) |
+				   (a ^ r3[2 * x]) | (a ^ r3[2 * x + 1]);
+	}
+	
+	for (x = 0; x != n; x++) {
+		if (!mixed[x])
+			continue;
+		
+		cell[0] = r0[2 * x];
+		cell[1] = r0[2 * x + 1];
+		cell[2] = r1[2 * x];
+		cell[3] = r1[2 * x + 1];
+		cell[4] = r2[2 * x];
+		cell[5] = r2[2 * x + 1];
+		cell[6] = r3[2 * x];
+		cell[7] = r3[2 * x + 1];
+		out[x] = LodVote(cell);
+	}
+}
+
+
+// The most common node, then the lowest rank, then the first found
+static u8 LodVote(const u8 *cell) {
+	int i, j, count, best_count = 0;
+	u8 best = 0;
+	
+	for (i = 0; i != 8; i++) {
+		count = 0;
+		for (j = 0; j != 8; j++)
+			count += cell[j] == cell[i];
+		
+		if (count > best_count ||
+			(count == best_count && lod_rank[cell[i]] < lod_rank[best])) {
+			best       = cell[i];
+			best_count = count;
+		}
+	}
+	
+	return best;
+}
+
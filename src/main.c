@@ -0,0 +1,552 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * main.c - 
+ *    A utility to convert an extracted Minecraft Classic map to
+ *    Minetest's 0.4.x SQLite3 format.
+ */
+
+#include "mcconvert.h"
+#include "daemon.h"
+#include "watch.h"
+#include "db.h"
+#include "autotune.h"
+
+#include <getopt.h>
+
+enum {
+	OPT_BATCH = 256,
+	OPT_TXN_BUDGET,
+	OPT_RATE_BLOCKS,
+	OPT_RATE_BYTES,
+	OPT_REGION,
+	OPT_REGION_BLOCKS,
+	OPT_ESTIMATE,
+	OPT_SIZE,
+	OPT_PACKED,
+	OPT_DEFLATE,
+	OPT_AUTOTUNE,
+	OPT_PROFILE,
+	OPT_SPAWN_FIRST,
+	OPT_SPAWN,
+	OPT_READY_FILE,
+	OPT_READY_RADIUS,
+	OPT_MAPPING,
+	OPT_TARGET,
+	OPT_SETTLE_LIQUIDS,
+	OPT_WATCH,
+	OPT_VFS_BUFFER,
+	OPT_LOD
+};
+
+static const struct option long_options[] = {
+	{"output",  required_argument, NULL, 'o'},
+	{"minimap", required_argument, NULL, 'm'},
+	{"no-walls", no_argument,      NULL, 'W'},
+	{"summary", no_argument,       NULL, 's'},
+	{"daemon",  required_argument, NULL, 'D'},
+	{"workers", required_argument, NULL, 'w'},
+	{"live",    optional_argument, NULL, 'L'},
+	{"batch",   required_argument, NULL, OPT_BATCH},
+	{"txn-budget",  required_argument, NULL, OPT_TXN_BUDGET},
+	{"rate-blocks", required_argument, NULL, OPT_RATE_BLOCKS},
+	{"rate-bytes",  required_argument, NULL, OPT_RATE_BYTES},
+	{"region",  required_argument, NULL, OPT_REGION},
+	{"region-blocks", required_argument, NULL, OPT_REGION_BLOCKS},
+	{"scale",   required_argument, NULL, 'S'},
+	{"merge",   no_argument,       NULL, 'M'},
+	{"threads", required_argument, NULL, 'j'},
+	{"estimate", optional_argument, NULL, OPT_ESTIMATE},
+	{"size",    required_argument, NULL, OPT_SIZE},
+	{"packed",  no_argument,       NULL, OPT_PACKED},
+	{"deflate", required_argument, NULL, OPT_DEFLATE},
+	{"autotune", required_argument, NULL, OPT_AUTOTUNE},
+	{"profile", required_argument, NULL, OPT_PROFILE},
+	{"spawn-first", no_argument,   NULL, OPT_SPAWN_FIRST},
+	{"spawn",   required_argument, NULL, OPT_SPAWN},
+	{"ready-file", required_argument, NULL, OPT_READY_FILE},
+	{"ready-radius", required_argument, NULL, OPT_READY_RADIUS},
+	{"mapping", required_argument, NULL, OPT_MAPPING},
+	{"target",  required_argument, NULL, OPT_TARGET},
+	{"settle-liquids", no_argument, NULL, OPT_SETTLE_LIQUIDS},
+	{"watch",   no_argument,       NULL, OPT_WATCH},
+	{"vfs-buffer", no_argument,    NULL, OPT_VFS_BUFFER},
+	{"lod",     required_argument, NULL, OPT_LOD},
+	{NULL, 0, NULL, 0}
+};
+
+static void Usage(const char *progname);
+static double ParseSize(const char *str);
+static int ParseRegion(LPMCCONTEXT ctx, const char *str, int in_blocks);
+static int ParseMapSize(LPMCCONTEXT ctx, const char *str);
+static int ParseSpawn(LPMCCONTEXT ctx, const char *str);
+static int ParseDeflate(const char *str, int *level, int *strategy);
+static int ParseAutotune(LPMCCONTEXT ctx, const char *str);
+static int ParseTarget(LPMCCONTEXT ctx, const char *str);
+static int ParseLods(LPMCCONTEXT ctx, const char *str);
+static void PrintEstimate(LPMCCONTEXT ctx);
+static void PrintProfile(LPMCCONTEXT ctx);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[]) {
+	LPMCCONTEXT ctx;
+	char *daemon_socket = NULL;
+	char *profile = NULL;
+	char *ready_file = NULL;
+	int ready_radius = MCC_READY_RADIUS;
+	int watch = 0;
+	int daemon_workers = 0;
+	int live_timeout = 0;
+	int batch = 0;
+	int threads = -1;
+	int level = 0, strategy = -1;
+	double txn_budget = -1.0;
+	double rate_blocks = 0.0, rate_bytes = 0.0;
+	int c, i, success;
+	
+	ctx = MCCContextCreate();
+	if (!ctx) {
+		fprintf(stderr, "Failed to create converter context\n");
+		return 1;
+	}
+	
+	while ((c = getopt_long(argc, argv, "o:m:WsS:Mj:D:w:L::", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'o':
+				MCCSetOutputFile(ctx, optarg);
+				break;
+			case 'm':
+				MCCSetMinimap(ctx, optarg);
+				break;
+			case 'W':
+				MCCSetWalls(ctx, 0);
+				break;
+			case 's':
+				MCCSetSummary(ctx, 1);
+				break;
+			case 'S':
+				if (!MCCSetScale(ctx, atoi(optarg))) {
+					fprintf(stderr, "Scale must be between 1 and %d\n", MCC_MAX_SCALE);
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case 'M':
+				MCCSetMerge(ctx, 1);
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'D':
+				daemon_socket = optarg;
+				break;
+			case 'w':
+				daemon_workers = atoi(optarg);
+				break;
+			case 'L':
+				live_timeout = optarg ? atoi(optarg) : DB_LIVE_BUSY_TIMEOUT;
+				break;
+			case OPT_BATCH:
+				batch = atoi(optarg);
+				break;
+			case OPT_TXN_BUDGET:
+				txn_budget = atof(optarg);
+				break;
+			case OPT_RATE_BLOCKS:
+				rate_blocks = atof(optarg);
+				break;
+			case OPT_RATE_BYTES:
+				rate_bytes = ParseSize(optarg);
+				break;
+			case OPT_ESTIMATE:
+				MCCSetEstimate(ctx, optarg ? atof(optarg) : 0.01);
+				break;
+			case OPT_SIZE:
+				if (!ParseMapSize(ctx, optarg)) {
+					fprintf(stderr, "Invalid map size '%s', expected <x>x<y>x<z>\n", optarg);
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_PACKED:
+				MCCSetPacked(ctx, 1);
+				break;
+			case OPT_SETTLE_LIQUIDS:
+				MCCSetSettleLiquids(ctx, 1);
+				break;
+			case OPT_WATCH:
+				watch = 1;
+				break;
+			case OPT_VFS_BUFFER:
+				MCCSetVfsBuffer(ctx, 1);
+				break;
+			case OPT_DEFLATE:
+				if (!ParseDeflate(optarg, &level, &strategy)) {
+					fprintf(stderr, "Invalid deflate setting '%s', expected <level>[,<strategy>]\n", optarg);
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_AUTOTUNE:
+				if (!ParseAutotune(ctx, optarg)) {
+					fprintf(stderr, "Invalid autotune goal '%s', expected fastest or smallest[:<%%>]\n", optarg);
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_PROFILE:
+				profile = optarg;
+				break;
+			case OPT_SPAWN_FIRST:
+				MCCSetSpawnFirst(ctx, 1);
+				break;
+			case OPT_SPAWN:
+				if (!ParseSpawn(ctx, optarg)) {
+					fprintf(stderr, "Invalid spawn '%s', expected x,y,z\n", optarg);
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_READY_FILE:
+				ready_file = optarg;
+				break;
+			case OPT_READY_RADIUS:
+				ready_radius = atoi(optarg);
+				break;
+			case OPT_MAPPING:
+				if (!MCCSetMapping(ctx, optarg)) {
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_TARGET:
+				if (!ParseTarget(ctx, optarg)) {
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_LOD:
+				if (!ParseLods(ctx, optarg)) {
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			case OPT_REGION:
+			case OPT_REGION_BLOCKS:
+				if (!ParseRegion(ctx, optarg, c == OPT_REGION_BLOCKS)) {
+					fprintf(stderr, "Invalid region '%s', expected x0,y0,z0:x1,y1,z1\n", optarg);
+					MCCContextDestroy(ctx);
+					return 1;
+				}
+				break;
+			default:
+				Usage(argv[0]);
+				MCCContextDestroy(ctx);
+				return 1;
+		}
+	}
+	
+	if (daemon_socket) {
+		MCCContextDestroy(ctx);
+		return !DaemonRun(daemon_socket, daemon_workers);
+	}
+	
+	// Live mode picks its own batching defaults, so apply it first, then a
+	// saved profile, then whatever was given explicitly
+	if (live_timeout)
+		MCCSetLive(ctx, live_timeout);
+	if (profile && !ctx->autotune && !MCCLoadProfile(ctx, profile)) {
+		MCCContextDestroy(ctx);
+		return 1;
+	}
+	if (batch || txn_budget >= 0.0) {
+		MCCSetBatch(ctx, batch ? batch : ctx->batch_size,
+			(txn_budget >= 0.0) ? txn_budget : ctx->txn_budget * 1000.0);
+	}
+	MCCSetRateLimit(ctx, rate_blocks, rate_bytes);
+	if (ready_file)
+		MCCSetReady(ctx, ready_file, ready_radius);
+	if ((threads >= 0 || !profile) && !MCCSetThreads(ctx, (threads >= 0) ? threads : 0)) {
+		fprintf(stderr, "Failed to start conversion threads\n");
+		MCCContextDestroy(ctx);
+		return 1;
+	}
+	if (strategy >= 0)
+		MCCSetCompression(ctx, level, strategy);
+	
+	if (optind >= argc) {
+		fprintf(stderr, "Insufficient number of arguments\n");
+		Usage(argv[0]);
+		MCCContextDestroy(ctx);
+		return 1;
+	}
+	
+	if (watch) {
+		success = WatchRun(ctx, argv[optind]);
+		MCCContextDestroy(ctx);
+		return !success;
+	}
+	
+	success = MCCConvertFile(ctx, argv[optind]);
+	if (ctx->autotune && ctx->profile.blocks_per_sec > 0.0) {
+		PrintProfile(ctx);
+		if (profile && !MCCSaveProfile(ctx, profile))
+			success = 0;
+	}
+	if (success && ctx->estimate > 0.0) {
+		PrintEstimate(ctx);
+		MCCContextDestroy(ctx);
+		return 0;
+	}
+	if (success)
+		printf("done!\n");
+	for (i = 0; success && i != ctx->ntargets; i++) {
+		printf("%lu blocks written to %s\n", ctx->targets[i]->stats.nblocks,
+			ctx->targets[i]->output_filename);
+	}
+	for (i = 0; success && i != ctx->nlods; i++) {
+		printf("%lu blocks written to %s (1/%d)\n", ctx->lods[i]->stats.nblocks,
+			ctx->lods[i]->output_filename, 2 << i);
+	}
+	if (ctx->merge)
+		printf("%lu blocks merged into existing ones\n", ctx->stats.nmerged);
+	if (ctx->settle_liquids)
+		printf("%lu liquid nodes settled\n", ctx->stats.nliquid);
+	if (live_timeout) {
+		printf("%lu blocks in %lu transactions, %lu busy retries\n",
+			ctx->stats.nblocks, ctx->stats.ntransactions, ctx->stats.nbusy);
+	}
+
+	MCCContextDestroy(ctx);
+
+	return !success;
+}
+
+
+static void Usage(const char *progname) {
+	fprintf(stderr, "usage: %s [options] <map file>\n"
+		"       %s -D <socket> [-w <n>]\n"
+		"  -o, --output <file>     output database (default " OUTPUT_FILENAME ")\n"
+		"  -m, --minimap <file>    render a top-down minimap (.png or .ppm)\n"
+		"  -W, --no-walls          don't surround the map with walls\n"
+		"  -s, --summary           write per-block summary tables alongside `blocks`\n"
+		"  -S, --scale <k>         make each map node k x k x k nodes\n"
+		"      --size <x>x<y>x<z>  map size, if the header is wrong or missing (y is up)\n"
+		"  -M, --merge             overlay onto blocks already in the output\n"
+		"                          (nodes written over lose their metadata)\n"
+		"  -j, --threads <n>       serialization threads (default: one per CPU)\n"
+		"      --packed            hold the map in 3/4 of the memory, a little slower\n"
+		"      --settle-liquids    let flowing water and lava come to rest first, so\n"
+		"                          the world loads without liquid updates\n"
+		"      --deflate <l>[,<s>] zlib level 0-9 and strategy (default, filtered,\n"
+		"                          huffman, rle or fixed) for node data\n"
+		"      --autotune <goal>   calibrate threads, batch and deflate on a sample\n"
+		"                          first; goal is fastest or smallest[:<%%>], the\n"
+		"                          smallest output at most <%%> slower (default 10)\n"
+		"      --profile <file>    settings to start from, or with --autotune, to save\n"
+		"  -L, --live[=<ms>]       import into a world a server has open\n"
+		"      --batch <n>         blocks per transaction\n"
+		"      --txn-budget <ms>   commit transactions held open this long\n"
+		"      --vfs-buffer        gather writes and sync only at the end; faster,\n"
+		"                          but a crash mid-run can corrupt the world\n"
+		"      --rate-blocks <n>   limit output to n blocks/sec\n"
+		"      --rate-bytes <n>    limit output to n bytes/sec (K, M suffixes)\n"
+		"      --estimate[=<f>]    sample a fraction f of the blocks (default 0.01)\n"
+		"                          and predict the output size and time\n"
+		"      --spawn-first       convert outwards from the spawn point\n"
+		"      --spawn <x,y,z>     spawn point, if not the map's own\n"
+		"      --ready-file <file> create file once the area around spawn is written\n"
+		"      --ready-radius <n>  ... within n blocks of it (default %d)\n"
+		"      --mapping <file>    Minetest names for Classic node IDs, as\n"
+		"                          `<id> <name>` lines (default minetest_game); an\n"
+		"                          ID named - is written as another node in its\n"
+		"                          block, or as air\n"
+		"      --target <file>[,<mapping>]\n"
+		"                          also write the map to another database with its\n"
+		"                          own mapping; may be repeated\n"
+		"      --lod <file>[,<file>...]\n"
+		"                          also write the map at 1/2 size, then 1/4 and so on\n"
+		"      --watch             keep converting the map each time it's saved,\n"
+		"                          rewriting only the blocks that changed\n"
+		"      --region <x0,y0,z0:x1,y1,z1>\n"
+		"                          only convert blocks overlapping this node box\n"
+		"      --region-blocks <x0,y0,z0:x1,y1,z1>\n"
+		"                          same, in block coordinates\n"
+		"  -D, --daemon <socket>   serve conversion jobs on a Unix socket\n"
+		"  -w, --workers <n>       number of concurrent daemon jobs\n",
+		progname, progname, MCC_READY_RADIUS);
+}
+
+
+static double ParseSize(const char *str) {
+	char *end;
+	double n = strtod(str, &end);
+	
+	switch (*end) {
+		case 'k':
+		case 'K':
+			n *= 1024.0;
+			break;
+		case 'm':
+		case 'M':
+			n *= 1024.0 * 1024.0;
+			break;
+		case 'g':
+		case 'G':
+			n *= 1024.0 * 1024.0 * 1024.0;
+			break;
+	}
+	
+	return n;
+}
+
+
+static int ParseRegion(LPMCCONTEXT ctx, const char *str, int in_blocks) {
+	int x0, y0, z0, x1, y1, z1;
+	char end;
+	
+	if (sscanf(str, "%d,%d,%d:%d,%d,%d%c", &x0, &y0, &z0, &x1, &y1, &z1, &end) != 6)
+		return 0;
+	
+	MCCSetRegion(ctx, x0, y0, z0, x1, y1, z1, in_blocks);
+	return 1;
+}
+
+
+static int ParseMapSize(LPMCCONTEXT ctx, const char *str) {
+	int cx, cy, cz;
+	char end;
+	
+	if (sscanf(str, "%dx%dx%d%c", &cx, &cy, &cz, &end) != 3 ||
+		cx <= 0 || cy <= 0 || cz <= 0)
+		return 0;
+	
+	MCCSetMapSize(ctx, cx, cy, cz);
+	return 1;
+}
+
+
+static int ParseSpawn(LPMCCONTEXT ctx, const char *str) {
+	int x, y, z;
+	char end;
+	
+	if (sscanf(str, "%d,%d,%d%c", &x, &y, &z, &end) != 3)
+		return 0;
+	
+	MCCSetSpawn(ctx, x, y, z);
+	return 1;
+}
+
+
+// <file>[,<mapping>]
+static int ParseTarget(LPMCCONTEXT ctx, const char *str) {
+	const char *comma = strchr(str, ',');
+	char *filename;
+	int success;
+	
+	if (!comma)
+		return MCCAddTarget(ctx, str, NULL);
+	
+	filename = strndup(str, comma - str);
+	success = MCCAddTarget(ctx, filename, comma + 1);
+	free(filename);
+	return success;
+}
+
+
+// <file>[,<file>...], largest level first
+static int ParseLods(LPMCCONTEXT ctx, const char *str) {
+	const char *comma;
+	char *filename;
+	int success = 1;
+	
+	while (success && (comma = strchr(str, ','))) {
+		filename = strndup(str, comma - str);
+		success = MCCAddLod(ctx, filename);
+		free(filename);
+		str = comma + 1;
+	}
+	
+	return success && MCCAddLod(ctx, str);
+}
+
+
+static int ParseDeflate(const char *str, int *level, int *strategy) {
+	const char *comma = strchr(str, ',');
+	char *end;
+	
+	*level = strtol(str, &end, 10);
+	if (end == str || end != (comma ? comma : str + strlen(str)) ||
+		*level < 0 || *level > 9)
+		return 0;
+	
+	*strategy = comma ? ProfileStrategyByName(comma + 1) : Z_DEFAULT_STRATEGY;
+	return *strategy >= 0;
+}
+
+
+static int ParseAutotune(LPMCCONTEXT ctx, const char *str) {
+	double slack = 10.0;
+	char end;
+	
+	if (!strcmp(str, "fastest")) {
+		MCCSetAutotune(ctx, MCC_TUNE_FASTEST, 0.0);
+		return 1;
+	}
+	
+	if (strcmp(str, "smallest") &&
+		sscanf(str, "smallest:%lf%c", &slack, &end) != 1)
+		return 0;
+	
+	MCCSetAutotune(ctx, MCC_TUNE_SMALLEST, slack);
+	return 1;
+}
+
+
+static void PrintEstimate(LPMCCONTEXT ctx) {
+	MCCESTIMATE est;
+	
+	MCCGetEstimate(ctx, &est);
+	printf("Estimate from %lu of %lu blocks, %d thread%s (95%% intervals):\n",
+		est.nsampled, est.nblocks - est.nwalls, est.nthreads, (est.nthreads == 1) ? "" : "s");
+	printf("  blocks  %lu (%lu walls)\n", est.nblocks, est.nwalls);
+	printf("  size    %.2f MiB +/- %.2f MiB\n",
+		est.nbytes / 1048576.0, est.nbytes_ci / 1048576.0);
+	printf("  time    %.2f s +/- %.2f s (serialize %.2f s, insert %.2f s)\n",
+		est.seconds, est.seconds_ci, est.serialize_seconds, est.insert_seconds);
+}
+
+
+static void PrintProfile(LPMCCONTEXT ctx) {
+	MCCPROFILE p;
+	
+	MCCGetProfile(ctx, &p);
+	printf("Autotuned: %d thread%s, batch %d, deflate %d,%s "
+		"(%.0f blocks/s, %.0f bytes/block on the sample)\n",
+		p.nthreads, (p.nthreads == 1) ? "" : "s", p.batch_size, p.level,
+		ProfileStrategyName(p.strategy), p.blocks_per_sec, p.bytes_per_block);
+}
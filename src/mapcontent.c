@@ -96,7 +96,70 @@ sqlite3_int64 MapBlockPosToInteger(const v3s16 pos) {
 }
 
 
-LPVECTOR MapBlockCreateMappingTableAndFixNodes(MapNode *nodes, size_t nnodes) {
+static inline s16 UnsignedToSigned12(sqlite3_int64 i) {
+	return (i < 2048) ? i : i - 4096;
+}
+
+
+v3s16 MapBlockIntegerToPos(sqlite3_int64 i) {
+	v3s16 pos;
+	
+	pos.X = UnsignedToSigned12(((i % 4096) + 4096) % 4096);
+	i = (i - pos.X) / 4096;
+	pos.Y = UnsignedToSigned12(((i % 4096) + 4096) % 4096);
+	i = (i - pos.Y) / 4096;
+	pos.Z = UnsignedToSigned12(((i % 4096) + 4096) % 4096);
+	return pos;
+}
+
+
+// Reads the names a target uses for each Classic ID, one "<id> <name>" pair
+// per line.  IDs that aren't listed keep their name from node_names, and a
+// name of "-" leaves the ID unmapped: it's written as the first named node in
+// its block, or as air if there's none.  The table is a single allocation.
+const char **MapNodeLoadNames(const char *filename) {
+	char line[256], name[MAP_MAX_NODE_NAME];
+	const char **names;
+	char *text;
+	int id, lineno = 0;
+	FILE *f;
+	
+	f = fopen(filename, "r");
+	if (!f) {
+		perror("Could not open node mapping");
+		return NULL;
+	}
+	
+	names = malloc(sizeof(node_names) + ARRAYLEN(node_names) * MAP_MAX_NODE_NAME);
+	if (!names) {
+		fprintf(stderr, "Out of memory for node mapping\n");
+		fclose(f);
+		return NULL;
+	}
+	text  = (char *)(names + ARRAYLEN(node_names));
+	memcpy(names, node_names, sizeof(node_names));
+	
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (sscanf(line, " %127s", name) != 1 || name[0] == '#')
+			continue;
+		
+		if (sscanf(line, "%d %127s", &id, name) != 2 || id < 0 || id >= ARRAYLEN(node_names)) {
+			fprintf(stderr, "WARNING: %s:%d: expected a Classic node ID and a name\n",
+				filename, lineno);
+			continue;
+		}
+		
+		names[id] = text + id * MAP_MAX_NODE_NAME;
+		strcpy(text + id * MAP_MAX_NODE_NAME, strcmp(name, "-") ? name : "");
+	}
+	
+	fclose(f);
+	return names;
+}
+
+
+LPVECTOR MapBlockCreateMappingTableAndFixNodes(const char **names, MapNode *nodes, size_t nnodes) {
 	u8 global_to_relative_id_map[ARRAYLEN(node_names)];
 	LPVECTOR names_seen = NULL;
 	int i;
@@ -115,12 +178,13 @@ LPVECTOR MapBlockCreateMappingTableAndFixNodes(MapNode *nodes, size_t nnodes) {
 		if (relative_id != 0xFF) {
 			id = relative_id;
 		} else {
-			if (*node_names[global_id]) {
+			if (*names[global_id]) {
 				id = num_ids;
 				num_ids++;
 				
 				global_to_relative_id_map[global_id] = id;
-				VectorAdd(&names_seen, node_names[global_id]);
+				if (!VectorAdd(&names_seen, names[global_id]))
+					goto nomem;
 			} else {
 				id = 0; //just make it anything, whatever the first node was
 			}
@@ -128,13 +192,110 @@ LPVECTOR MapBlockCreateMappingTableAndFixNodes(MapNode *nodes, size_t nnodes) {
 		nodes[i].param0 = id;
 	}
 	
+	// With no named node to stand in for them, unnamed IDs are written as air
+	if (!names_seen && !VectorAdd(&names_seen, (void *)"air"))
+		goto nomem;
+	
 	return names_seen;
+
+nomem:
+	fprintf(stderr, "ERROR: Out of memory for the name-id mapping\n");
+	free(names_seen);
+	return NULL;
 }
 
 
-size_t MapBlockSerialize(MapBlock *block, u8 *outbuf) {
+void MapBlockSummarize(const char **names, const MapNode *nodes, LPBLOCKSUMMARY summary) {
+	u16 counts[ARRAYLEN(node_names)];
+	int i, j, y, unnamed = -1;
+	u8 global_id;
+	
+	memset(counts, 0, sizeof(counts));
+	summary->min_y  = -1;
+	summary->max_y  = -1;
+	summary->nsolid = 0;
+	summary->nnames = 0;
+	
+	// IDs without a name are written as whichever named node comes first,
+	// or as air if there's none; see MapBlockCreateMappingTableAndFixNodes
+	for (i = 0; i != MAP_BLOCKNUMNODES && unnamed == -1; i++) {
+		global_id = nodes[i].param0;
+		if (global_id < ARRAYLEN(node_names) && *names[global_id])
+			unnamed = global_id;
+	}
+	if (unnamed == -1) {
+		summary->names[0]  = "air";
+		summary->counts[0] = MAP_BLOCKNUMNODES;
+		summary->nnames    = 1;
+		return;
+	}
+	
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+		global_id = nodes[i].param0;
+		if (global_id >= ARRAYLEN(node_names))
+			continue;
+		if (!*names[global_id])
+			global_id = unnamed;
+		
+		counts[global_id]++;
+		if (global_id) {
+			y = (i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE;
+			if (summary->min_y == -1 || y < summary->min_y)
+				summary->min_y = y;
+			if (y > summary->max_y)
+				summary->max_y = y;
+			summary->nsolid++;
+		}
+	}
+	
+	// Several Classic IDs share a Minetest name; fold them together
+	for (i = 0; i != ARRAYLEN(node_names); i++) {
+		if (!counts[i] || !*names[i])
+			continue;
+		
+		for (j = 0; j != summary->nnames; j++) {
+			if (!strcmp(summary->names[j], names[i]))
+				break;
+		}
+		if (j == summary->nnames) {
+			summary->names[j]  = names[i];
+			summary->counts[j] = 0;
+			summary->nnames++;
+		}
+		summary->counts[j] += counts[i];
+	}
+}
+
+
+int SerializerInit(LPSERIALIZER ser) {
+	memset(ser, 0, sizeof(SERIALIZER));
+	ZLibDeflaterSetParams(&ser->deflater, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY);
+	ZLibDeflaterSetParams(&ser->rawdeflater, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY);
+	ser->outbuf   = malloc(MAPBLOCK_MAX_SERIALIZED);
+	ser->planebuf = malloc(MAP_BLOCKNUMNODES * sizeof(MapNode));
+	ser->source   = malloc(MAP_BLOCKNUMNODES * sizeof(MapNode));
+	
+	return ser->outbuf && ser->planebuf && ser->source;
+}
+
+
+void SerializerFree(LPSERIALIZER ser) {
+	ZLibDeflaterEnd(&ser->deflater);
+	ZLibDeflaterEnd(&ser->rawdeflater);
+	ZLibInflaterEnd(&ser->inflater);
+	free(ser->source);
+	free(ser->planebuf);
+	free(ser->outbuf);
+	ser->source   = NULL;
+	ser->planebuf = NULL;
+	ser->outbuf   = NULL;
+}
+
+
+// Serializes into ser->outbuf, and fills ser->summary if summaries are on
+size_t MapBlockSerialize(LPMCCONTEXT ctx, LPSERIALIZER ser, MapBlock *block) {
+	u8 *outbuf = ser->outbuf;
 	u8 *os = outbuf;
-	u8 *compressed_data;
 	size_t compressed_len;
 	LPVECTOR names_seen;
 	
@@ -153,25 +314,26 @@ size_t MapBlockSerialize(MapBlock *block, u8 *outbuf) {
 	InsertU8(os, content_width);
 	InsertU8(os, params_width);
 	
-	names_seen = MapBlockCreateMappingTableAndFixNodes(block->data, nodecount);
+	if (ctx->summary)
+		MapBlockSummarize(ctx->names, block->data, &ser->summary);
+	
+	names_seen = MapBlockCreateMappingTableAndFixNodes(ctx->names, block->data, nodecount);
 	if (!names_seen) {
 		fprintf(stderr, "crap\n");
 		return 0;
 	}
 	
-	MapNodeSerializeBulk(block->data, nodecount, &compressed_data, &compressed_len);
-	memcpy(os, compressed_data, compressed_len);
+	compressed_len = MapNodeSerializeBulk(block->data, nodecount, ser,
+		&ctx->plane_tail, os, MAPBLOCK_MAX_SERIALIZED - (os - outbuf));
+	if (!compressed_len) {
+		free(names_seen);
+		return 0;
+	}
 	os += compressed_len;
-	free(compressed_data);
-	
-	// Node metadata
-	u8 buf[4];
-	WriteU8(buf, 0); //version 1 for real data, 0 for "go away"
-	ZLibCompress(buf, 1, &compressed_data, &compressed_len);
 	
-	memcpy(os, compressed_data, compressed_len);
-	os += compressed_len;
-	free(compressed_data);
+	// Node metadata, always empty so it was compressed once up front
+	memcpy(os, ctx->meta_blob, ctx->meta_len);
+	os += ctx->meta_len;
 
 	// Static objects
 	InsertU8(os, 0);
@@ -202,17 +364,88 @@ size_t MapBlockSerialize(MapBlock *block, u8 *outbuf) {
 }
 
 
-void MapNodeSerializeBulk(const MapNode *nodes, u32 nodecount,
-						u8 **outbuf, size_t *outlen) {
+// Builds the tail spliced onto blocks whose param1 and param2 are all
+// defaults; see MapNodeSerializeBulk
+int MapNodeInitPlaneTail(LPPLANETAIL tail) {
+	DEFLATER d;
+	u8 *planes;
+	
+	planes = malloc(2 * MAP_BLOCKNUMNODES);
+	if (!planes)
+		return 0;
+	memset(planes, 0x0F, MAP_BLOCKNUMNODES);
+	memset(planes + MAP_BLOCKNUMNODES, 0, MAP_BLOCKNUMNODES);
+	
+	memset(&d, 0, sizeof(d));
+	ZLibDeflaterSetParams(&d, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY);
+	tail->len   = ZLibDeflaterRawCompress(&d, planes, 2 * MAP_BLOCKNUMNODES,
+		tail->blob, sizeof(tail->blob), Z_FINISH);
+	tail->adler = adler32(adler32(0, Z_NULL, 0), planes, 2 * MAP_BLOCKNUMNODES);
+	ZLibDeflaterEnd(&d);
+	
+	free(planes);
+	return tail->len != 0;
+}
+
+
+// The zlib stream header deflateInit would have written for these settings.
+// Its level field is only a hint, but keep it honest.
+static void WriteZLibHeader(u8 *out, const DEFLATER *d) {
+	int flevel, header;
+	
+	if (d->strategy >= Z_HUFFMAN_ONLY || (d->level >= 0 && d->level < 2))
+		flevel = 0;
+	else if (d->level >= 0 && d->level < 6)
+		flevel = 1;
+	else if (d->level == 6 || d->level < 0)
+		flevel = 2;
+	else
+		flevel = 3;
+	
+	header = (0x78 << 8) | (flevel << 6);
+	header += 31 - header % 31;
+	WriteU16(out, header);
+}
+
+
+// Writes the zlib-compressed param0, param1 and param2 planes.  When param1
+// and param2 hold nothing but defaults, which is nearly always, only the
+// param0 plane is deflated; it's flushed to a byte boundary, the constant
+// tail is copied on after it, and the trailer's checksum is combined from
+// the two parts.  Inflating gives the same planes as deflating them whole.
+size_t MapNodeSerializeBulk(const MapNode *nodes, u32 nodecount, LPSERIALIZER ser,
+						const PLANETAIL *tail, u8 *outbuf, size_t outmax) {
 	unsigned int i;
 	size_t datalen = nodecount * sizeof(MapNode);
-	u8 *databuf = malloc(datalen);
-	u8 *d = databuf;
+	size_t len;
+	u8 *d = ser->planebuf;
+	int constant = (tail && nodecount == MAP_BLOCKNUMNODES);
+	uLong adler;
 
 	// Serialize content
 	for (i = 0; i != nodecount; i++) {
 		WriteU16(d, nodes[i].param0);
 		d += sizeof(nodes[i].param0);
+		constant &= (nodes[i].param1 == 0x0F && nodes[i].param2 == 0);
+	}
+	
+	if (constant) {
+		datalen = nodecount * sizeof(nodes[0].param0);
+		if (outmax < 2 + tail->len + 4)
+			return 0;
+		
+		WriteZLibHeader(outbuf, &ser->rawdeflater);
+		len = ZLibDeflaterRawCompress(&ser->rawdeflater, ser->planebuf, datalen,
+			outbuf + 2, outmax - (2 + tail->len + 4), Z_FULL_FLUSH);
+		if (!len)
+			return 0;
+		
+		memcpy(outbuf + 2 + len, tail->blob, tail->len);
+		adler = adler32(adler32(0, Z_NULL, 0), ser->planebuf, datalen);
+		adler = adler32_combine(adler, tail->adler, 2 * nodecount);
+		WriteU32(outbuf + 2 + len + tail->len, adler);
+		
+		return 2 + len + tail->len + 4;
 	}
 
 	// Serialize param1
@@ -227,7 +460,5 @@ void MapNodeSerializeBulk(const MapNode *nodes, u32 nodecount,
 		d += sizeof(nodes[i].param2);
 	}
 
-	ZLibCompress(databuf, datalen, outbuf, outlen);
-	
-	free(databuf);
+	return ZLibDeflaterCompress(&ser->deflater, ser->planebuf, datalen, outbuf, outmax);
 }
@@ -93,11 +93,23 @@
 
 #include "vector.h"
 
-LPVECTOR MapBlockCreateMappingTableAndFixNodes(MapNode *nodes, size_t nnodes);
-size_t MapBlockSerialize(MapBlock *block, u8 *outbuf);
-void MapNodeSerializeBulk(const MapNode *nodes, u32 nodecount,
-						u8 **outbuf, size_t *outlen);
+// One name per Classic node ID
+#define MAP_NUM_NODE_NAMES 50
+#define MAP_MAX_NODE_NAME 128 // in loaded mappings, terminator included
+
+extern const char *node_names[MAP_NUM_NODE_NAMES];
+
+const char **MapNodeLoadNames(const char *filename);
+LPVECTOR MapBlockCreateMappingTableAndFixNodes(const char **names, MapNode *nodes, size_t nnodes);
+void MapBlockSummarize(const char **names, const MapNode *nodes, LPBLOCKSUMMARY summary);
+int SerializerInit(LPSERIALIZER ser);
+void SerializerFree(LPSERIALIZER ser);
+size_t MapBlockSerialize(LPMCCONTEXT ctx, LPSERIALIZER ser, MapBlock *block);
+int MapNodeInitPlaneTail(LPPLANETAIL tail);
+size_t MapNodeSerializeBulk(const MapNode *nodes, u32 nodecount, LPSERIALIZER ser,
+						const PLANETAIL *tail, u8 *outbuf, size_t outmax);
 sqlite3_int64 MapBlockPosToInteger(const v3s16 pos);
+v3s16 MapBlockIntegerToPos(sqlite3_int64 i);
 
 
 #endif // MAPCONTENT_HEADER
@@ -0,0 +1,230 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * mapheader.c -
+ *    Reading the map dimensions and the position of the node array from the
+ *    serialized com.mojang.minecraft.level.Level that follows the file magic.
+ *
+ *    Only the class description and the primitive field values are parsed.
+ *    The object fields come after them in an order that depends on the class
+ *    version, and the BlockMap among them is too involved to walk, so the
+ *    node array is found by its length, width * height * depth, sitting right
+ *    after a byte[] array header.
+ */
+
+#include "mcconvert.h"
+#include "mapheader.h"
+
+#define MAPHEADER_MAX_FIELDS 64
+
+typedef struct _JAVAFIELD {
+	char type;
+	char name[16]; // truncated; only short names are looked for
+} JAVAFIELD;
+
+static int ReadUTF(const u8 *buf, size_t len, size_t *p, char *out, size_t outlen);
+static int PrimitiveSize(char type);
+static u32 ReadBE32(const u8 *p);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+void MapHeaderDefaults(LPMAPINFO info) {
+	memset(info, 0, sizeof(MAPINFO));
+	info->cx = MCC_MAP_CX;
+	info->cy = MCC_MAP_CY;
+	info->cz = MCC_MAP_CZ;
+	info->data_offset = MCC_MAPDATA_OFFSET;
+}
+
+
+// buf holds the start of the file, magic and version included.  Returns 1
+// with info filled in, 0 if the header isn't understood and the defaults
+// should be used, or -1 if more of the file is needed to tell.
+int MapHeaderParse(const u8 *buf, size_t len, LPMAPINFO info) {
+	JAVAFIELD fields[MAPHEADER_MAX_FIELDS];
+	char classname[128];
+	int nfields, i, size;
+	int width = 0, height = 0, depth = 0;
+	int spawn[3] = {0, 0, 0}, nspawn = 0;
+	size_t p = 5;
+	u32 nnodes, v;
+	
+	if (len < p + 4)
+		return -1;
+	if (((buf[p] << 8) | buf[p + 1]) != JAVA_STREAM_MAGIC ||
+		((buf[p + 2] << 8) | buf[p + 3]) != JAVA_STREAM_VERSION)
+		return 0;
+	p += 4;
+	
+	// TC_OBJECT, TC_CLASSDESC, class name, serialVersionUID, flags
+	if (len < p + 2)
+		return -1;
+	if (buf[p] != JAVA_TC_OBJECT || buf[p + 1] != JAVA_TC_CLASSDESC)
+		return 0;
+	p += 2;
+	
+	i = ReadUTF(buf, len, &p, classname, sizeof(classname));
+	if (i <= 0)
+		return i;
+	if (len < p + 8 + 1 + 2)
+		return -1;
+	p += 8 + 1;
+	
+	nfields = (buf[p] << 8) | buf[p + 1];
+	p += 2;
+	if (nfields > MAPHEADER_MAX_FIELDS)
+		return 0;
+	
+	for (i = 0; i != nfields; i++) {
+		int r;
+		
+		if (len < p + 1)
+			return -1;
+		fields[i].type = buf[p++];
+		r = ReadUTF(buf, len, &p, fields[i].name, sizeof(fields[i].name));
+		if (r <= 0)
+			return r;
+		
+		// Object fields name their class, as a string or a back reference
+		if (fields[i].type == 'L' || fields[i].type == '[') {
+			if (len < p + 1)
+				return -1;
+			if (buf[p] == JAVA_TC_STRING) {
+				p++;
+				r = ReadUTF(buf, len, &p, NULL, 0);
+				if (r <= 0)
+					return r;
+			} else if (buf[p] == JAVA_TC_REFERENCE) {
+				p += 5;
+			} else {
+				return 0;
+			}
+		}
+	}
+	
+	// No class annotations, and Level extends Object
+	if (len < p + 2)
+		return -1;
+	if (buf[p] != JAVA_TC_ENDBLOCKDATA || buf[p + 1] != JAVA_TC_NULL)
+		return 0;
+	p += 2;
+	
+	// Primitive field values, in the order they were described
+	for (i = 0; i != nfields; i++) {
+		size = PrimitiveSize(fields[i].type);
+		if (!size)
+			continue;
+		if (len < p + size)
+			return -1;
+		
+		if (fields[i].type == 'I') {
+			v = ReadBE32(buf + p);
+			if (!strcmp(fields[i].name, "width"))
+				width = v;
+			else if (!strcmp(fields[i].name, "height"))
+				height = v;
+			else if (!strcmp(fields[i].name, "depth"))
+				depth = v;
+			else if (!strcmp(fields[i].name, "xSpawn"))
+				spawn[0] = v, nspawn++;
+			else if (!strcmp(fields[i].name, "ySpawn"))
+				spawn[1] = v, nspawn++;
+			else if (!strcmp(fields[i].name, "zSpawn"))
+				spawn[2] = v, nspawn++;
+		}
+		p += size;
+	}
+	
+	if (width <= 0 || height <= 0 || depth <= 0)
+		return 0;
+	nnodes = (u32)width * height * depth;
+	
+	// Classic's depth is the vertical extent and its height the length
+	for (; p + 4 <= len; p++) {
+		if (ReadBE32(buf + p) != nnodes)
+			continue;
+		if ((p >= 2 && buf[p - 2] == JAVA_TC_ENDBLOCKDATA && buf[p - 1] == JAVA_TC_NULL) ||
+			(p >= 6 && buf[p - 6] == JAVA_TC_ARRAY && buf[p - 5] == JAVA_TC_REFERENCE)) {
+			info->cx = width;
+			info->cy = depth;
+			info->cz = height;
+			info->data_offset = p + 4;
+			info->has_spawn = (nspawn == 3);
+			info->spawn_x = spawn[0];
+			info->spawn_y = spawn[1];
+			info->spawn_z = spawn[2];
+			return 1;
+		}
+	}
+	
+	return -1;
+}
+
+
+// Reads a length-prefixed modified UTF-8 string, truncating it into out
+static int ReadUTF(const u8 *buf, size_t len, size_t *p, char *out, size_t outlen) {
+	size_t n, ncopy;
+	
+	if (len < *p + 2)
+		return -1;
+	n = (buf[*p] << 8) | buf[*p + 1];
+	if (len < *p + 2 + n)
+		return -1;
+	
+	if (out) {
+		ncopy = (n < outlen - 1) ? n : outlen - 1;
+		memcpy(out, buf + *p + 2, ncopy);
+		out[ncopy] = 0;
+	}
+	
+	*p += 2 + n;
+	return 1;
+}
+
+
+static int PrimitiveSize(char type) {
+	switch (type) {
+		case 'B':
+		case 'Z':
+			return 1;
+		case 'C':
+		case 'S':
+			return 2;
+		case 'F':
+		case 'I':
+			return 4;
+		case 'D':
+		case 'J':
+			return 8;
+		default:
+			return 0;
+	}
+}
+
+
+static u32 ReadBE32(const u8 *p) {
+	return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
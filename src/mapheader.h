@@ -0,0 +1,44 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPHEADER_HEADER
+#define MAPHEADER_HEADER
+
+// Java serialization stream constants
+#define JAVA_STREAM_MAGIC   0xACED
+#define JAVA_STREAM_VERSION 5
+#define JAVA_TC_NULL        0x70
+#define JAVA_TC_REFERENCE   0x71
+#define JAVA_TC_CLASSDESC   0x72
+#define JAVA_TC_OBJECT      0x73
+#define JAVA_TC_STRING      0x74
+#define JAVA_TC_ARRAY       0x75
+#define JAVA_TC_ENDBLOCKDATA 0x78
+
+// Never look further than this into a file for the node array
+#define MAPHEADER_MAX 0x100000
+
+int MapHeaderParse(const u8 *buf, size_t len, LPMAPINFO info);
+void MapHeaderDefaults(LPMAPINFO info);
+
+#endif // MAPHEADER_HEADER
@@ -23,138 +23,596 @@
 
 /* 
  * mcconvert.c - 
- *    A utility to convert an extracted Minecraft Classic map to
+ *    Routines to convert an extracted Minecraft Classic map to
  *    Minetest's 0.4.x SQLite3 format.
  */
 
 #include "mcconvert.h"
 #include "vector.h"
 #include "mapcontent.h"
+#include "merge.h"
+#include "workpool.h"
+#include "liquid.h"
 #include "db.h"
 
-#include <zlib.h>
+// Blocks are converted in batches: existing blocks for the whole batch are
+// read up front when merging, the batch is serialized across the thread
+// pool, and then written out in order from the calling thread.  With extra
+// targets each block is extracted once and serialized for every target, and
+// the targets are written out concurrently, each in order.
+#define CONVERT_BATCH_BLOCKS 256
+
+// Serialized block for one target
+typedef struct _BLOCKOUT {
+	u8 *blob;    // NULL if a template is written instead
+	size_t len;
+	BLOCKSUMMARY summary;
+} BLOCKOUT;
+
+typedef struct _BLOCKJOB {
+	v3s16 pos;
+	int wall;    // WALL_* for a wall block, -1 for one from the map
+	int uniform; // Classic ID if the source under the block is uniform, else -1
+	
+	u8 *old;     // existing block, when merging
+	size_t old_len;
+	LPDECODEDBLOCK old_decoded; // existing block found in the cache, owned by it
+	LPDECODEDBLOCK merged;
+	
+	BLOCKOUT out[MCC_MAX_TARGETS + 1]; // the context's own output first
+	int keep;    // leave the existing block as it is
+	int failed;
+} BLOCKJOB;
+
+typedef struct _BLOCKBATCH {
+	LPMCCONTEXT ctx;
+	const MCVOLUME *vol; // NULL when only walls are queued
+	const MCVOLUME *prev; // map as last converted, if only changes are written
+	int maxjobs;
+	int njobs;
+	int written[MCC_MAX_TARGETS + 1]; // per target, set by BatchWriteProc
+	BLOCKJOB jobs[CONVERT_BATCH_BLOCKS];
+} BLOCKBATCH, *LPBLOCKBATCH;
+
+typedef struct _READRUN {
+	LPBLOCKBATCH batch;
+	int first;
+	int count;
+} READRUN;
+
+static LPBLOCKBATCH BatchCreate(LPMCCONTEXT ctx, const MCVOLUME *vol);
+static int BatchAdd(LPBLOCKBATCH batch, s16 bx, s16 by, s16 bz, int wall);
+static int BatchFlush(LPBLOCKBATCH batch);
+static void BatchDestroy(LPBLOCKBATCH batch);
+static int BatchReadExisting(LPBLOCKBATCH batch);
+static void BatchReadProc(void *arg, sqlite3_int64 pos, const u8 *data, size_t len);
+static void BatchJobProc(void *arg, int item, int worker);
+static void BatchWriteProc(void *arg, int item, int worker);
+static int BatchWrite(LPBLOCKBATCH batch, int target);
+static int BatchKeepBlob(BLOCKJOB *job, int target, LPMCCONTEXT ctx,
+						LPSERIALIZER ser, size_t len);
+static void BatchCopySource(LPBLOCKBATCH batch, BLOCKJOB *job, MapNode *nodes);
+static int ConvertSpawnFirst(LPMCCONTEXT ctx, const MCVOLUME *vol);
+static int AddShellRow(LPBLOCKBATCH batch, int d, int by, int bz);
+static void GetSourceRange(const MCVOLUME *vol, int scale, s16 bx, s16 by, s16 bz,
+						int *lo, int *hi);
 
 
 ///////////////////////////////////////////////////////////////////////////////
 
 
-int main(int argc, char *argv[]) {
-	char fn_output_buf[256];
-	char *fn_input, *fn_output;
-	FILE *fin;
-	uint32_t magic;
-	uint8_t version;
+int ConvertMCToMT(LPMCCONTEXT ctx, const MCVOLUME *vol) {
+	LPBLOCKBATCH batch;
+	int bx, by, bz;
+	int success = 1;
+	const BLOCKBOX *box = &ctx->outbox;
 	
-	if (argc < 2) {
-		fprintf(stderr, "Insufficient number of arguments\n");
-		return 1;
+	if (ctx->spawn_first)
+		return ConvertSpawnFirst(ctx, vol);
+	
+	batch = BatchCreate(ctx, vol);
+	if (!batch)
+		return 0;
+	for (by = box->min.Y; by <= box->max.Y && success; by++) {
+		for (bz = box->min.Z; bz <= box->max.Z && success; bz++) {
+			for (bx = box->min.X; bx <= box->max.X && success; bx++)
+				success = BatchAdd(batch, bx, by, bz, -1);
+		}
 	}
+	if (success)
+		success = BatchFlush(batch);
 	
-	fn_input  = argv[1];
-	fn_output = fn_output_buf;
-	strlcpy(fn_output_buf, fn_input, sizeof(fn_output_buf));
+	BatchDestroy(batch);
+	return success;
+}
+
+
+// Writes only the blocks whose source nodes differ between prev and vol,
+// which must have the same layout.  Walls are left as they are.
+int ConvertChangedBlocks(LPMCCONTEXT ctx, const MCVOLUME *vol, const MCVOLUME *prev) {
+	LPBLOCKBATCH batch;
+	int bx, by, bz;
+	int success = 1;
+	const BLOCKBOX *box = &ctx->outbox;
 	
-	fin = fopen(fn_input, "rb");
-	if (!fin) {
-		perror("Could not open input file for read");
-		return 1;
+	// Comparing is about as costly as copying the block out, so it's left
+	// to the batch's threads
+	batch = BatchCreate(ctx, vol);
+	if (!batch)
+		return 0;
+	batch->prev = prev;
+	for (by = box->min.Y; by <= box->max.Y && success; by++) {
+		for (bz = box->min.Z; bz <= box->max.Z && success; bz++) {
+			for (bx = box->min.X; bx <= box->max.X && success; bx++)
+				success = BatchAdd(batch, bx, by, bz, -1);
+		}
 	}
+	if (success)
+		success = BatchFlush(batch);
 	
-	fread(&magic, 1, sizeof(magic), fin);
-	magic = SWAP4(magic);
-	if (magic != 0x271bb788) {
-		fprintf(stderr, "Header mismatch, invalid Minecraft Classic map file\n");
-		fclose(fin);
-		return 1;
+	BatchDestroy(batch);
+	return success;
+}
+
+
+// Blocks go out in cubic shells around the spawn block, shell d holding those
+// whose largest distance along any axis is d.  Within a shell they're still
+// in Y, Z, X order.  Once the shell at ready_radius is out it's committed and
+// readiness signalled, before the remaining shells are started.
+static int ConvertSpawnFirst(LPMCCONTEXT ctx, const MCVOLUME *vol) {
+	LPBLOCKBATCH batch;
+	const BLOCKBOX *box = &ctx->outbox;
+	v3s16 c = ctx->spawn_block;
+	int d, maxd, by, bz, y0, y1, z0, z1;
+	int success = 1;
+	
+	maxd = 0;
+	if (c.X - box->min.X > maxd) maxd = c.X - box->min.X;
+	if (c.Y - box->min.Y > maxd) maxd = c.Y - box->min.Y;
+	if (c.Z - box->min.Z > maxd) maxd = c.Z - box->min.Z;
+	if (box->max.X - c.X > maxd) maxd = box->max.X - c.X;
+	if (box->max.Y - c.Y > maxd) maxd = box->max.Y - c.Y;
+	if (box->max.Z - c.Z > maxd) maxd = box->max.Z - c.Z;
+	
+	batch = BatchCreate(ctx, vol);
+	if (!batch)
+		return 0;
+	for (d = 0; d <= maxd && success; d++) {
+		y0 = (c.Y - d < box->min.Y) ? box->min.Y : c.Y - d;
+		y1 = (c.Y + d > box->max.Y) ? box->max.Y : c.Y + d;
+		z0 = (c.Z - d < box->min.Z) ? box->min.Z : c.Z - d;
+		z1 = (c.Z + d > box->max.Z) ? box->max.Z : c.Z + d;
+		for (by = y0; by <= y1 && success; by++) {
+			for (bz = z0; bz <= z1 && success; bz++)
+				success = AddShellRow(batch, d, by, bz);
+		}
+		
+		if (success && d == ctx->ready_radius && ctx->ready_filename)
+			success = BatchFlush(batch) && SignalReady(ctx);
+	}
+	if (success)
+		success = BatchFlush(batch);
+	
+	BatchDestroy(batch);
+	return success;
+}
+
+
+// The part of shell d in row (by, bz): the whole row across the shell on its
+// top, bottom, front and back faces, otherwise just the two ends
+static int AddShellRow(LPBLOCKBATCH batch, int d, int by, int bz) {
+	const BLOCKBOX *box = &batch->ctx->outbox;
+	v3s16 c = batch->ctx->spawn_block;
+	int bx, x0, x1;
+	int success = 1;
+	
+	x0 = c.X - d;
+	x1 = c.X + d;
+	if (abs(by - c.Y) == d || abs(bz - c.Z) == d) {
+		if (x0 < box->min.X)
+			x0 = box->min.X;
+		if (x1 > box->max.X)
+			x1 = box->max.X;
+		for (bx = x0; bx <= x1 && success; bx++)
+			success = BatchAdd(batch, bx, by, bz, -1);
+		return success;
+	}
+	
+	if (x0 >= box->min.X)
+		success = BatchAdd(batch, x0, by, bz, -1);
+	if (success && x1 <= box->max.X)
+		success = BatchAdd(batch, x1, by, bz, -1);
+	return success;
+}
+
+
+// Makes everything written so far durable, then creates the ready file.  The
+// file is written under another name and renamed into place, so whoever is
+// waiting for it never sees it empty.
+int SignalReady(LPMCCONTEXT ctx) {
+	char tmpname[1024];
+	FILE *f;
+	int i;
+	
+	if (ctx->db && !DBCommit(ctx))
+		return 0;
+	for (i = 0; i != ctx->ntargets; i++) {
+		if (ctx->targets[i]->db && !DBCommit(ctx->targets[i]))
+			return 0;
 	}
 	
-	fread(&version, 1, sizeof(version), fin);
-	if (version != 2) {
-		fprintf(stderr, "Unhandled map file version\n");
-		fclose(fin);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", ctx->ready_filename);
+	f = fopen(tmpname, "w");
+	if (!f) {
+		perror("Could not create ready file");
+		return 0;
+	}
+	fprintf(f, "spawn %d,%d,%d radius %d blocks %lu\n",
+		ctx->spawn_block.X, ctx->spawn_block.Y, ctx->spawn_block.Z,
+		ctx->ready_radius, ctx->stats.nblocks);
+	if (fclose(f) || rename(tmpname, ctx->ready_filename)) {
+		perror("Could not write ready file");
+		remove(tmpname);
+		return 0;
+	}
+	
+	ctx->ready_done = 1;
+	return 1;
+}
+
+
+static LPBLOCKBATCH BatchCreate(LPMCCONTEXT ctx, const MCVOLUME *vol) {
+	LPBLOCKBATCH batch = malloc(sizeof(BLOCKBATCH));
+	
+	if (!batch) {
+		fprintf(stderr, "Out of memory for a batch of blocks\n");
+		return NULL;
+	}
+	
+	batch->ctx   = ctx;
+	batch->vol   = vol;
+	batch->prev  = NULL;
+	batch->njobs = 0;
+	
+	// A merged batch reads and writes inside one transaction, so it can't be
+	// larger than one
+	batch->maxjobs = CONVERT_BATCH_BLOCKS;
+	if (ctx->merge && ctx->batch_size < batch->maxjobs)
+		batch->maxjobs = ctx->batch_size;
+	
+	return batch;
+}
+
+
+static int BatchAdd(LPBLOCKBATCH batch, s16 bx, s16 by, s16 bz, int wall) {
+	BLOCKJOB *job = &batch->jobs[batch->njobs++];
+	
+	memset(job, 0, sizeof(BLOCKJOB));
+	job->pos.X   = bx;
+	job->pos.Y   = by;
+	job->pos.Z   = bz;
+	job->wall    = wall;
+	job->uniform = -1;
+	
+	return (batch->njobs == batch->maxjobs) ? BatchFlush(batch) : 1;
+}
+
+
+static int BatchFlush(LPBLOCKBATCH batch) {
+	LPMCCONTEXT ctx = batch->ctx;
+	BLOCKJOB *job;
+	int i, t, success = 1;
+	
+	if (!batch->njobs)
 		return 1;
+	
+	if (ctx->merge)
+		success = BatchReadExisting(batch);
+	
+	if (success) {
+		if (!ctx->pool)
+			ctx->pool = WorkPoolCreate(ctx->nthreads);
+		if (!ctx->pool) {
+			fprintf(stderr, "Out of memory for worker threads\n");
+			success = 0;
+		}
 	}
 	
-#if 0
-	fseek(fin, 6, SEEK_CUR); // ac ed 00 05 73 72
-	for (i = 0; i != 3; i++) {
-		char *str;
-		uint16_t slen;
+	if (success) {
+		WorkPoolRun(ctx->pool, BatchJobProc, batch, batch->njobs);
 		
-		fread(&slen, 1, sizeof(slen), fin);
-		slen = SWAP2(slen);
-		str = malloc(slen + 1);
+		// Each target has its own database, so they're written side by side
+		if (ctx->ntargets) {
+			WorkPoolRun(ctx->pool, BatchWriteProc, batch, ctx->ntargets + 1);
+			for (t = 0; t <= ctx->ntargets; t++)
+				success &= batch->written[t];
+		} else {
+			success = BatchWrite(batch, 0);
+		}
+	}
+	
+	for (i = 0; i != batch->njobs; i++) {
+		job = &batch->jobs[i];
+		for (t = 0; t <= ctx->ntargets; t++)
+			free(job->out[t].blob);
+		MergeFreeBlock(job->merged);
+		free(job->old);
+	}
+	
+	batch->njobs = 0;
+	return success;
+}
+
+
+static void BatchWriteProc(void *arg, int item, int worker) {
+	LPBLOCKBATCH batch = arg;
+	
+	batch->written[item] = BatchWrite(batch, item);
+}
+
+
+// Writes out one target's blocks in order.  Templates and the merge cache of
+// a target are only touched from the thread writing it.
+static int BatchWrite(LPBLOCKBATCH batch, int target) {
+	LPMCCONTEXT ctx = target ? batch->ctx->targets[target - 1] : batch->ctx;
+	BLOCKJOB *job;
+	BLOCKOUT *out;
+	int i, success = 1;
+	
+	for (i = 0; i != batch->njobs && success; i++) {
+		job = &batch->jobs[i];
+		out = &job->out[target];
+		if (job->keep)
+			continue;
 		
-		fread(str, slen, 1, fin);
-		str[slen] = 0;
+		if (job->failed)
+			success = 0;
+		else if (out->blob)
+			success = DBSaveBlob(ctx, job->pos, out->blob, out->len,
+				ctx->summary ? &out->summary : NULL);
+		else if (job->wall >= 0)
+			success = SaveTemplate(ctx, job->pos, GetWallTemplate(ctx, job->wall));
+		else
+			success = SaveTemplate(ctx, job->pos, GetUniformTemplate(ctx, job->uniform));
 		
-		printf("str: %s\n", str);
-		free(str);
+		if (success && job->merged) {
+			ctx->stats.nmerged++;
+			MergeCacheInsert(&ctx->cache, job->merged);
+			job->merged = NULL;
+		}
 	}
-#endif
 	
+	// A live import never keeps the write lock while the next batch is
+	// serialized, whatever the batch size
+	if (success && ctx->live && ctx->db)
+		success = DBCommit(ctx);
 	
-	fseek(fin, MCC_MAPDATA_OFFSET, SEEK_SET);
-	u8 *mcdata = malloc(MAP_NNODES);
-	int nread = fread(mcdata, MAP_NNODES, 1, fin);
-	if (nread != 1) {
-		fprintf(stderr, "Failed to read node data\n");
-		return 1;
-	}
+	return success;
+}
 
-	ConvertMCToMT(mcdata);
-	CreateWalls();
-	//free(mcdata);
 
-	printf("done!\n");
+static void BatchDestroy(LPBLOCKBATCH batch) {
+	batch->njobs = 0;
+	free(batch);
+}
 
-	if (m_database_read)
-		sqlite3_finalize(m_database_read);
-	if (m_database_write)
-		sqlite3_finalize(m_database_write);
-	if (m_database)
-		sqlite3_close(m_database);
 
-	return 0;
+static int BatchReadExisting(LPBLOCKBATCH batch) {
+	LPMCCONTEXT ctx = batch->ctx;
+	BLOCKJOB *jobs = batch->jobs;
+	READRUN run;
+	int i, j, k, nmissing;
+	
+	if (!DBVerify(ctx))
+		return 0;
+	
+	// Blocks are read in the transaction they're written back in, so a live
+	// server can't change one in between
+	if (!ctx->txn_open && !DBBegin(ctx))
+		return 0;
+	
+	for (i = 0; i < batch->njobs; i = j) {
+		// A run of neighbours along X is a single range of keys
+		for (j = i + 1; j < batch->njobs; j++) {
+			if (jobs[j].pos.Y != jobs[i].pos.Y || jobs[j].pos.Z != jobs[i].pos.Z ||
+				jobs[j].pos.X != jobs[j - 1].pos.X + 1)
+				break;
+		}
+		
+		// Entries found here stay cached through the batch: at most
+		// CONVERT_BATCH_BLOCKS are inserted before they're used, which
+		// can't push them out of a cache twice that size
+		nmissing = 0;
+		for (k = i; k != j; k++) {
+			jobs[k].old_decoded = MergeCacheLookup(&ctx->cache,
+				MapBlockPosToInteger(jobs[k].pos));
+			if (!jobs[k].old_decoded)
+				nmissing++;
+		}
+		if (!nmissing)
+			continue;
+		
+		run.batch = batch;
+		run.first = i;
+		run.count = j - i;
+		if (!DBReadRange(ctx, MapBlockPosToInteger(jobs[i].pos),
+			MapBlockPosToInteger(jobs[j - 1].pos), BatchReadProc, &run))
+			return 0;
+	}
+	
+	return 1;
 }
 
 
-void ConvertMCToMT(u8 *mcdata) {
-	int bx, by, bz;
-	MapBlock *block = malloc(sizeof(MapBlock));
-	
-	for (by = 0; by != MAP_NBLOCKS_Y; by++) {
-		for (bz = 0; bz != MAP_NBLOCKS_Z; bz++) {
-			for (bx = 0; bx != MAP_NBLOCKS_X; bx++) {
-				
-				CopyMapBlockFromMC(mcdata, bx, by, bz, block->data);
-				block->pos.X = bx;
-				block->pos.Y = by;
-				block->pos.Z = bz;
-				DBSaveMapBlock(block);
+static void BatchReadProc(void *arg, sqlite3_int64 pos, const u8 *data, size_t len) {
+	READRUN *run = arg;
+	BLOCKJOB *job;
+	int k;
+	
+	k = MapBlockIntegerToPos(pos).X - run->batch->jobs[run->first].pos.X;
+	if (k < 0 || k >= run->count)
+		return;
+	
+	job = &run->batch->jobs[run->first + k];
+	if (job->old_decoded || !len)
+		return;
+	
+	job->old = malloc(len);
+	if (!job->old) {
+		fprintf(stderr, "Out of memory reading existing blocks\n");
+		job->failed = 1;
+		return;
+	}
+	job->old_len = len;
+	memcpy(job->old, data, len);
+}
+
+
+static void BatchJobProc(void *arg, int item, int worker) {
+	LPBLOCKBATCH batch = arg;
+	LPMCCONTEXT ctx = batch->ctx;
+	LPSERIALIZER ser = &ctx->ser[worker];
+	BLOCKJOB *job = &batch->jobs[item];
+	LPDECODEDBLOCK old;
+	LPMCCONTEXT target;
+	int lo[3], hi[3];
+	int t, nomem;
+	
+	if (job->failed)
+		return;
+	
+	if (batch->prev && job->wall < 0) {
+		GetSourceRange(batch->vol, ctx->scale, job->pos.X, job->pos.Y, job->pos.Z, lo, hi);
+		if (VolumeRangeEqual(batch->prev, batch->vol, lo[0], lo[1], lo[2],
+			hi[0] - lo[0] + 1, hi[1] - lo[1] + 1, hi[2] - lo[2] + 1)) {
+			job->keep = 1;
+			return;
+		}
+	}
+	
+	// Blocks of a single node type (open sky, solid ground and, when
+	// upscaling, most blocks) reuse a serialized template
+	if (job->wall < 0)
+		job->uniform = GetUniformSource(batch->vol, ctx->scale,
+			job->pos.X, job->pos.Y, job->pos.Z);
+	
+	if (job->old || job->old_decoded) {
+		// Nothing but air on top of an existing block leaves it unchanged
+		if (job->uniform == 0) {
+			job->keep = 1;
+			return;
+		}
+		
+		old = job->old_decoded;
+		if (!old) {
+			old = MergeDecode(ser, MapBlockPosToInteger(job->pos), job->old,
+				job->old_len, &nomem);
+			if (!old) {
+				job->failed = nomem;
+				job->keep   = !nomem;
+				return;
 			}
 		}
+		
+		BatchCopySource(batch, job, ser->block.data);
+		job->merged = MergeOverlay(ser, ctx->names, old, ser->block.data);
+		if (old != job->old_decoded)
+			MergeFreeBlock(old);
+		if (!job->merged) {
+			fprintf(stderr, "Out of memory merging block\n");
+			job->failed = 1;
+			return;
+		}
+		
+		BatchKeepBlob(job, 0, ctx, ser, MergeEncode(ctx, ser, job->merged));
+		return;
+	}
+	
+	if (job->wall >= 0 || job->uniform >= 0)
+		return;
+	
+	ser->block.pos = job->pos;
+	if (!ctx->ntargets) {
+		BatchCopySource(batch, job, ser->block.data);
+		BatchKeepBlob(job, 0, ctx, ser, MapBlockSerialize(ctx, ser, &ser->block));
+		return;
+	}
+	
+	// Serializing rewrites the nodes to block-local ids, so each target
+	// starts from a fresh copy of the block extracted once
+	BatchCopySource(batch, job, ser->source);
+	for (t = 0; t <= ctx->ntargets; t++) {
+		target = t ? ctx->targets[t - 1] : ctx;
+		memcpy(ser->block.data, ser->source, MAP_BLOCKNUMNODES * sizeof(MapNode));
+		if (!BatchKeepBlob(job, t, target, ser, MapBlockSerialize(target, ser, &ser->block)))
+			return;
 	}
-	free(block);
 }
 
 
-void CopyMapBlockFromMC(u8 *mcdata, s16 bx, s16 by, s16 bz, MapNode *blockdata) {
-	int x, y, z;
-	int i = 0;
+// Holds on to the block just serialized for a target until it's written
+static int BatchKeepBlob(BLOCKJOB *job, int target, LPMCCONTEXT ctx,
+						LPSERIALIZER ser, size_t len) {
+	BLOCKOUT *out = &job->out[target];
 	
-	bx *= MAP_BLOCKSIZE;
-	by *= MAP_BLOCKSIZE;
-	bz *= MAP_BLOCKSIZE;
+	if (!len) {
+		job->failed = 1;
+		return 0;
+	}
 	
-	bx = 255 - bx;
+	out->blob = malloc(len);
+	if (!out->blob) {
+		fprintf(stderr, "Out of memory holding serialized blocks\n");
+		job->failed = 1;
+		return 0;
+	}
+	out->len  = len;
+	memcpy(out->blob, ser->outbuf, len);
+	if (ctx->summary)
+		out->summary = ser->summary;
+	return 1;
+}
+
+
+static void BatchCopySource(LPBLOCKBATCH batch, BLOCKJOB *job, MapNode *nodes) {
+	int i;
+	
+	if (job->wall >= 0) {
+		FillWallBlock(job->wall, nodes);
+	} else if (job->uniform >= 0) {
+		for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+			nodes[i].param0 = job->uniform;
+			nodes[i].param1 = 0x0F;
+			nodes[i].param2 = 0;
+		}
+	} else if (batch->ctx->scale == 1) {
+		CopyMapBlockFromMC(batch->vol, job->pos.X, job->pos.Y, job->pos.Z, nodes);
+	} else {
+		CopyScaledMapBlockFromMC(batch->vol, batch->ctx->scale,
+			job->pos.X, job->pos.Y, job->pos.Z, nodes);
+	}
+	
+	if (job->wall < 0 && job->uniform < 0 && batch->vol->param2) {
+		CopyParam2FromMC(batch->vol, batch->ctx->scale,
+			job->pos.X, job->pos.Y, job->pos.Z, nodes);
+	}
+}
+
+
+// Copies the block whose first row starts at base, which is the node with the
+// highest source X since X is inverted.  Rows are rowstride apart along Z and
+// planestride apart along Y; given constants, the compiler folds them into
+// the addressing.
+static inline void CopyBlockRows(const u8 *base, size_t rowstride, size_t planestride,
+								MapNode *blockdata) {
+	int x, y, z;
+	int i = 0;
 	
 	for (z = 0; z != MAP_BLOCKSIZE; z++) {
 		for (y = 0; y != MAP_BLOCKSIZE; y++) {
-			// X coordinate needs to be inverted for some reason
+			const u8 *row = base + z * rowstride + y * planestride;
 			for (x = 0; x != MAP_BLOCKSIZE; x++) {
-				int index = MINDEX(bx - x, by + y, bz + z);
-				blockdata[i].param0 = mcdata[index];
+				blockdata[i].param0 = row[-x];
 				blockdata[i].param1 = 0x0F; // full lighting in daytime for now
 				blockdata[i].param2 = 0;
 				i++;
@@ -164,136 +622,551 @@ void CopyMapBlockFromMC(u8 *mcdata, s16 bx, s16 by, s16 bz, MapNode *blockdata)
 }
 
 
-void CreateWalls() {
-	int bx, by, bz;
+// Same as CopyBlockRows, for a packed volume.  Each row is unpacked with the
+// whole-group loop since blocks always start on a group boundary.
+static void CopyPackedBlockRows(const MCVOLUME *vol, int sx, int sy, int sz,
+								MapNode *blockdata) {
+	u8 row[MAP_BLOCKSIZE];
 	int x, y, z;
-	int i;
-	MapBlock *mblock = malloc(sizeof(MapBlock));
-	MapBlock *block  = malloc(sizeof(MapBlock));
+	int i = 0;
 	
-	////////////////-y
-	i = 0;
 	for (z = 0; z != MAP_BLOCKSIZE; z++) {
 		for (y = 0; y != MAP_BLOCKSIZE; y++) {
+			VolumeUnpack(vol->alloc, VolumeIndex(vol, sx - (MAP_BLOCKSIZE - 1), sy + y, sz + z),
+				MAP_BLOCKSIZE, row);
 			for (x = 0; x != MAP_BLOCKSIZE; x++) {
-				mblock->data[i].param0 = (y == MAP_BLOCKSIZE - 1) ? 7 : 0;
-				mblock->data[i].param1 = 0x0F;
-				mblock->data[i].param2 = 0;
+				blockdata[i].param0 = row[MAP_BLOCKSIZE - 1 - x];
+				blockdata[i].param1 = 0x0F;
+				blockdata[i].param2 = 0;
 				i++;
 			}
 		}
 	}
-	for (bz = 0; bz != MAP_NBLOCKS_Z; bz++) {
-		for (bx = 0; bx != MAP_NBLOCKS_X; bx++) {
-			block->pos.X = bx;
-			block->pos.Y = -1;
-			block->pos.Z = bz;
-			
-			memcpy(block->data, mblock->data, sizeof(block->data));
-			DBSaveMapBlock(block);
+}
+
+
+static inline int UniformRows(const u8 *base, int n, int ny, int nz,
+							size_t rowstride, size_t planestride) {
+	int y, z;
+	u8 id = base[0];
+	
+	for (y = 0; y != ny; y++) {
+		for (z = 0; z != nz; z++) {
+			const u8 *row = base + y * planestride + z * rowstride;
+			if (row[0] != id || memcmp(row, row + 1, n - 1))
+				return -1;
 		}
 	}
 	
-	////////////////-x
-	i = 0;
-	for (z = 0; z != MAP_BLOCKSIZE; z++) {
-		for (y = 0; y != MAP_BLOCKSIZE; y++) {
-			for (x = 0; x != MAP_BLOCKSIZE; x++) {
-				mblock->data[i].param0 = (x == MAP_BLOCKSIZE - 1) ? 7 : 0;
-				mblock->data[i].param1 = 0x0F;
-				mblock->data[i].param2 = 0;
-				i++;
-			}
+	return id;
+}
+
+
+static int UniformPackedRows(const MCVOLUME *vol, int sx, int sy, int sz,
+							int n, int ny, int nz) {
+	u8 row[MAP_BLOCKSIZE];
+	int y, z;
+	int id = VolumeNode(vol, sx, sy, sz);
+	
+	for (y = 0; y != ny; y++) {
+		for (z = 0; z != nz; z++) {
+			VolumeUnpack(vol->alloc, VolumeIndex(vol, sx, sy + y, sz + z), n, row);
+			if (row[0] != id || memcmp(row, row + 1, n - 1))
+				return -1;
 		}
 	}
-	for (bz = 0; bz != MAP_NBLOCKS_Z; bz++) {
-		for (by = 0; by != MAP_NBLOCKS_Y / 2; by++) {
-			block->pos.X = -1;
-			block->pos.Y = by;
-			block->pos.Z = bz;
-			
-			memcpy(block->data, mblock->data, sizeof(block->data));
-			DBSaveMapBlock(block);
-		}
+	
+	return id;
+}
+
+
+// Volumes as wide as the common Classic map sizes get kernels specialized
+// for their strides.  Height doesn't enter into the addressing, so only the
+// width and length need to match.
+#define SQUARE_VOLUME_CASES(stmt) \
+	case 128:  { const size_t w = 128;  stmt; } break; \
+	case 256:  { const size_t w = 256;  stmt; } break; \
+	case 512:  { const size_t w = 512;  stmt; } break; \
+	case 1024: { const size_t w = 1024; stmt; } break;
+
+#define SQUARE_VOLUME_WIDTH(vol) (((vol)->cx == (vol)->cz) ? (vol)->cx : 0)
+
+
+void CopyMapBlockFromMC(const MCVOLUME *vol, s16 bx, s16 by, s16 bz, MapNode *blockdata) {
+	const u8 *base;
+	
+	bx *= MAP_BLOCKSIZE;
+	by *= MAP_BLOCKSIZE;
+	bz *= MAP_BLOCKSIZE;
+	
+	// X coordinate needs to be inverted for some reason
+	bx = vol->map_cx - 1 - bx;
+	if (vol->packed) {
+		CopyPackedBlockRows(vol, bx, by, bz, blockdata);
+		return;
 	}
+	base = vol->data + VolumeIndex(vol, bx, by, bz);
+	
+	switch (SQUARE_VOLUME_WIDTH(vol)) {
+		SQUARE_VOLUME_CASES(CopyBlockRows(base, w, w * w, blockdata))
+		default:
+			CopyBlockRows(base, vol->cx, (size_t)vol->cx * vol->cz, blockdata);
+	}
+}
+
+
+void CopyScaledMapBlockFromMC(const MCVOLUME *vol, int scale,
+							s16 bx, s16 by, s16 bz, MapNode *blockdata) {
+	int xoff[MAP_BLOCKSIZE];
+	u8 rowbuf[MAP_BLOCKSIZE];
+	int x, y, z, sx0, sy, sz, span;
+	int prev_sy, prev_sz = -1;
+	MapNode *out = blockdata;
+	
+	bx *= MAP_BLOCKSIZE;
+	by *= MAP_BLOCKSIZE;
+	bz *= MAP_BLOCKSIZE;
+	
+	// Each source node covers scale output nodes along every axis.  Build the
+	// row once from the source row through an index table, then replicate
+	// whole rows and slices that map to the same source row or slice rather
+	// than reading the source again.
+	sx0 = vol->map_cx - 1 - bx / scale;
+	for (x = 0; x != MAP_BLOCKSIZE; x++)
+		xoff[x] = (bx + x) / scale - bx / scale;
+	span = xoff[MAP_BLOCKSIZE - 1] + 1;
 	
-	////////////////+x
-	i = 0;
 	for (z = 0; z != MAP_BLOCKSIZE; z++) {
+		sz = (bz + z) / scale;
+		if (sz == prev_sz) {
+			memcpy(out, out - MAP_BLOCKSIZE * MAP_BLOCKSIZE,
+				MAP_BLOCKSIZE * MAP_BLOCKSIZE * sizeof(MapNode));
+			out += MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+			continue;
+		}
+		prev_sz = sz;
+		
+		prev_sy = -1;
 		for (y = 0; y != MAP_BLOCKSIZE; y++) {
-			for (x = 0; x != MAP_BLOCKSIZE; x++) {
-				mblock->data[i].param0 = (x == 0) ? 7 : 0;
-				mblock->data[i].param1 = 0x0F;
-				mblock->data[i].param2 = 0;
-				i++;
+			sy = (by + y) / scale;
+			if (sy == prev_sy) {
+				memcpy(out, out - MAP_BLOCKSIZE, MAP_BLOCKSIZE * sizeof(MapNode));
+				out += MAP_BLOCKSIZE;
+				continue;
 			}
-		}
-	}
-	for (bz = 0; bz != MAP_NBLOCKS_Z; bz++) {
-		for (by = 0; by != MAP_NBLOCKS_Y / 2; by++) {
-			block->pos.X = MAP_NBLOCKS_X;
-			block->pos.Y = by;
-			block->pos.Z = bz;
+			prev_sy = sy;
 			
-			memcpy(block->data, mblock->data, sizeof(block->data));
-			DBSaveMapBlock(block);
+			// Rows are fetched from their lowest X, so point back at sx0
+			const u8 *row = VolumeRow(vol, sx0 - span + 1, sy, sz, span, rowbuf) + span - 1;
+			for (x = 0; x != MAP_BLOCKSIZE; x++) {
+				out[x].param0 = row[-xoff[x]];
+				out[x].param1 = 0x0F;
+				out[x].param2 = 0;
+			}
+			out += MAP_BLOCKSIZE;
 		}
 	}
+}
+
+
+// Fills in param2 of a block already copied by CopyMapBlockFromMC or
+// CopyScaledMapBlockFromMC, for a volume whose liquids were settled.  Pages
+// are looked up once per source row.
+void CopyParam2FromMC(const MCVOLUME *vol, int scale,
+					s16 bx, s16 by, s16 bz, MapNode *blockdata) {
+	int x, y, z, sx, sy, sz;
+	MapNode *out = blockdata;
+	
+	bx *= MAP_BLOCKSIZE;
+	by *= MAP_BLOCKSIZE;
+	bz *= MAP_BLOCKSIZE;
 	
-	////////////////-z
-	i = 0;
 	for (z = 0; z != MAP_BLOCKSIZE; z++) {
+		sz = (bz + z) / scale;
 		for (y = 0; y != MAP_BLOCKSIZE; y++) {
+			sy = (by + y) / scale;
 			for (x = 0; x != MAP_BLOCKSIZE; x++) {
-				mblock->data[i].param0 = (z == MAP_BLOCKSIZE - 1) ? 7 : 0;
-				mblock->data[i].param1 = 0x0F;
-				mblock->data[i].param2 = 0;
-				i++;
+				sx = vol->map_cx - 1 - (bx + x) / scale;
+				out[x].param2 = VolumeParam2(vol, sx, sy, sz);
 			}
+			out += MAP_BLOCKSIZE;
 		}
 	}
-	for (by = 0; by != MAP_NBLOCKS_Y / 2; by++) {
-		for (bx = 0; bx != MAP_NBLOCKS_X; bx++) {
-			block->pos.X = bx;
-			block->pos.Y = by;
-			block->pos.Z = -1;
-			
-			memcpy(block->data, mblock->data, sizeof(block->data));
-			DBSaveMapBlock(block);
+}
+
+
+// Source node range under an output block, inclusive, in source (unflipped)
+// coordinates
+static void GetSourceRange(const MCVOLUME *vol, int scale, s16 bx, s16 by, s16 bz,
+						int *lo, int *hi) {
+	lo[0] = vol->map_cx - 1 - (bx * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1) / scale;
+	hi[0] = vol->map_cx - 1 - (bx * MAP_BLOCKSIZE) / scale;
+	lo[1] = (by * MAP_BLOCKSIZE) / scale;
+	hi[1] = (by * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1) / scale;
+	lo[2] = (bz * MAP_BLOCKSIZE) / scale;
+	hi[2] = (bz * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1) / scale;
+}
+
+
+int GetUniformSource(const MCVOLUME *vol, int scale, s16 bx, s16 by, s16 bz) {
+	int lo[3], hi[3];
+	int n, ny, nz, id;
+	const u8 *base;
+	
+	GetSourceRange(vol, scale, bx, by, bz, lo, hi);
+	n  = hi[0] - lo[0] + 1;
+	ny = hi[1] - lo[1] + 1;
+	nz = hi[2] - lo[2] + 1;
+	
+	if (vol->packed) {
+		id = UniformPackedRows(vol, lo[0], lo[1], lo[2], n, ny, nz);
+	} else {
+		base = vol->data + VolumeIndex(vol, lo[0], lo[1], lo[2]);
+		switch (SQUARE_VOLUME_WIDTH(vol)) {
+			SQUARE_VOLUME_CASES(id = UniformRows(base, n, ny, nz, w, w * w))
+			default:
+				id = UniformRows(base, n, ny, nz, vol->cx, (size_t)vol->cx * vol->cz);
 		}
 	}
 	
+	// Settled flowing liquid varies in param2, which templates don't carry
+	if (vol->param2 && LiquidIsFlowing(id))
+		return -1;
+	return id;
+}
+
+
+int CreateWalls(LPMCCONTEXT ctx) {
+	LPBLOCKBATCH batch;
+	int bx, by, bz;
+	int success = 1;
+	const BLOCKBOX *box = &ctx->outbox;
+	int wall_top;
+	
+	// Every wall block of a side is identical apart from its position, so
+	// each side is serialized once and the blob re-emitted
+	wall_top = GetWallTop(box);
+	batch = BatchCreate(ctx, NULL);
+	if (!batch)
+		return 0;
+	
+	////////////////-y
+	for (bz = box->min.Z; bz <= box->max.Z; bz++) {
+		for (bx = box->min.X; bx <= box->max.X; bx++)
+			success &= BatchAdd(batch, bx, box->min.Y - 1, bz, WALL_BOTTOM);
+	}
+	
+	////////////////-x
+	for (bz = box->min.Z; bz <= box->max.Z; bz++) {
+		for (by = box->min.Y; by != wall_top; by++)
+			success &= BatchAdd(batch, box->min.X - 1, by, bz, WALL_WEST);
+	}
+	
+	////////////////+x
+	for (bz = box->min.Z; bz <= box->max.Z; bz++) {
+		for (by = box->min.Y; by != wall_top; by++)
+			success &= BatchAdd(batch, box->max.X + 1, by, bz, WALL_EAST);
+	}
+	
+	////////////////-z
+	for (by = box->min.Y; by != wall_top; by++) {
+		for (bx = box->min.X; bx <= box->max.X; bx++)
+			success &= BatchAdd(batch, bx, by, box->min.Z - 1, WALL_SOUTH);
+	}
+	
 	////////////////+z
+	for (by = box->min.Y; by != wall_top; by++) {
+		for (bx = box->min.X; bx <= box->max.X; bx++)
+			success &= BatchAdd(batch, bx, by, box->max.Z + 1, WALL_NORTH);
+	}
+	
+	success &= BatchFlush(batch);
+	BatchDestroy(batch);
+	return success;
+}
+
+
+// The side walls cover the lower half of the converted box; returns the
+// first block row above them
+int GetWallTop(const BLOCKBOX *box) {
+	return box->min.Y + (box->max.Y - box->min.Y + 2) / 2;
+}
+
+
+// Fills counts with the number of blocks CreateWalls writes on each side
+int CountWallBlocks(LPMCCONTEXT ctx, int *counts) {
+	const BLOCKBOX *box = &ctx->outbox;
+	int nx, ny, nz;
+	
+	nx = box->max.X - box->min.X + 1;
+	ny = GetWallTop(box) - box->min.Y;
+	nz = box->max.Z - box->min.Z + 1;
+	
+	counts[WALL_BOTTOM] = nx * nz;
+	counts[WALL_WEST]   = nz * ny;
+	counts[WALL_EAST]   = nz * ny;
+	counts[WALL_SOUTH]  = nx * ny;
+	counts[WALL_NORTH]  = nx * ny;
+	
+	return nx * nz + 2 * nz * ny + 2 * nx * ny;
+}
+
+
+LPTEMPLATEBLOB GetWallTemplate(LPMCCONTEXT ctx, int wall) {
+	MapBlock *mblock;
+	
+	if (ctx->wall_templates[wall])
+		return ctx->wall_templates[wall];
+	
+	mblock = malloc(sizeof(MapBlock));
+	if (!mblock)
+		return NULL;
+	FillWallBlock(wall, mblock->data);
+	ctx->wall_templates[wall] = MakeTemplate(ctx, mblock);
+	
+	free(mblock);
+	return ctx->wall_templates[wall];
+}
+
+
+void FillWallBlock(int wall, MapNode *nodes) {
+	int x, y, z;
+	int i, solid;
+	
 	i = 0;
 	for (z = 0; z != MAP_BLOCKSIZE; z++) {
 		for (y = 0; y != MAP_BLOCKSIZE; y++) {
 			for (x = 0; x != MAP_BLOCKSIZE; x++) {
-				mblock->data[i].param0 = (z == 0) ? 7 : 0;
-				mblock->data[i].param1 = 0x0F;
-				mblock->data[i].param2 = 0;
+				switch (wall) {
+					case WALL_BOTTOM:
+						solid = (y == MAP_BLOCKSIZE - 1);
+						break;
+					case WALL_WEST:
+						solid = (x == MAP_BLOCKSIZE - 1);
+						break;
+					case WALL_EAST:
+						solid = (x == 0);
+						break;
+					case WALL_SOUTH:
+						solid = (z == MAP_BLOCKSIZE - 1);
+						break;
+					default:
+						solid = (z == 0);
+				}
+				nodes[i].param0 = solid ? 7 : 0;
+				nodes[i].param1 = 0x0F;
+				nodes[i].param2 = 0;
 				i++;
 			}
 		}
 	}
-	for (by = 0; by != MAP_NBLOCKS_Y / 2; by++) {
-		for (bx = 0; bx != MAP_NBLOCKS_X; bx++) {
-			block->pos.X = bx;
-			block->pos.Y = by;
-			block->pos.Z = MAP_NBLOCKS_Z;
-			
-			memcpy(block->data, mblock->data, sizeof(block->data));
-			DBSaveMapBlock(block);
-		}
+}
+
+
+LPTEMPLATEBLOB GetUniformTemplate(LPMCCONTEXT ctx, u8 id) {
+	MapBlock *mblock;
+	int i;
+	
+	if (ctx->uniform_templates[id])
+		return ctx->uniform_templates[id];
+	
+	mblock = malloc(sizeof(MapBlock));
+	if (!mblock)
+		return NULL;
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+		mblock->data[i].param0 = id;
+		mblock->data[i].param1 = 0x0F;
+		mblock->data[i].param2 = 0;
 	}
 	
-	free(block);
+	ctx->uniform_templates[id] = MakeTemplate(ctx, mblock);
+	
 	free(mblock);
+	return ctx->uniform_templates[id];
+}
+
+
+// Returns NULL if the block can't be serialized or memory runs out
+LPTEMPLATEBLOB MakeTemplate(LPMCCONTEXT ctx, MapBlock *block) {
+	LPTEMPLATEBLOB tmpl;
+	size_t len;
+	
+	tmpl = malloc(sizeof(TEMPLATEBLOB));
+	if (!tmpl)
+		return NULL;
+	MapBlockSummarize(ctx->names, block->data, &tmpl->summary);
+	
+	len = MapBlockSerialize(ctx, &ctx->ser[0], block);
+	tmpl->blob = len ? malloc(len) : NULL;
+	if (!tmpl->blob) {
+		free(tmpl);
+		return NULL;
+	}
+	tmpl->len = len;
+	memcpy(tmpl->blob, ctx->ser[0].outbuf, len);
+	
+	return tmpl;
+}
+
+
+void FreeTemplate(LPTEMPLATEBLOB tmpl) {
+	if (!tmpl)
+		return;
+	
+	free(tmpl->blob);
+	free(tmpl);
+}
+
+
+int SaveTemplate(LPMCCONTEXT ctx, v3s16 pos, LPTEMPLATEBLOB tmpl) {
+	if (!tmpl) {
+		fprintf(stderr, "ERROR: Template block could not be made\n");
+		return 0;
+	}
+	
+	return DBSaveBlob(ctx, pos, tmpl->blob, tmpl->len,
+		ctx->summary ? &tmpl->summary : NULL);
 }
 
 
 /////////////////// Zlib wrappers
 
 
+size_t ZLibDeflaterCompress(LPDEFLATER d, const u8 *data, size_t datalen, u8 *out, size_t outmax) {
+	int status;
+	
+	if (!d->ready) {
+		d->z.zalloc = Z_NULL;
+		d->z.zfree  = Z_NULL;
+		d->z.opaque = Z_NULL;
+		if (deflateInit2(&d->z, d->level, Z_DEFLATED, MAX_WBITS, 8, d->strategy) != Z_OK) {
+			fprintf(stderr, "ZLibDeflaterCompress: deflateInit2 failed\n");
+			return 0;
+		}
+		d->ready = 1;
+	} else {
+		deflateReset(&d->z);
+	}
+	
+	d->z.next_in   = (Bytef *)data;
+	d->z.avail_in  = datalen;
+	d->z.next_out  = out;
+	d->z.avail_out = outmax;
+	status = deflate(&d->z, Z_FINISH);
+	if (status != Z_STREAM_END) {
+		fprintf(stderr, "ZLibDeflaterCompress: deflate failed\n");
+		return 0;
+	}
+	
+	return outmax - d->z.avail_out;
+}
+
+
+// Deflates without the zlib header and trailer, so the output can be
+// stitched into a larger stream.  With Z_FULL_FLUSH the output ends on a
+// byte boundary and nothing after it refers back into it.
+size_t ZLibDeflaterRawCompress(LPDEFLATER d, const u8 *data, size_t datalen,
+							u8 *out, size_t outmax, int flush) {
+	int status;
+	
+	if (!d->ready) {
+		d->z.zalloc = Z_NULL;
+		d->z.zfree  = Z_NULL;
+		d->z.opaque = Z_NULL;
+		if (deflateInit2(&d->z, d->level, Z_DEFLATED, -MAX_WBITS, 8, d->strategy) != Z_OK) {
+			fprintf(stderr, "ZLibDeflaterRawCompress: deflateInit2 failed\n");
+			return 0;
+		}
+		d->ready = 1;
+	} else {
+		deflateReset(&d->z);
+	}
+	
+	d->z.next_in   = (Bytef *)data;
+	d->z.avail_in  = datalen;
+	d->z.next_out  = out;
+	d->z.avail_out = outmax;
+	status = deflate(&d->z, flush);
+	if ((flush == Z_FINISH) ? status != Z_STREAM_END :
+		(status != Z_OK || d->z.avail_in || !d->z.avail_out)) {
+		fprintf(stderr, "ZLibDeflaterRawCompress: deflate failed\n");
+		return 0;
+	}
+	
+	return outmax - d->z.avail_out;
+}
+
+
+// Takes effect from the next block; the stream is set up again on first use
+void ZLibDeflaterSetParams(LPDEFLATER d, int level, int strategy) {
+	ZLibDeflaterEnd(d);
+	d->level    = level;
+	d->strategy = strategy;
+}
+
+
+void ZLibDeflaterEnd(LPDEFLATER d) {
+	if (d->ready)
+		deflateEnd(&d->z);
+	d->ready = 0;
+}
+
+
+// Inflates one zlib stream from the front of data, reporting how much of data
+// it took up.  With no output buffer the inflated bytes are thrown away.
+// Returns the inflated size, or (size_t)-1 if the stream is bad or too big.
+size_t ZLibInflaterDecompress(LPINFLATER inf, const u8 *data, size_t datalen,
+							u8 *out, size_t outmax, size_t *consumed) {
+	u8 discard[4096];
+	size_t total = 0, avail;
+	int status;
+	
+	if (!inf->ready) {
+		inf->z.zalloc   = Z_NULL;
+		inf->z.zfree    = Z_NULL;
+		inf->z.opaque   = Z_NULL;
+		inf->z.next_in  = Z_NULL;
+		inf->z.avail_in = 0;
+		if (inflateInit(&inf->z) != Z_OK) {
+			fprintf(stderr, "ZLibInflaterDecompress: inflateInit failed\n");
+			return (size_t)-1;
+		}
+		inf->ready = 1;
+	} else {
+		inflateReset(&inf->z);
+	}
+	
+	inf->z.next_in  = (Bytef *)data;
+	inf->z.avail_in = datalen;
+	do {
+		if (out) {
+			inf->z.next_out  = out + total;
+			inf->z.avail_out = outmax - total;
+		} else {
+			inf->z.next_out  = discard;
+			inf->z.avail_out = sizeof(discard);
+		}
+		avail  = inf->z.avail_out;
+		status = inflate(&inf->z, Z_NO_FLUSH);
+		total += avail - inf->z.avail_out;
+	} while (status == Z_OK);
+	
+	if (status != Z_STREAM_END)
+		return (size_t)-1;
+	
+	*consumed = datalen - inf->z.avail_in;
+	return total;
+}
+
+
+void ZLibInflaterEnd(LPINFLATER inf) {
+	if (inf->ready)
+		inflateEnd(&inf->z);
+	inf->ready = 0;
+}
+
+
+
 int ZLibCompress(u8 *data, size_t datalen, u8 **out, size_t *outlen) {
 	z_stream z;
 	int status = 0;
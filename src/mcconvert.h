@@ -29,7 +29,12 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <time.h>
+
 #include <sqlite3.h>
+#include <zlib.h>
+
+#include "libmcconvert.h"
 
 #define MAP_BLOCKSIZE 16
 #define MAP_BLOCKNUMNODES (MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE)
@@ -44,19 +49,21 @@
 					
 #define OUTPUT_FILENAME "tehmap.sqlite"
 
-// These parameters need to be guessed
+// Layout assumed when the header can't be parsed; see mapheader.c
 #define MCC_MAP_CX 256
 #define MCC_MAP_CY 64
 #define MCC_MAP_CZ 256
-
 #define MCC_MAPDATA_OFFSET 20630
 
-#define MAP_NNODES (MCC_MAP_CX * MCC_MAP_CY * MCC_MAP_CZ)
-#define MAP_NBLOCKS_X (MCC_MAP_CX / MAP_BLOCKSIZE)
-#define MAP_NBLOCKS_Y (MCC_MAP_CY / MAP_BLOCKSIZE)
-#define MAP_NBLOCKS_Z (MCC_MAP_CZ / MAP_BLOCKSIZE)
+#define MCC_MAP_MAGIC      0x271bb788
+#define MCC_MAP_VERSION    2
 
-#define MINDEX(x,y,z) ((x) + ((y) * MCC_MAP_CX * MCC_MAP_CZ) + ((z) * MCC_MAP_CX))
+#define MCC_MAX_SCALE 16
+#define MCC_MAX_THREADS 64
+#define MCC_READY_RADIUS 4 // blocks around spawn written before signalling ready
+#define MCC_MAX_TARGETS 8  // worlds written alongside the main output
+#define MCC_MAX_LODS 4     // levels of detail, each half the size of the last
+#define MAP_MAX_BLOCKPOS 2047
 
 typedef int8_t   s8;
 typedef int16_t  s16;
@@ -89,6 +96,200 @@ typedef struct _MapBlock {
 	MapNode data[MAP_BLOCKNUMNODES];
 } MapBlock;
 
+// To make things easy, just guess the needed size of the buffer.
+// This seems like a generous enough amount.
+#define MAPBLOCK_MAX_SERIALIZED 0x20000
+
+// A zlib stream kept around between blocks, reset rather than reallocated.
+// Set level and strategy through ZLibDeflaterSetParams before first use.
+typedef struct _DEFLATER {
+	z_stream z;
+	int ready;
+	int level;
+	int strategy;
+} DEFLATER, *LPDEFLATER;
+
+// The param1/param2 planes of a block lit 0x0F throughout with no param2,
+// raw deflated once to be spliced after each block's content plane
+typedef struct _PLANETAIL {
+	u8 blob[128];
+	size_t len;
+	uLong adler;
+} PLANETAIL, *LPPLANETAIL;
+
+typedef struct _INFLATER {
+	z_stream z;
+	int ready;
+} INFLATER, *LPINFLATER;
+
+#include "volume.h"
+
+// Per-block digest written to the companion summary tables, so worlds can be
+// queried without inflating every block
+#define BLOCKSUMMARY_MAX_NAMES 64
+
+typedef struct _BLOCKSUMMARY {
+	s8 min_y;  // lowest non-air node within the block, -1 if all air
+	s8 max_y;  // highest non-air node within the block, -1 if all air
+	u16 nsolid;
+	int nnames;
+	const char *names[BLOCKSUMMARY_MAX_NAMES];
+	u16 counts[BLOCKSUMMARY_MAX_NAMES];
+} BLOCKSUMMARY, *LPBLOCKSUMMARY;
+
+// A block serialized once and emitted at many positions
+typedef struct _TEMPLATEBLOB {
+	u8 *blob;
+	size_t len; // 0 if the block failed to serialize
+	BLOCKSUMMARY summary;
+} TEMPLATEBLOB, *LPTEMPLATEBLOB;
+
+// Scratch state for serializing blocks, one per conversion thread
+typedef struct _SERIALIZER {
+	MapBlock block;
+	u8 *outbuf;   // MAPBLOCK_MAX_SERIALIZED bytes
+	u8 *planebuf; // uncompressed param0/param1/param2 planes
+	MapNode *source; // block as extracted, copied for each target
+	DEFLATER deflater;
+	DEFLATER rawdeflater; // headerless, for content planes of stitched streams
+	INFLATER inflater;
+	BLOCKSUMMARY summary;
+} SERIALIZER, *LPSERIALIZER;
+
+// An existing block taken apart for merging.  Everything other than the
+// nodes and the name-id mapping is carried over as it was read.
+typedef struct _DECODEDBLOCK {
+	sqlite3_int64 pos;
+	u8 version;
+	u8 flags;
+	u16 lighting_complete; // version 27 and up
+	u32 timestamp;
+	MapNode nodes[MAP_BLOCKNUMNODES]; // param0 is a block-local id
+	int nnames;
+	char **names; // indexed by block-local id, NULL where unmapped
+	
+	u8 *raw;      // metadata, static objects and node timers, back to back
+	size_t meta_len;
+	size_t objects_len;
+	size_t timers_len;
+	
+	struct _DECODEDBLOCK *hash_next;
+	struct _DECODEDBLOCK *lru_prev;
+	struct _DECODEDBLOCK *lru_next;
+} DECODEDBLOCK, *LPDECODEDBLOCK;
+
+// Most recently written merged blocks, so importing over the same area
+// again doesn't need to read and decode them back
+#define MERGECACHE_BUCKETS 1024
+#define MERGECACHE_BLOCKS  512
+
+typedef struct _MERGECACHE {
+	LPDECODEDBLOCK buckets[MERGECACHE_BUCKETS];
+	LPDECODEDBLOCK lru_head; // most recently used
+	LPDECODEDBLOCK lru_tail;
+	int count;
+} MERGECACHE, *LPMERGECACHE;
+
+enum {
+	WALL_BOTTOM,
+	WALL_WEST,
+	WALL_EAST,
+	WALL_SOUTH,
+	WALL_NORTH,
+	WALL_COUNT
+};
+
+struct _MCCONTEXT {
+	char *output_filename;
+	char *minimap_filename;
+	int walls;
+	int summary;
+	
+	int has_region;
+	BLOCKBOX region; // blocks requested, before clipping to the map
+	BLOCKBOX box;    // source blocks being converted
+	BLOCKBOX outbox; // output blocks being written, box scaled up
+	int scale;       // output nodes per source node along each axis
+	MAPINFO map;     // layout of the map being converted
+	int size_cx, size_cy, size_cz; // forced map size, 0 to use the header
+	int merge;       // overlay onto existing blocks instead of replacing them
+	int packed;      // hold the node array at 6 bits per node
+	int settle_liquids; // see LiquidSettle
+	const char **names;  // Minetest name for each Classic ID, node_names by default
+	const char **mapping; // loaded names, owned
+	LPMCVOLUME synced;    // map as of the last MCCSyncFile, NULL before the first
+	
+	// Further worlds converted from the same extraction, each with its own
+	// mapping and database; see BatchFlush
+	int ntargets;
+	struct _MCCONTEXT *targets[MCC_MAX_TARGETS];
+	
+	// Downsampled worlds written after the map; see MCCConvertLods
+	int nlods;
+	struct _MCCONTEXT *lods[MCC_MAX_LODS];
+	
+	// Spawn-first ordering; see ConvertMCToMT
+	int spawn_first;
+	int has_spawn;   // spawn given in output node coordinates, else the map's
+	int spawn_x, spawn_y, spawn_z;
+	v3s16 spawn_block; // output block the shells grow from
+	int ready_radius;  // in blocks
+	char *ready_filename;
+	int ready_done;
+	int deflate_level;    // zlib settings for node data
+	int deflate_strategy;
+	int autotune;         // MCC_TUNE_* goal to calibrate for first
+	double autotune_slack; // percent slower than the fastest MCC_TUNE_SMALLEST may be
+	MCCPROFILE profile;   // measured by the last calibration
+	double estimate; // fraction of blocks to sample instead of converting, 0 if off
+	MCCESTIMATE est;
+	
+	int nthreads;
+	struct _WORKPOOL *pool; // created on first use
+	LPSERIALIZER ser;       // one per thread, ser[0] belongs to the caller
+	MERGECACHE cache;
+	
+	sqlite3 *db;
+	sqlite3_stmt *db_read;
+	sqlite3_stmt *db_read_range;
+	sqlite3_stmt *db_write;
+	sqlite3_stmt *db_list;
+	sqlite3_stmt *db_summary_write;
+	sqlite3_stmt *db_nodes_clear;
+	sqlite3_stmt *db_nodes_write;
+	
+	LPBLOCKSUMMARY cur_summary; // summary of the block being sunk, if any
+	
+	// Transaction batching; a batch is committed once it holds batch_size
+	// blocks or has been open for txn_budget seconds, whichever is first
+	int batch_size;
+	double txn_budget;
+	int txn_open;
+	int txn_nblocks;
+	double txn_started;
+	double txn_ended;
+	
+	// Cooperative import into a world that's open elsewhere
+	int live;
+	int busy_timeout; // ms
+	int vfs_buffer;   // write through the buffered VFS; see vfsbuf.c
+	double rate_blocks; // blocks/sec, 0 for unlimited
+	double rate_bytes;  // bytes/sec, 0 for unlimited
+	double throttle_start;
+	
+	MCCSINKPROC sink;
+	void *sink_arg;
+	
+	// Serialization state kept warm for the life of the context
+	u8 meta_blob[16];
+	size_t meta_len;
+	PLANETAIL plane_tail;
+	LPTEMPLATEBLOB wall_templates[WALL_COUNT];
+	LPTEMPLATEBLOB uniform_templates[256]; // indexed by Classic node ID
+	
+	MCCSTATS stats;
+};
+
 
 static inline void WriteU64(u8 *data, u64 i) {
 	data[0] = ((i >> 56) & 0xff);
@@ -140,10 +341,40 @@ static inline void WriteU8(u8 *data, u8 i) {
 	data += sizeof(u64); \
 }
 
+static inline double TimeNow(void) {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int ZLibCompress(u8 *data, size_t datalen, u8 **out, size_t *outlen);
+size_t ZLibDeflaterCompress(LPDEFLATER d, const u8 *data, size_t datalen, u8 *out, size_t outmax);
+size_t ZLibDeflaterRawCompress(LPDEFLATER d, const u8 *data, size_t datalen,
+							u8 *out, size_t outmax, int flush);
+void ZLibDeflaterSetParams(LPDEFLATER d, int level, int strategy);
+void ZLibDeflaterEnd(LPDEFLATER d);
+size_t ZLibInflaterDecompress(LPINFLATER inf, const u8 *data, size_t datalen,
+							u8 *out, size_t outmax, size_t *consumed);
+void ZLibInflaterEnd(LPINFLATER inf);
 int ZLibDecompress(u8 *data, size_t datalen, u8 **out, size_t *outlen);
-void CopyMapBlockFromMC(u8 *mcdata, s16 bx, s16 by, s16 bz, MapNode *blockdata);
-void ConvertMCToMT(u8 *mcdata);
-void CreateWalls();
+void CopyMapBlockFromMC(const MCVOLUME *vol, s16 bx, s16 by, s16 bz, MapNode *blockdata);
+void CopyScaledMapBlockFromMC(const MCVOLUME *vol, int scale,
+							s16 bx, s16 by, s16 bz, MapNode *blockdata);
+void CopyParam2FromMC(const MCVOLUME *vol, int scale,
+					s16 bx, s16 by, s16 bz, MapNode *blockdata);
+int GetUniformSource(const MCVOLUME *vol, int scale, s16 bx, s16 by, s16 bz);
+int ConvertMCToMT(LPMCCONTEXT ctx, const MCVOLUME *vol);
+int ConvertChangedBlocks(LPMCCONTEXT ctx, const MCVOLUME *vol, const MCVOLUME *prev);
+int SignalReady(LPMCCONTEXT ctx);
+int CreateWalls(LPMCCONTEXT ctx);
+void FillWallBlock(int wall, MapNode *nodes);
+int GetWallTop(const BLOCKBOX *box);
+int CountWallBlocks(LPMCCONTEXT ctx, int *counts);
+LPTEMPLATEBLOB GetWallTemplate(LPMCCONTEXT ctx, int wall);
+LPTEMPLATEBLOB GetUniformTemplate(LPMCCONTEXT ctx, u8 id);
+LPTEMPLATEBLOB MakeTemplate(LPMCCONTEXT ctx, MapBlock *block);
+void FreeTemplate(LPTEMPLATEBLOB tmpl);
+int SaveTemplate(LPMCCONTEXT ctx, v3s16 pos, LPTEMPLATEBLOB tmpl);
 
 #endif //MCCONVERT_HEADER
@@ -0,0 +1,719 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * merge.c -
+ *    Taking apart existing map blocks, overlaying converted nodes onto them
+ *    and putting them back together
+ */
+
+#include "mcconvert.h"
+#include "mapcontent.h"
+#include "merge.h"
+
+// Bounds-checked cursor over a serialized block
+typedef struct _READER {
+	const u8 *p;
+	const u8 *end;
+	int error;
+} READER;
+
+static const u8 *ReadBytes(READER *r, size_t n);
+static u8 ReadU8(READER *r);
+static u16 ReadU16(READER *r);
+static u32 ReadU32(READER *r);
+static int MergeSkipZlib(LPSERIALIZER ser, READER *r, const u8 **start, size_t *len);
+static int MergeSkipObjects(READER *r, const u8 **start, size_t *len);
+static int MergeFilterMeta(LPSERIALIZER ser, const u8 *meta, size_t meta_len,
+	const u8 *overwritten, u8 **out, size_t *out_len);
+static size_t MergeFilterTimers(u8 *timers, size_t len, const u8 *overwritten);
+static int MergeNameId(LPDECODEDBLOCK blk, const char *name);
+static int MergeSummarize(const DECODEDBLOCK *blk, const u8 *used, LPBLOCKSUMMARY summary);
+static void MergeCacheUnlink(LPMERGECACHE cache, LPDECODEDBLOCK blk);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Versions 25 through 28 share a layout; 29 and up compress the whole block
+// with zstd and are not handled.  Returns NULL if the block can't be merged,
+// setting *nomem if that is for want of memory.
+LPDECODEDBLOCK MergeDecode(LPSERIALIZER ser, sqlite3_int64 pos, const u8 *data, size_t len,
+						   int *nomem) {
+	LPDECODEDBLOCK blk;
+	READER r;
+	const u8 *meta, *objects, *timers, *p;
+	size_t meta_len, objects_len, timers_len, consumed, n;
+	u16 count, id, namelen;
+	char **names;
+	int i;
+	
+	*nomem = 0;
+	if (!len || data[0] < MERGE_MIN_VERSION || data[0] > MERGE_MAX_VERSION) {
+		fprintf(stderr, "WARNING: block %lld has unsupported version %d, left as is\n",
+			pos, len ? data[0] : -1);
+		return NULL;
+	}
+	
+	blk = calloc(1, sizeof(DECODEDBLOCK));
+	if (!blk)
+		goto nomem;
+	blk->pos     = pos;
+	blk->version = data[0];
+	
+	r.p     = data + 1;
+	r.end   = data + len;
+	r.error = 0;
+	
+	blk->flags = ReadU8(&r);
+	if (blk->version >= 27)
+		blk->lighting_complete = ReadU16(&r);
+	if (ReadU8(&r) != 2 || ReadU8(&r) != 2 || r.error)
+		goto corrupt;
+	
+	// Node data; the planes are inflated straight into the scratch buffer
+	n = ZLibInflaterDecompress(&ser->inflater, r.p, r.end - r.p, ser->planebuf,
+		MAP_BLOCKNUMNODES * sizeof(MapNode), &consumed);
+	if (n != MAP_BLOCKNUMNODES * sizeof(MapNode))
+		goto corrupt;
+	r.p += consumed;
+	
+	p = ser->planebuf;
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+		blk->nodes[i].param0 = (p[2 * i] << 8) | p[2 * i + 1];
+		blk->nodes[i].param1 = p[2 * MAP_BLOCKNUMNODES + i];
+		blk->nodes[i].param2 = p[3 * MAP_BLOCKNUMNODES + i];
+	}
+	
+	if (!MergeSkipZlib(ser, &r, &meta, &meta_len) ||
+		!MergeSkipObjects(&r, &objects, &objects_len))
+		goto corrupt;
+	
+	blk->timestamp = ReadU32(&r);
+	
+	// Name-id mapping
+	if (ReadU8(&r) != 0)
+		goto corrupt;
+	count = ReadU16(&r);
+	for (i = 0; i != count && !r.error; i++) {
+		id      = ReadU16(&r);
+		namelen = ReadU16(&r);
+		p = ReadBytes(&r, namelen);
+		if (r.error)
+			break;
+		
+		if (id >= blk->nnames) {
+			names = realloc(blk->names, (id + 1) * sizeof(char *));
+			if (!names)
+				goto nomem;
+			memset(names + blk->nnames, 0, (id + 1 - blk->nnames) * sizeof(char *));
+			blk->names  = names;
+			blk->nnames = id + 1;
+		}
+		free(blk->names[id]);
+		blk->names[id] = malloc(namelen + 1);
+		if (!blk->names[id])
+			goto nomem;
+		memcpy(blk->names[id], p, namelen);
+		blk->names[id][namelen] = 0;
+	}
+	
+	// Node timers run to the end of the block
+	timers = r.p;
+	n = ReadU8(&r);
+	count = ReadU16(&r);
+	ReadBytes(&r, (size_t)count * n);
+	timers_len = r.p - timers;
+	if (r.error)
+		goto corrupt;
+	
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+		id = blk->nodes[i].param0;
+		if (id >= blk->nnames || !blk->names[id])
+			goto corrupt;
+	}
+	
+	blk->raw = malloc(meta_len + objects_len + timers_len);
+	if (!blk->raw)
+		goto nomem;
+	memcpy(blk->raw, meta, meta_len);
+	memcpy(blk->raw + meta_len, objects, objects_len);
+	memcpy(blk->raw + meta_len + objects_len, timers, timers_len);
+	blk->meta_len    = meta_len;
+	blk->objects_len = objects_len;
+	blk->timers_len  = timers_len;
+	
+	return blk;
+
+corrupt:
+	fprintf(stderr, "WARNING: block %lld could not be decoded, left as is\n", pos);
+	MergeFreeBlock(blk);
+	return NULL;
+
+nomem:
+	fprintf(stderr, "Out of memory decoding block %lld\n", pos);
+	MergeFreeBlock(blk);
+	*nomem = 1;
+	return NULL;
+}
+
+
+// Returns a copy of old with every non-air node of src, which holds Classic
+// IDs named by names, written over it.  As when Minetest replaces a node, the
+// metadata and timers of the nodes written over are dropped.  Returns NULL if
+// out of memory.
+LPDECODEDBLOCK MergeOverlay(LPSERIALIZER ser, const char **names, const DECODEDBLOCK *old,
+							const MapNode *src) {
+	int local_ids[ARRAYLEN(node_names)];
+	u8 overwritten[MAP_BLOCKNUMNODES];
+	LPDECODEDBLOCK blk;
+	u8 *meta = NULL;
+	size_t meta_len = 0, raw_len;
+	int i, id;
+	u16 global_id;
+	
+	blk = malloc(sizeof(DECODEDBLOCK));
+	if (!blk)
+		return NULL;
+	memcpy(blk, old, sizeof(DECODEDBLOCK));
+	blk->hash_next = NULL;
+	blk->lru_prev  = NULL;
+	blk->lru_next  = NULL;
+	blk->raw       = NULL;
+	
+	blk->names = calloc(blk->nnames ? blk->nnames : 1, sizeof(char *));
+	if (!blk->names) {
+		free(blk);
+		return NULL;
+	}
+	for (i = 0; i != blk->nnames; i++) {
+		if (old->names[i] && !(blk->names[i] = strdup(old->names[i]))) {
+			MergeFreeBlock(blk);
+			return NULL;
+		}
+	}
+	
+	// The name-id mapping becomes the union of both; existing ids are kept
+	// so untouched nodes don't need rewriting
+	for (i = 0; i != ARRAYLEN(node_names); i++)
+		local_ids[i] = -1;
+	
+	memset(overwritten, 0, sizeof(overwritten));
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+		global_id = src[i].param0;
+		if (!global_id || global_id >= ARRAYLEN(node_names) || !*names[global_id])
+			continue;
+		
+		id = local_ids[global_id];
+		if (id < 0)
+			id = local_ids[global_id] = MergeNameId(blk, names[global_id]);
+		if (id < 0) {
+			MergeFreeBlock(blk);
+			return NULL;
+		}
+		
+		blk->nodes[i].param0 = id;
+		blk->nodes[i].param1 = src[i].param1;
+		blk->nodes[i].param2 = src[i].param2;
+		overwritten[i] = 1;
+	}
+	
+	if (!MergeFilterMeta(ser, old->raw, old->meta_len, overwritten, &meta, &meta_len)) {
+		MergeFreeBlock(blk);
+		return NULL;
+	}
+	if (!meta)
+		meta_len = old->meta_len;
+	
+	raw_len  = meta_len + old->objects_len + old->timers_len;
+	blk->raw = malloc(raw_len ? raw_len : 1);
+	if (!blk->raw) {
+		free(meta);
+		MergeFreeBlock(blk);
+		return NULL;
+	}
+	memcpy(blk->raw, meta ? meta : old->raw, meta_len);
+	memcpy(blk->raw + meta_len, old->raw + old->meta_len, old->objects_len + old->timers_len);
+	blk->meta_len   = meta_len;
+	blk->timers_len = MergeFilterTimers(blk->raw + meta_len + old->objects_len,
+		old->timers_len, overwritten);
+	free(meta);
+	
+	return blk;
+}
+
+
+// Serializes into ser->outbuf in the block's own version, writing only the
+// names still in use
+size_t MergeEncode(LPMCCONTEXT ctx, LPSERIALIZER ser, const DECODEDBLOCK *blk) {
+	u8 *outbuf = ser->outbuf;
+	u8 *os = outbuf;
+	const u8 *raw = blk->raw;
+	u8 *used;
+	size_t len, need;
+	int i, nused;
+	
+	used = calloc(blk->nnames ? blk->nnames : 1, 1);
+	if (!used)
+		return 0;
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++)
+		used[blk->nodes[i].param0] = 1;
+	
+	need = blk->meta_len + blk->objects_len + blk->timers_len + 4 + 3;
+	nused = 0;
+	for (i = 0; i != blk->nnames; i++) {
+		if (used[i]) {
+			need += 4 + strlen(blk->names[i]);
+			nused++;
+		}
+	}
+	
+	InsertU8(os, blk->version);
+	InsertU8(os, blk->flags);
+	if (blk->version >= 27)
+		InsertU16(os, blk->lighting_complete);
+	InsertU8(os, 2);
+	InsertU8(os, 2);
+	
+	len = MapNodeSerializeBulk(blk->nodes, MAP_BLOCKNUMNODES, ser,
+		&ctx->plane_tail, os, MAPBLOCK_MAX_SERIALIZED - (os - outbuf));
+	if (!len || (os - outbuf) + len + need > MAPBLOCK_MAX_SERIALIZED) {
+		free(used);
+		return 0;
+	}
+	os += len;
+	
+	memcpy(os, raw, blk->meta_len + blk->objects_len);
+	os  += blk->meta_len + blk->objects_len;
+	raw += blk->meta_len + blk->objects_len;
+	
+	InsertU32(os, blk->timestamp);
+	
+	InsertU8(os, 0);
+	InsertU16(os, nused);
+	for (i = 0; i != blk->nnames; i++) {
+		if (!used[i])
+			continue;
+		
+		len = strlen(blk->names[i]);
+		InsertU16(os, i);
+		InsertU16(os, len);
+		memcpy(os, blk->names[i], len);
+		os += len;
+	}
+	
+	memcpy(os, raw, blk->timers_len);
+	os += blk->timers_len;
+	
+	if (ctx->summary && !MergeSummarize(blk, used, &ser->summary)) {
+		free(used);
+		return 0;
+	}
+	
+	free(used);
+	return os - outbuf;
+}
+
+
+void MergeFreeBlock(LPDECODEDBLOCK blk) {
+	int i;
+	
+	if (!blk)
+		return;
+	
+	for (i = 0; i != blk->nnames; i++)
+		free(blk->names[i]);
+	free(blk->names);
+	free(blk->raw);
+	free(blk);
+}
+
+
+/////////////////// Decoded block cache
+
+
+LPDECODEDBLOCK MergeCacheLookup(LPMERGECACHE cache, sqlite3_int64 pos) {
+	LPDECODEDBLOCK blk;
+	
+	blk = cache->buckets[(u64)pos % MERGECACHE_BUCKETS];
+	while (blk && blk->pos != pos)
+		blk = blk->hash_next;
+	if (!blk)
+		return NULL;
+	
+	// Move to the front of the LRU list
+	if (blk != cache->lru_head) {
+		blk->lru_prev->lru_next = blk->lru_next;
+		if (blk->lru_next)
+			blk->lru_next->lru_prev = blk->lru_prev;
+		else
+			cache->lru_tail = blk->lru_prev;
+		
+		blk->lru_prev = NULL;
+		blk->lru_next = cache->lru_head;
+		cache->lru_head->lru_prev = blk;
+		cache->lru_head = blk;
+	}
+	
+	return blk;
+}
+
+
+// Takes ownership of blk, replacing any block cached at the same position
+void MergeCacheInsert(LPMERGECACHE cache, LPDECODEDBLOCK blk) {
+	LPDECODEDBLOCK old;
+	int bucket = (u64)blk->pos % MERGECACHE_BUCKETS;
+	
+	for (old = cache->buckets[bucket]; old; old = old->hash_next) {
+		if (old->pos == blk->pos) {
+			MergeCacheUnlink(cache, old);
+			MergeFreeBlock(old);
+			break;
+		}
+	}
+	
+	if (cache->count == MERGECACHE_BLOCKS) {
+		old = cache->lru_tail;
+		MergeCacheUnlink(cache, old);
+		MergeFreeBlock(old);
+	}
+	
+	blk->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = blk;
+	
+	blk->lru_prev = NULL;
+	blk->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = blk;
+	else
+		cache->lru_tail = blk;
+	cache->lru_head = blk;
+	cache->count++;
+}
+
+
+void MergeCacheClear(LPMERGECACHE cache) {
+	LPDECODEDBLOCK blk, next;
+	
+	for (blk = cache->lru_head; blk; blk = next) {
+		next = blk->lru_next;
+		MergeFreeBlock(blk);
+	}
+	memset(cache, 0, sizeof(MERGECACHE));
+}
+
+
+static void MergeCacheUnlink(LPMERGECACHE cache, LPDECODEDBLOCK blk) {
+	LPDECODEDBLOCK *link;
+	
+	link = &cache->buckets[(u64)blk->pos % MERGECACHE_BUCKETS];
+	while (*link != blk)
+		link = &(*link)->hash_next;
+	*link = blk->hash_next;
+	
+	if (blk->lru_prev)
+		blk->lru_prev->lru_next = blk->lru_next;
+	else
+		cache->lru_head = blk->lru_next;
+	if (blk->lru_next)
+		blk->lru_next->lru_prev = blk->lru_prev;
+	else
+		cache->lru_tail = blk->lru_prev;
+	
+	cache->count--;
+}
+
+
+/////////////////// Helpers
+
+
+static const u8 *ReadBytes(READER *r, size_t n) {
+	const u8 *p = r->p;
+	
+	if (r->error || (size_t)(r->end - r->p) < n) {
+		r->error = 1;
+		return NULL;
+	}
+	
+	r->p += n;
+	return p;
+}
+
+
+static u8 ReadU8(READER *r) {
+	const u8 *p = ReadBytes(r, 1);
+	
+	return p ? p[0] : 0;
+}
+
+
+static u16 ReadU16(READER *r) {
+	const u8 *p = ReadBytes(r, 2);
+	
+	return p ? (p[0] << 8) | p[1] : 0;
+}
+
+
+static u32 ReadU32(READER *r) {
+	const u8 *p = ReadBytes(r, 4);
+	
+	return p ? ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] : 0;
+}
+
+
+// Finds the end of a zlib stream without keeping what it inflates to
+static int MergeSkipZlib(LPSERIALIZER ser, READER *r, const u8 **start, size_t *len) {
+	size_t consumed;
+	
+	if (r->error)
+		return 0;
+	
+	if (ZLibInflaterDecompress(&ser->inflater, r->p, r->end - r->p, NULL, 0, &consumed) == (size_t)-1)
+		return 0;
+	
+	*start = r->p;
+	*len   = consumed;
+	r->p  += consumed;
+	return 1;
+}
+
+
+static int MergeSkipObjects(READER *r, const u8 **start, size_t *len) {
+	u16 count, i;
+	
+	*start = r->p;
+	ReadU8(r); // version
+	count = ReadU16(r);
+	for (i = 0; i != count && !r->error; i++) {
+		ReadU8(r);          // type
+		ReadBytes(r, 12);   // position, 3 x s32
+		ReadBytes(r, ReadU16(r));
+	}
+	*len = r->p - *start;
+	
+	return !r->error;
+}
+
+
+// Takes the nodes written over out of a zlib-compressed metadata list: a
+// version byte, which is 0 for an empty list, a count and, for each node, its
+// position, its variables and a text inventory ending in an EndInventory
+// line.  *out is left NULL when nothing is dropped.  Fails only when out of
+// memory; a list that can't be read is kept as it is.
+static int MergeFilterMeta(LPSERIALIZER ser, const u8 *meta, size_t meta_len,
+						   const u8 *overwritten, u8 **out, size_t *out_len) {
+	u8 *plain, *kept, *d;
+	const u8 *entry, *line, *nl;
+	size_t len, consumed, bound;
+	u16 count, nkept = 0, pos;
+	u32 nvars, j;
+	u8 version;
+	READER r;
+	int i;
+	
+	*out = NULL;
+	len = ZLibInflaterDecompress(&ser->inflater, meta, meta_len, NULL, 0, &consumed);
+	if (len == (size_t)-1 || len <= 1)
+		return 1;
+	
+	plain = malloc(len);
+	kept  = malloc(len);
+	if (!plain || !kept) {
+		free(plain);
+		free(kept);
+		return 0;
+	}
+	ZLibInflaterDecompress(&ser->inflater, meta, meta_len, plain, len, &consumed);
+	
+	r.p     = plain;
+	r.end   = plain + len;
+	r.error = 0;
+	
+	version = ReadU8(&r);
+	count   = ReadU16(&r);
+	d = kept + 3;
+	for (i = 0; i != count && !r.error; i++) {
+		entry = r.p;
+		pos   = ReadU16(&r);
+		nvars = ReadU32(&r);
+		for (j = 0; j != nvars && !r.error; j++) {
+			ReadBytes(&r, ReadU16(&r));
+			ReadBytes(&r, ReadU32(&r));
+			if (version >= 2)
+				ReadU8(&r);
+		}
+		
+		do {
+			line = r.p;
+			nl = r.error ? NULL : memchr(line, '\n', r.end - line);
+			if (!nl) {
+				r.error = 1;
+				break;
+			}
+			r.p = nl + 1;
+		} while (nl - line != 12 || memcmp(line, "EndInventory", 12));
+		
+		if (r.error || (pos < MAP_BLOCKNUMNODES && overwritten[pos]))
+			continue;
+		
+		memcpy(d, entry, r.p - entry);
+		d += r.p - entry;
+		nkept++;
+	}
+	
+	if (r.error || nkept == count) {
+		free(plain);
+		free(kept);
+		return 1;
+	}
+	
+	if (nkept) {
+		kept[0] = version;
+		kept[1] = nkept >> 8;
+		kept[2] = nkept & 0xFF;
+	} else {
+		kept[0] = 0;
+		d = kept + 1;
+	}
+	
+	bound = compressBound(d - kept);
+	*out  = malloc(bound);
+	if (*out)
+		*out_len = ZLibDeflaterCompress(&ser->deflater, kept, d - kept, *out, bound);
+	
+	free(plain);
+	free(kept);
+	return *out && *out_len;
+}
+
+
+// Filters timers in place, returning their new length.  Each is a fixed size
+// record starting with the node's position.
+static size_t MergeFilterTimers(u8 *timers, size_t len, const u8 *overwritten) {
+	size_t size, count, nkept = 0, i;
+	u8 *d;
+	u16 pos;
+	
+	if (len < 3)
+		return len;
+	
+	size  = timers[0];
+	count = (timers[1] << 8) | timers[2];
+	if (size < 2 || 3 + count * size != len)
+		return len;
+	
+	d = timers + 3;
+	for (i = 0; i != count; i++) {
+		pos = (timers[3 + i * size] << 8) | timers[4 + i * size];
+		if (pos < MAP_BLOCKNUMNODES && overwritten[pos])
+			continue;
+		
+		memmove(d, timers + 3 + i * size, size);
+		d += size;
+		nkept++;
+	}
+	
+	timers[1] = nkept >> 8;
+	timers[2] = nkept & 0xFF;
+	return d - timers;
+}
+
+
+// Returns -1 if out of memory
+static int MergeNameId(LPDECODEDBLOCK blk, const char *name) {
+	char **names;
+	int i, free_id = -1;
+	
+	for (i = 0; i != blk->nnames; i++) {
+		if (!blk->names[i]) {
+			if (free_id < 0)
+				free_id = i;
+		} else if (!strcmp(blk->names[i], name)) {
+			return i;
+		}
+	}
+	
+	if (free_id < 0) {
+		names = realloc(blk->names, (blk->nnames + 1) * sizeof(char *));
+		if (!names)
+			return -1;
+		blk->names = names;
+		free_id = blk->nnames++;
+		blk->names[free_id] = NULL;
+	}
+	blk->names[free_id] = strdup(name);
+	
+	return blk->names[free_id] ? free_id : -1;
+}
+
+
+// Returns 0 if out of memory
+static int MergeSummarize(const DECODEDBLOCK *blk, const u8 *used, LPBLOCKSUMMARY summary) {
+	u16 *counts;
+	u8 *is_air;
+	int i, y;
+	u16 id;
+	
+	counts = calloc(blk->nnames, sizeof(u16));
+	is_air = calloc(blk->nnames, 1);
+	if (!counts || !is_air) {
+		free(is_air);
+		free(counts);
+		return 0;
+	}
+	for (i = 0; i != blk->nnames; i++) {
+		if (used[i])
+			is_air[i] = !strcmp(blk->names[i], "air");
+	}
+	
+	summary->min_y  = -1;
+	summary->max_y  = -1;
+	summary->nsolid = 0;
+	summary->nnames = 0;
+	
+	for (i = 0; i != MAP_BLOCKNUMNODES; i++) {
+		id = blk->nodes[i].param0;
+		counts[id]++;
+		if (!is_air[id]) {
+			y = (i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE;
+			if (summary->min_y == -1 || y < summary->min_y)
+				summary->min_y = y;
+			if (y > summary->max_y)
+				summary->max_y = y;
+			summary->nsolid++;
+		}
+	}
+	
+	for (i = 0; i != blk->nnames && summary->nnames != BLOCKSUMMARY_MAX_NAMES; i++) {
+		if (!counts[i])
+			continue;
+		
+		summary->names[summary->nnames]  = blk->names[i];
+		summary->counts[summary->nnames] = counts[i];
+		summary->nnames++;
+	}
+	
+	free(is_air);
+	free(counts);
+	return 1;
+}
@@ -0,0 +1,42 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MERGE_HEADER
+#define MERGE_HEADER
+
+// Block versions sharing the layout MergeDecode reads
+#define MERGE_MIN_VERSION 25
+#define MERGE_MAX_VERSION 28
+
+LPDECODEDBLOCK MergeDecode(LPSERIALIZER ser, sqlite3_int64 pos, const u8 *data, size_t len,
+						   int *nomem);
+LPDECODEDBLOCK MergeOverlay(LPSERIALIZER ser, const char **names, const DECODEDBLOCK *old,
+							const MapNode *src);
+size_t MergeEncode(LPMCCONTEXT ctx, LPSERIALIZER ser, const DECODEDBLOCK *blk);
+void MergeFreeBlock(LPDECODEDBLOCK blk);
+
+LPDECODEDBLOCK MergeCacheLookup(LPMERGECACHE cache, sqlite3_int64 pos);
+void MergeCacheInsert(LPMERGECACHE cache, LPDECODEDBLOCK blk);
+void MergeCacheClear(LPMERGECACHE cache);
+
+#endif // MERGE_HEADER
@@ -0,0 +1,314 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * minimap.c -
+ *    Routines to render a shaded top-down overview of the source map, computed
+ *    directly from the in-memory node data while the conversion is underway
+ */
+
+#include "mcconvert.h"
+#include "minimap.h"
+
+#include <strings.h>
+#include <zlib.h>
+
+// Indexed by Classic node ID, same order as node_names in mapcontent.c
+static const u8 minimap_colours[][3] = {
+	{0x00, 0x00, 0x00}, //air
+	{0x7d, 0x7d, 0x7d}, //stone
+	{0x5b, 0x8c, 0x32}, //grass
+	{0x86, 0x60, 0x43}, //dirt
+	{0x6e, 0x6e, 0x6e}, //cobble
+	{0x9c, 0x7f, 0x4e}, //wood
+	{0x49, 0x8a, 0x1c}, //sapling
+	{0x33, 0x33, 0x33}, //bedrock
+	{0x2f, 0x5a, 0xc8}, //water_flowing
+	{0x2a, 0x50, 0xc0}, //water_source
+	
+	{0xd8, 0x5a, 0x10}, //lava_flowing
+	{0xcf, 0x50, 0x0c}, //lava_source
+	{0xdb, 0xd3, 0xa0}, //sand
+	{0x85, 0x7e, 0x7e}, //gravel
+	{0x7d, 0x7d, 0x5a}, //gold ore
+	{0x88, 0x82, 0x7e}, //iron ore
+	{0x73, 0x73, 0x73}, //coal ore
+	{0x66, 0x51, 0x32}, //tree
+	{0x3c, 0x7a, 0x1e}, //leaves
+	{0xe5, 0xe5, 0x4f}, //sponge
+	
+	{0xc0, 0xf5, 0xfe}, //glass
+	{0xe0, 0x3a, 0x3a}, //red
+	{0xe0, 0x90, 0x3a}, //orange
+	{0xe0, 0xe0, 0x3a}, //yellow
+	{0x90, 0xe0, 0x3a}, //lightgreen
+	{0x3a, 0xe0, 0x3a}, //green
+	{0x3a, 0xe0, 0x90}, //aquagreen
+	{0x3a, 0xe0, 0xe0}, //cyan
+	{0x6e, 0xa8, 0xe0}, //lightblue
+	{0x80, 0x80, 0xe0}, //blue
+	{0x90, 0x3a, 0xe0}, //purple
+	{0xb0, 0x5a, 0xe0}, //lightpurple
+	{0xe0, 0x3a, 0xe0}, //pink
+	{0xe0, 0x3a, 0x90}, //darkpink
+	{0x4d, 0x4d, 0x4d}, //darkgrey
+	{0x9e, 0x9e, 0x9e}, //lightgrey
+	{0xe0, 0xe0, 0xe0}, //white
+	{0xf1, 0xe5, 0x2a}, //yellow flower
+	{0xe6, 0x1c, 0x1c}, //red flower
+	{0x8a, 0x6e, 0x55}, //mushroom1
+	
+	{0xc2, 0x2e, 0x2e}, //mushroom2
+	{0xf5, 0xe2, 0x45}, //gold block
+	{0xd8, 0xd8, 0xd8}, //iron block
+	{0xa6, 0xa6, 0xa6}, //full step
+	{0xa6, 0xa6, 0xa6}, //half step
+	{0x9b, 0x52, 0x3f}, //brick
+	{0xdb, 0x44, 0x1a}, //tnt
+	{0x6b, 0x58, 0x39}, //bookshelf
+	{0x5a, 0x6e, 0x5a}, //mossycobble
+	{0x14, 0x12, 0x1e}  //obsidian
+};
+
+static void *MinimapThreadProc(void *arg);
+static int MinimapWritePNG(FILE *f, const u8 *rgb, int width, int height);
+static void PNGWriteChunk(FILE *f, const char *type, const u8 *data, u32 len);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+void MinimapBuildHeightmap(const MCVOLUME *vol, u16 *heightmap, u8 *topnode) {
+	int y, i, remaining;
+	int ncolumns = vol->cx * vol->cz;
+	u8 *planebuf = vol->packed ? malloc(ncolumns) : NULL;
+	
+	memset(heightmap, 0, ncolumns * sizeof(*heightmap));
+	memset(topnode, 0, ncolumns);
+	
+	// Sweep whole horizontal planes from the top down instead of walking each
+	// column, so the node data is read sequentially.  The topnode array doubles
+	// as the 'resolved' marker; air columns never resolve and stay 0.
+	remaining = ncolumns;
+	for (y = vol->cy - 1; y >= 0 && remaining; y--) {
+		const u8 *plane = VolumeRow(vol, vol->ox, vol->oy + y, vol->oz, ncolumns, planebuf);
+		
+		for (i = 0; i != ncolumns; i++) {
+			if (topnode[i] || !plane[i])
+				continue;
+			
+			topnode[i]   = plane[i];
+			heightmap[i] = y;
+			remaining--;
+		}
+	}
+	
+	free(planebuf);
+}
+
+
+void MinimapShade(const MCVOLUME *vol, const u16 *heightmap, const u8 *topnode, u8 *rgb) {
+	int x, z, i, c;
+	int cx = vol->cx, cz = vol->cz;
+	
+	// Output is oriented with +X (east) to the right and +Z (north) up, which
+	// means both source axes are flipped; see CopyMapBlockFromMC for X.
+	for (z = 0; z != cz; z++) {
+		for (x = 0; x != cx; x++) {
+			int src  = (cx - 1 - x) + (cz - 1 - z) * cx;
+			u8 *px   = rgb + (x + z * cx) * 3;
+			u8 id    = topnode[src];
+			int h    = heightmap[src];
+			int slope, scale;
+			
+			if (!id || id >= ARRAYLEN(minimap_colours)) {
+				px[0] = px[1] = px[2] = 0;
+				continue;
+			}
+			
+			// Light comes from the north-west; compare with the neighbour in
+			// that direction to pick out relief, then darken with depth.
+			slope = 0;
+			if (x && z)
+				slope = h - heightmap[src + 1 + cx];
+			if (slope > 4)
+				slope = 4;
+			if (slope < -4)
+				slope = -4;
+			
+			scale = 160 + (96 * (h + vol->oy)) / vol->map_cy + slope * 12;
+			for (i = 0; i != 3; i++) {
+				c = (minimap_colours[id][i] * scale) >> 8;
+				px[i] = (c > 0xFF) ? 0xFF : c;
+			}
+		}
+	}
+}
+
+
+int MinimapWrite(const char *filename, const u8 *rgb, int width, int height) {
+	FILE *f;
+	const char *ext;
+	int success;
+	
+	f = fopen(filename, "wb");
+	if (!f) {
+		perror("Could not open minimap file for write");
+		return 0;
+	}
+	
+	ext = strrchr(filename, '.');
+	if (ext && !strcasecmp(ext, ".png")) {
+		success = MinimapWritePNG(f, rgb, width, height);
+	} else {
+		fprintf(f, "P6\n%d %d\n255\n", width, height);
+		success = fwrite(rgb, width * height * 3, 1, f) == 1;
+	}
+	
+	if (fclose(f))
+		success = 0;
+	if (!success)
+		fprintf(stderr, "ERROR: Failed to write minimap %s\n", filename);
+	return success;
+}
+
+
+int MinimapGenerate(const MCVOLUME *vol, const char *filename) {
+	u16 *heightmap;
+	u8 *topnode, *rgb;
+	size_t ncolumns = (size_t)vol->cx * vol->cz;
+	int success;
+	
+	// Maps can be taller than 256 nodes
+	heightmap = malloc(ncolumns * sizeof(*heightmap));
+	topnode   = malloc(ncolumns);
+	rgb       = malloc(ncolumns * 3);
+	
+	MinimapBuildHeightmap(vol, heightmap, topnode);
+	MinimapShade(vol, heightmap, topnode, rgb);
+	success = MinimapWrite(filename, rgb, vol->cx, vol->cz);
+	
+	free(rgb);
+	free(topnode);
+	free(heightmap);
+	return success;
+}
+
+
+int MinimapStart(LPMINIMAP mm, const MCVOLUME *vol, const char *filename) {
+	mm->vol      = vol;
+	mm->filename = filename;
+	mm->status   = 0;
+	
+	// The node data is only ever read during conversion, so the minimap can
+	// share it with the converter without any locking.
+	if (pthread_create(&mm->thread, NULL, MinimapThreadProc, mm)) {
+		fprintf(stderr, "WARNING: Minimap thread failed to start, rendering inline\n");
+		mm->status = MinimapGenerate(vol, filename);
+		mm->filename = NULL;
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+int MinimapFinish(LPMINIMAP mm) {
+	if (mm->filename)
+		pthread_join(mm->thread, NULL);
+	
+	return mm->status;
+}
+
+
+static void *MinimapThreadProc(void *arg) {
+	LPMINIMAP mm = arg;
+	
+	mm->status = MinimapGenerate(mm->vol, mm->filename);
+	return NULL;
+}
+
+
+/////////////////// PNG output
+
+
+static int MinimapWritePNG(FILE *f, const u8 *rgb, int width, int height) {
+	static const u8 signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	u8 ihdr[13], *os;
+	u8 *raw, *compressed;
+	uLongf compressed_len;
+	size_t rowlen = width * 3;
+	int y;
+	
+	os = ihdr;
+	InsertU32(os, width);
+	InsertU32(os, height);
+	InsertU8(os, 8); // bit depth
+	InsertU8(os, 2); // colour type RGB
+	InsertU8(os, 0); // compression
+	InsertU8(os, 0); // filter
+	InsertU8(os, 0); // interlace
+	
+	// Every scanline is prefixed with its filter type, 0 for none
+	raw = malloc((rowlen + 1) * height);
+	for (y = 0; y != height; y++) {
+		raw[y * (rowlen + 1)] = 0;
+		memcpy(raw + y * (rowlen + 1) + 1, rgb + y * rowlen, rowlen);
+	}
+	
+	compressed_len = compressBound((rowlen + 1) * height);
+	compressed = malloc(compressed_len);
+	if (compress2(compressed, &compressed_len, raw, (rowlen + 1) * height, 6) != Z_OK) {
+		fprintf(stderr, "MinimapWritePNG: compress failed\n");
+		free(compressed);
+		free(raw);
+		return 0;
+	}
+	
+	fwrite(signature, sizeof(signature), 1, f);
+	PNGWriteChunk(f, "IHDR", ihdr, sizeof(ihdr));
+	PNGWriteChunk(f, "IDAT", compressed, compressed_len);
+	PNGWriteChunk(f, "IEND", NULL, 0);
+	
+	free(compressed);
+	free(raw);
+	return !ferror(f);
+}
+
+
+static void PNGWriteChunk(FILE *f, const char *type, const u8 *data, u32 len) {
+	u8 buf[4];
+	uLong crc;
+	
+	WriteU32(buf, len);
+	fwrite(buf, 4, 1, f);
+	fwrite(type, 4, 1, f);
+	if (len)
+		fwrite(data, len, 1, f);
+	
+	crc = crc32(0, (const Bytef *)type, 4);
+	if (len)
+		crc = crc32(crc, data, len);
+	WriteU32(buf, crc);
+	fwrite(buf, 4, 1, f);
+}
@@ -0,0 +1,43 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MINIMAP_HEADER
+#define MINIMAP_HEADER
+
+#include <pthread.h>
+
+typedef struct _MINIMAP {
+	const MCVOLUME *vol;
+	const char *filename;
+	pthread_t thread;
+	int status;
+} MINIMAP, *LPMINIMAP;
+
+void MinimapBuildHeightmap(const MCVOLUME *vol, u16 *heightmap, u8 *topnode);
+void MinimapShade(const MCVOLUME *vol, const u16 *heightmap, const u8 *topnode, u8 *rgb);
+int MinimapWrite(const char *filename, const u8 *rgb, int width, int height);
+int MinimapGenerate(const MCVOLUME *vol, const char *filename);
+int MinimapStart(LPMINIMAP mm, const MCVOLUME *vol, const char *filename);
+int MinimapFinish(LPMINIMAP mm);
+
+#endif // MINIMAP_HEADER
@@ -37,21 +37,29 @@ LPVECTOR VectorInit(unsigned int size) {
 	LPVECTOR vect;
 	
 	vect = (LPVECTOR)malloc(sizeof(VECTOR) + size * sizeof(void *));
+	if (!vect)
+		return NULL;
 	vect->numelem = 0;
 	vect->maxelem = size;
 	return vect;
 }
 
 
+// Returns NULL if out of memory, leaving *vector as it was
 LPVECTOR VectorAdd(LPVECTOR *vector, void *item) {
 	LPVECTOR v = *vector;
 	
-	if (!v)
+	if (!v) {
 		v = VectorInit(VECTOR_DEFAULT_SIZE);
+		if (!v)
+			return NULL;
+	}
 
 	if (v->numelem == v->maxelem) {
+		v = realloc(v, sizeof(VECTOR) + (v->maxelem << 1) * sizeof(void *));
+		if (!v)
+			return NULL;
 		v->maxelem <<= 1;
-		v = realloc(v, sizeof(VECTOR) + v->maxelem * sizeof(void *));
 	}
 	v->elem[v->numelem] = item;
 	v->numelem++;
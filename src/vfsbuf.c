@@ -0,0 +1,325 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * vfsbuf.c -
+ *    An SQLite VFS layered over the default one for writing large worlds
+ *    from scratch.  Writes that follow on from each other, as the pages
+ *    SQLite writes out at each commit mostly do, are gathered in memory and
+ *    written in one piece, and syncs are put off until the database is
+ *    closed.  Everything is written out before SQLite reads it back or gives
+ *    up its lock, so the file is always the one the default VFS would have
+ *    left, and any SQLite, Minetest included, opens it as usual.
+ *
+ *    The cost is that a crash or power loss before the database is closed
+ *    may leave it corrupt, as with `PRAGMA synchronous=OFF`.  Only the files
+ *    SQLite reopens later, the database and its WAL, are synced at all; a
+ *    rollback journal is deleted on commit.
+ */
+
+#include "mcconvert.h"
+#include "vfsbuf.h"
+
+#include <pthread.h>
+
+static pthread_once_t vfsbuf_once = PTHREAD_ONCE_INIT;
+static sqlite3_vfs vfsbuf_vfs;
+static int vfsbuf_registered;
+
+static void VfsBufInit(void);
+static int VfsBufOpen(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+					int flags, int *out_flags);
+static int VfsBufFlush(LPVFSBUFFILE f);
+static int VfsBufClose(sqlite3_file *file);
+static int VfsBufRead(sqlite3_file *file, void *buf, int amt, sqlite3_int64 offset);
+static int VfsBufWrite(sqlite3_file *file, const void *buf, int amt, sqlite3_int64 offset);
+static int VfsBufTruncate(sqlite3_file *file, sqlite3_int64 size);
+static int VfsBufSync(sqlite3_file *file, int flags);
+static int VfsBufFileSize(sqlite3_file *file, sqlite3_int64 *size);
+static int VfsBufLock(sqlite3_file *file, int lock);
+static int VfsBufUnlock(sqlite3_file *file, int lock);
+static int VfsBufCheckReservedLock(sqlite3_file *file, int *out);
+static int VfsBufFileControl(sqlite3_file *file, int op, void *arg);
+static int VfsBufSectorSize(sqlite3_file *file);
+static int VfsBufDeviceCharacteristics(sqlite3_file *file);
+static int VfsBufShmMap(sqlite3_file *file, int region, int size, int extend, void volatile **pp);
+static int VfsBufShmLock(sqlite3_file *file, int offset, int n, int flags);
+static void VfsBufShmBarrier(sqlite3_file *file);
+static int VfsBufShmUnmap(sqlite3_file *file, int delete_flag);
+static int VfsBufFetch(sqlite3_file *file, sqlite3_int64 offset, int amt, void **pp);
+static int VfsBufUnfetch(sqlite3_file *file, sqlite3_int64 offset, void *p);
+
+static const sqlite3_io_methods vfsbuf_io = {
+	3,
+	VfsBufClose,
+	VfsBufRead,
+	VfsBufWrite,
+	VfsBufTruncate,
+	VfsBufSync,
+	VfsBufFileSize,
+	VfsBufLock,
+	VfsBufUnlock,
+	VfsBufCheckReservedLock,
+	VfsBufFileControl,
+	VfsBufSectorSize,
+	VfsBufDeviceCharacteristics,
+	VfsBufShmMap,
+	VfsBufShmLock,
+	VfsBufShmBarrier,
+	VfsBufShmUnmap,
+	VfsBufFetch,
+	VfsBufUnfetch
+};
+
+#define REAL(file) (((LPVFSBUFFILE)(file))->real)
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Returns the name to open databases with, or NULL if it couldn't be set up
+const char *VfsBufRegister(void) {
+	pthread_once(&vfsbuf_once, VfsBufInit);
+	return vfsbuf_registered ? VFSBUF_NAME : NULL;
+}
+
+
+// Everything but opening files is left to the default VFS
+static void VfsBufInit(void) {
+	sqlite3_vfs *real = sqlite3_vfs_find(NULL);
+	
+	if (!real)
+		return;
+	
+	vfsbuf_vfs = *real;
+	vfsbuf_vfs.pNext    = NULL;
+	vfsbuf_vfs.zName    = VFSBUF_NAME;
+	vfsbuf_vfs.szOsFile = sizeof(VFSBUFFILE) + real->szOsFile;
+	vfsbuf_vfs.pAppData = real;
+	vfsbuf_vfs.xOpen    = VfsBufOpen;
+	
+	vfsbuf_registered = sqlite3_vfs_register(&vfsbuf_vfs, 0) == SQLITE_OK;
+}
+
+
+static int VfsBufOpen(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+					int flags, int *out_flags) {
+	sqlite3_vfs *real = vfs->pAppData;
+	LPVFSBUFFILE f = (LPVFSBUFFILE)file;
+	int e;
+	
+	memset(f, 0, sizeof(VFSBUFFILE));
+	f->real = (sqlite3_file *)(f + 1);
+	f->real->pMethods = NULL;
+	
+	e = real->xOpen(real, name, f->real, flags, out_flags);
+	if (e != SQLITE_OK) {
+		if (f->real->pMethods)
+			f->real->pMethods->xClose(f->real);
+		return e;
+	}
+	
+	f->base.pMethods = &vfsbuf_io;
+	f->sync_on_close = (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL)) != 0;
+	return SQLITE_OK;
+}
+
+
+static int VfsBufFlush(LPVFSBUFFILE f) {
+	size_t done, n;
+	int e = SQLITE_OK;
+	
+	for (done = 0; done != f->buf_len && e == SQLITE_OK; done += n) {
+		n = f->buf_len - done;
+		if (n > VFSBUF_WRITE_MAX)
+			n = VFSBUF_WRITE_MAX;
+		e = f->real->pMethods->xWrite(f->real, f->buf + done, n, f->buf_offset + done);
+	}
+	
+	f->buf_len = 0;
+	return e;
+}
+
+
+static int VfsBufClose(sqlite3_file *file) {
+	LPVFSBUFFILE f = (LPVFSBUFFILE)file;
+	int e, e2;
+	
+	e = VfsBufFlush(f);
+	if (e == SQLITE_OK && f->deferred && f->sync_on_close)
+		e = f->real->pMethods->xSync(f->real, SQLITE_SYNC_FULL);
+	
+	e2 = f->real->pMethods->xClose(f->real);
+	free(f->buf);
+	f->buf = NULL;
+	return (e != SQLITE_OK) ? e : e2;
+}
+
+
+static int VfsBufRead(sqlite3_file *file, void *buf, int amt, sqlite3_int64 offset) {
+	LPVFSBUFFILE f = (LPVFSBUFFILE)file;
+	int e;
+	
+	if (f->buf_len && offset < f->buf_offset + (sqlite3_int64)f->buf_len &&
+		offset + amt > f->buf_offset) {
+		e = VfsBufFlush(f);
+		if (e != SQLITE_OK)
+			return e;
+	}
+	
+	return f->real->pMethods->xRead(f->real, buf, amt, offset);
+}
+
+
+// Gathers writes continuing the buffered run, and rewrites of what's already
+// in it, such as a journal's header; anything else starts a new run
+static int VfsBufWrite(sqlite3_file *file, const void *buf, int amt, sqlite3_int64 offset) {
+	LPVFSBUFFILE f = (LPVFSBUFFILE)file;
+	sqlite3_int64 end = f->buf_offset + f->buf_len;
+	int e;
+	
+	if (f->buf_len && offset >= f->buf_offset && offset <= end &&
+		offset + amt - f->buf_offset <= VFSBUF_SIZE) {
+		memcpy(f->buf + (offset - f->buf_offset), buf, amt);
+		if (offset + amt > end)
+			f->buf_len = offset + amt - f->buf_offset;
+		return SQLITE_OK;
+	}
+	
+	e = VfsBufFlush(f);
+	if (e != SQLITE_OK)
+		return e;
+	
+	if (amt > VFSBUF_WRITE_MAX)
+		return f->real->pMethods->xWrite(f->real, buf, amt, offset);
+	
+	if (!f->buf) {
+		f->buf = malloc(VFSBUF_SIZE);
+		if (!f->buf)
+			return f->real->pMethods->xWrite(f->real, buf, amt, offset);
+	}
+	
+	memcpy(f->buf, buf, amt);
+	f->buf_offset = offset;
+	f->buf_len    = amt;
+	return SQLITE_OK;
+}
+
+
+static int VfsBufTruncate(sqlite3_file *file, sqlite3_int64 size) {
+	int e = VfsBufFlush((LPVFSBUFFILE)file);
+	
+	return (e == SQLITE_OK) ? REAL(file)->pMethods->xTruncate(REAL(file), size) : e;
+}
+
+
+// Hands the data to the OS so other handles on the file see it, but leaves
+// making it durable to the close
+static int VfsBufSync(sqlite3_file *file, int flags) {
+	LPVFSBUFFILE f = (LPVFSBUFFILE)file;
+	
+	f->deferred = 1;
+	return VfsBufFlush(f);
+}
+
+
+static int VfsBufFileSize(sqlite3_file *file, sqlite3_int64 *size) {
+	int e = VfsBufFlush((LPVFSBUFFILE)file);
+	
+	return (e == SQLITE_OK) ? REAL(file)->pMethods->xFileSize(REAL(file), size) : e;
+}
+
+
+static int VfsBufLock(sqlite3_file *file, int lock) {
+	return REAL(file)->pMethods->xLock(REAL(file), lock);
+}
+
+
+// Whoever takes the lock next must find everything written
+static int VfsBufUnlock(sqlite3_file *file, int lock) {
+	int e = VfsBufFlush((LPVFSBUFFILE)file);
+	
+	return (e == SQLITE_OK) ? REAL(file)->pMethods->xUnlock(REAL(file), lock) : e;
+}
+
+
+static int VfsBufCheckReservedLock(sqlite3_file *file, int *out) {
+	return REAL(file)->pMethods->xCheckReservedLock(REAL(file), out);
+}
+
+
+static int VfsBufFileControl(sqlite3_file *file, int op, void *arg) {
+	return REAL(file)->pMethods->xFileControl(REAL(file), op, arg);
+}
+
+
+static int VfsBufSectorSize(sqlite3_file *file) {
+	return REAL(file)->pMethods->xSectorSize(REAL(file));
+}
+
+
+static int VfsBufDeviceCharacteristics(sqlite3_file *file) {
+	return REAL(file)->pMethods->xDeviceCharacteristics(REAL(file));
+}
+
+
+static int VfsBufShmMap(sqlite3_file *file, int region, int size, int extend, void volatile **pp) {
+	if (REAL(file)->pMethods->iVersion < 2)
+		return SQLITE_IOERR_SHMMAP;
+	return REAL(file)->pMethods->xShmMap(REAL(file), region, size, extend, pp);
+}
+
+
+static int VfsBufShmLock(sqlite3_file *file, int offset, int n, int flags) {
+	if (REAL(file)->pMethods->iVersion < 2)
+		return SQLITE_IOERR_SHMLOCK;
+	return REAL(file)->pMethods->xShmLock(REAL(file), offset, n, flags);
+}
+
+
+static void VfsBufShmBarrier(sqlite3_file *file) {
+	if (REAL(file)->pMethods->iVersion >= 2)
+		REAL(file)->pMethods->xShmBarrier(REAL(file));
+}
+
+
+static int VfsBufShmUnmap(sqlite3_file *file, int delete_flag) {
+	if (REAL(file)->pMethods->iVersion < 2)
+		return SQLITE_OK;
+	return REAL(file)->pMethods->xShmUnmap(REAL(file), delete_flag);
+}
+
+
+// A mapping would show the file without what's still buffered, so SQLite is
+// always sent back to xRead
+static int VfsBufFetch(sqlite3_file *file, sqlite3_int64 offset, int amt, void **pp) {
+	*pp = NULL;
+	return SQLITE_OK;
+}
+
+
+static int VfsBufUnfetch(sqlite3_file *file, sqlite3_int64 offset, void *p) {
+	if (REAL(file)->pMethods->iVersion < 3)
+		return SQLITE_OK;
+	return REAL(file)->pMethods->xUnfetch(REAL(file), offset, p);
+}
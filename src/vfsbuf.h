@@ -0,0 +1,45 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VFSBUF_HEADER
+#define VFSBUF_HEADER
+
+#define VFSBUF_NAME "mcc-buffered"
+#define VFSBUF_SIZE (4 << 20) // bytes of consecutive writes gathered per file
+#define VFSBUF_WRITE_MAX 0x10000 // the unix VFS writes less than 128K per call
+
+// A file opened through the buffered VFS.  The default VFS's own file
+// follows it in the same allocation.
+typedef struct _VFSBUFFILE {
+	sqlite3_file base;
+	sqlite3_file *real;
+	u8 *buf;                  // VFSBUF_SIZE bytes, allocated on first write
+	sqlite3_int64 buf_offset; // file offset of buf[0]
+	size_t buf_len;
+	int sync_on_close;        // the database or its WAL, which outlive the run
+	int deferred;             // syncs not yet made
+} VFSBUFFILE, *LPVFSBUFFILE;
+
+const char *VfsBufRegister(void);
+
+#endif // VFSBUF_HEADER
@@ -0,0 +1,380 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * volume.c -
+ *    Routines to load all or part of the source node array.  Only the rows
+ *    overlapping the requested blocks are read, so converting a small region
+ *    of a large map costs about as much as the region itself.
+ */
+
+#include "mcconvert.h"
+#include "volume.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+static int VolumeSetExtent(LPMCVOLUME vol, const MAPINFO *info,
+						const BLOCKBOX *box, int packed);
+static void VolumeStore(LPMCVOLUME vol, size_t first, const u8 *src, size_t n);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Nodes past the last whole block along an axis are left out
+void VolumeFullBox(LPBLOCKBOX box, const MAPINFO *info) {
+	box->min.X = 0;
+	box->min.Y = 0;
+	box->min.Z = 0;
+	box->max.X = info->cx / MAP_BLOCKSIZE - 1;
+	box->max.Y = info->cy / MAP_BLOCKSIZE - 1;
+	box->max.Z = info->cz / MAP_BLOCKSIZE - 1;
+}
+
+
+int VolumeClipBox(LPBLOCKBOX box, const MAPINFO *info) {
+	BLOCKBOX full;
+	
+	VolumeFullBox(&full, info);
+	if (box->min.X < full.min.X) box->min.X = full.min.X;
+	if (box->min.Y < full.min.Y) box->min.Y = full.min.Y;
+	if (box->min.Z < full.min.Z) box->min.Z = full.min.Z;
+	if (box->max.X > full.max.X) box->max.X = full.max.X;
+	if (box->max.Y > full.max.Y) box->max.Y = full.max.Y;
+	if (box->max.Z > full.max.Z) box->max.Z = full.max.Z;
+	
+	return box->min.X <= box->max.X &&
+		   box->min.Y <= box->max.Y &&
+		   box->min.Z <= box->max.Z;
+}
+
+
+void VolumeWrap(LPMCVOLUME vol, const u8 *mcdata, const MAPINFO *info) {
+	vol->data  = mcdata;
+	vol->alloc = NULL;
+	vol->param2 = NULL;
+	vol->packed = 0;
+	vol->cx = info->cx;
+	vol->cy = info->cy;
+	vol->cz = info->cz;
+	vol->map_cx = info->cx;
+	vol->map_cy = info->cy;
+	vol->map_cz = info->cz;
+	vol->ox = 0;
+	vol->oy = 0;
+	vol->oz = 0;
+}
+
+
+int VolumeReadFile(LPMCVOLUME vol, int fd, const MAPINFO *info,
+					const BLOCKBOX *box, int packed) {
+	size_t rowlen, spanlen, first;
+	ssize_t n;
+	int y, z, nz;
+	u8 *span;
+	
+	if (!VolumeSetExtent(vol, info, box, packed))
+		return 0;
+	
+	// Rows of one plane are contiguous in the file when the whole width is
+	// wanted, so read each plane's Z span at once; otherwise a row at a time.
+	// Unpacked spans are read straight into the volume, packed ones through
+	// a span-sized buffer.
+	rowlen = vol->cx;
+	nz = (vol->cx == info->cx) ? vol->cz : 1;
+	spanlen = rowlen * nz;
+	
+	span = packed ? malloc(spanlen) : NULL;
+	if (packed && !span) {
+		fprintf(stderr, "Out of memory reading node data\n");
+		VolumeFree(vol);
+		return 0;
+	}
+	
+	first = 0;
+	for (y = vol->oy; y != vol->oy + vol->cy; y++) {
+		for (z = vol->oz; z != vol->oz + vol->cz; z += nz) {
+			off_t pos = info->data_offset + MapIndex(info, vol->ox, y, z);
+			u8 *dst = packed ? span : vol->alloc + first;
+			size_t done = 0;
+			
+			while (done != spanlen) {
+				n = pread(fd, dst + done, spanlen - done, pos + done);
+				if (n <= 0) {
+					if (n == -1 && errno == EINTR)
+						continue;
+					fprintf(stderr, "Failed to read node data\n");
+					free(span);
+					VolumeFree(vol);
+					return 0;
+				}
+				done += n;
+			}
+			if (packed)
+				VolumePack(vol->alloc, first, span, spanlen);
+			first += spanlen;
+		}
+	}
+	
+	free(span);
+	return 1;
+}
+
+
+int VolumeReadStream(LPMCVOLUME vol, MCCREADPROC reader, void *arg,
+					const MAPINFO *info, const BLOCKBOX *box, int packed) {
+	u8 *plane;
+	long n;
+	size_t planelen, done, first;
+	int y, z;
+	
+	if (!VolumeSetExtent(vol, info, box, packed))
+		return 0;
+	
+	// The stream can't seek, so pass over whole planes but only keep the
+	// wanted rows, and stop reading after the last wanted plane.
+	planelen = (size_t)info->cx * info->cz;
+	plane = malloc(planelen);
+	if (!plane) {
+		fprintf(stderr, "Out of memory reading node data\n");
+		VolumeFree(vol);
+		return 0;
+	}
+	first = 0;
+	
+	for (y = 0; y != vol->oy + vol->cy; y++) {
+		for (done = 0; done != planelen; done += n) {
+			n = reader(arg, plane + done, planelen - done);
+			if (n <= 0) {
+				fprintf(stderr, "Failed to read node data\n");
+				free(plane);
+				VolumeFree(vol);
+				return 0;
+			}
+		}
+		
+		if (y < vol->oy)
+			continue;
+		
+		for (z = vol->oz; z != vol->oz + vol->cz; z++) {
+			VolumeStore(vol, first, plane + MapIndex(info, vol->ox, 0, z), vol->cx);
+			first += vol->cx;
+		}
+	}
+	
+	free(plane);
+	return 1;
+}
+
+
+// Takes a copy of borrowed node data so it can be changed, and sets up the
+// param2 page table
+int VolumeMakeWritable(LPMCVOLUME vol) {
+	size_t nnodes = (size_t)vol->cx * vol->cy * vol->cz;
+	size_t npages;
+	
+	if (!vol->alloc) {
+		vol->alloc = malloc(nnodes);
+		if (!vol->alloc) {
+			fprintf(stderr, "Out of memory for %lu nodes\n", (unsigned long)nnodes);
+			return 0;
+		}
+		memcpy(vol->alloc, vol->data, nnodes);
+		vol->data = vol->alloc;
+	}
+	
+	if (!vol->param2) {
+		vol->pcx = (vol->cx + VOLUME_PAGE_SIZE - 1) / VOLUME_PAGE_SIZE;
+		vol->pcz = (vol->cz + VOLUME_PAGE_SIZE - 1) / VOLUME_PAGE_SIZE;
+		npages = (size_t)vol->pcx * vol->pcz *
+			((vol->cy + VOLUME_PAGE_SIZE - 1) / VOLUME_PAGE_SIZE);
+		vol->param2 = calloc(npages, sizeof(u8 *));
+		if (!vol->param2) {
+			fprintf(stderr, "Out of memory for param2 pages\n");
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+
+// Pages are allocated on the first nonzero param2, so threads may only set
+// nodes in different pages at once
+int VolumeSetParam2(LPMCVOLUME vol, int x, int y, int z, u8 param2) {
+	u8 **page = &vol->param2[VolumePage(vol, x, y, z)];
+	
+	if (!*page) {
+		if (!param2)
+			return 1;
+		*page = calloc(VOLUME_PAGE_SIZE * VOLUME_PAGE_SIZE * VOLUME_PAGE_SIZE, 1);
+		if (!*page)
+			return 0;
+	}
+	
+	(*page)[VolumePageOffset(vol, x, y, z)] = param2;
+	return 1;
+}
+
+
+// Whether two volumes hold the same nodes, param2 included, in the box of
+// nx * ny * nz nodes from (x0, y0, z0).  The volumes may differ in packing
+// but both must cover the box.
+int VolumeRangeEqual(const MCVOLUME *a, const MCVOLUME *b,
+					int x0, int y0, int z0, int nx, int ny, int nz) {
+	u8 abuf[MAP_BLOCKSIZE], bbuf[MAP_BLOCKSIZE];
+	const u8 *arow, *brow;
+	int x, y, z, n;
+	
+	for (y = y0; y != y0 + ny; y++) {
+		for (z = z0; z != z0 + nz; z++) {
+			for (x = x0; x < x0 + nx; x += n) {
+				n = (x0 + nx - x < MAP_BLOCKSIZE) ? x0 + nx - x : MAP_BLOCKSIZE;
+				arow = VolumeRow(a, x, y, z, n, abuf);
+				brow = VolumeRow(b, x, y, z, n, bbuf);
+				if (memcmp(arow, brow, n))
+					return 0;
+			}
+		}
+	}
+	
+	if (!a->param2 && !b->param2)
+		return 1;
+	
+	for (y = y0; y != y0 + ny; y++) {
+		for (z = z0; z != z0 + nz; z++) {
+			for (x = x0; x != x0 + nx; x++) {
+				if (VolumeParam2(a, x, y, z) != VolumeParam2(b, x, y, z))
+					return 0;
+			}
+		}
+	}
+	
+	return 1;
+}
+
+
+void VolumeFree(LPMCVOLUME vol) {
+	size_t i, npages;
+	
+	if (vol->param2) {
+		npages = (size_t)vol->pcx * vol->pcz *
+			((vol->cy + VOLUME_PAGE_SIZE - 1) / VOLUME_PAGE_SIZE);
+		for (i = 0; i != npages; i++)
+			free(vol->param2[i]);
+		free(vol->param2);
+		vol->param2 = NULL;
+	}
+	
+	free(vol->alloc);
+	vol->alloc = NULL;
+	vol->data  = NULL;
+}
+
+
+void VolumeUnpack(const u8 *packed, size_t first, size_t n, u8 *out) {
+	const u8 *p;
+	
+	for (; n && (first & 3); n--)
+		*out++ = PackedGet(packed, first++);
+	
+	// Whole groups of four nodes in three bytes
+	p = packed + first / 4 * 3;
+	for (; n >= 4; n -= 4) {
+		out[0] = p[0] & VOLUME_PACKED_MASK;
+		out[1] = (p[0] >> 6) | ((p[1] & 0x0F) << 2);
+		out[2] = (p[1] >> 4) | ((p[2] & 0x03) << 4);
+		out[3] = p[2] >> 2;
+		p   += 3;
+		out += 4;
+		first += 4;
+	}
+	
+	for (; n; n--)
+		*out++ = PackedGet(packed, first++);
+}
+
+
+// first and n must be multiples of four, which whole rows always are.  IDs
+// too large to pack become VOLUME_PACKED_MASK, which is just as invalid as a
+// node name and gets the same treatment when the block is serialized.
+void VolumePack(u8 *packed, size_t first, const u8 *src, size_t n) {
+	u8 *p = packed + first / 4 * 3;
+	u8 a, b, c, d;
+	size_t i;
+	
+	for (i = 0; i != n; i += 4) {
+		a = (src[i]     > VOLUME_PACKED_MASK) ? VOLUME_PACKED_MASK : src[i];
+		b = (src[i + 1] > VOLUME_PACKED_MASK) ? VOLUME_PACKED_MASK : src[i + 1];
+		c = (src[i + 2] > VOLUME_PACKED_MASK) ? VOLUME_PACKED_MASK : src[i + 2];
+		d = (src[i + 3] > VOLUME_PACKED_MASK) ? VOLUME_PACKED_MASK : src[i + 3];
+		p[0] = a | (b << 6);
+		p[1] = (b >> 2) | (c << 4);
+		p[2] = (c >> 4) | (d << 2);
+		p += 3;
+	}
+}
+
+
+static void VolumeStore(LPMCVOLUME vol, size_t first, const u8 *src, size_t n) {
+	if (vol->packed)
+		VolumePack(vol->alloc, first, src, n);
+	else
+		memcpy(vol->alloc + first, src, n);
+}
+
+
+static int VolumeSetExtent(LPMCVOLUME vol, const MAPINFO *info,
+						const BLOCKBOX *box, int packed) {
+	size_t nnodes, len;
+	
+	vol->map_cx = info->cx;
+	vol->map_cy = info->cy;
+	vol->map_cz = info->cz;
+	
+	// Output X runs opposite to source X; see CopyMapBlockFromMC
+	vol->ox = info->cx - (box->max.X + 1) * MAP_BLOCKSIZE;
+	vol->oy = box->min.Y * MAP_BLOCKSIZE;
+	vol->oz = box->min.Z * MAP_BLOCKSIZE;
+	vol->cx = (box->max.X - box->min.X + 1) * MAP_BLOCKSIZE;
+	vol->cy = (box->max.Y - box->min.Y + 1) * MAP_BLOCKSIZE;
+	vol->cz = (box->max.Z - box->min.Z + 1) * MAP_BLOCKSIZE;
+	
+	// One spare byte lets PackedGet read two bytes for the last node
+	nnodes = (size_t)vol->cx * vol->cy * vol->cz;
+	len = packed ? nnodes / 4 * 3 + 1 : nnodes;
+	
+	vol->packed = packed;
+	vol->param2 = NULL;
+	vol->alloc  = malloc(len);
+	vol->data   = packed ? NULL : vol->alloc;
+	if (!vol->alloc) {
+		fprintf(stderr, "Out of memory for %lu nodes\n", (unsigned long)nnodes);
+		return 0;
+	}
+	if (packed)
+		vol->alloc[len - 1] = 0;
+	
+	return 1;
+}
@@ -0,0 +1,166 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VOLUME_HEADER
+#define VOLUME_HEADER
+
+// Layout of the map file, read from its header
+typedef struct _MAPINFO {
+	int cx, cy, cz;     // size in nodes; cy is the vertical extent
+	size_t data_offset; // of the node array from the start of the file
+	int has_spawn;
+	int spawn_x, spawn_y, spawn_z; // source node coordinates
+} MAPINFO, *LPMAPINFO;
+
+// A range of MapBlocks in output (Minetest) block coordinates, inclusive
+typedef struct _BLOCKBOX {
+	v3s16 min;
+	v3s16 max;
+} BLOCKBOX, *LPBLOCKBOX;
+
+// Some or all of the source node array.  Layout matches the map file, rows
+// along X, then Z, then Y, but only the cx * cy * cz nodes starting at source
+// coordinates (ox, oy, oz) are held.  A packed volume keeps its nodes in alloc
+// at VOLUME_PACKED_BITS each and leaves data NULL; read those through
+// VolumeNode and VolumeRow.
+//
+// Nodes only have a param2 once liquids are settled.  It's kept in pages of
+// VOLUME_PAGE_SIZE nodes on a side, in VolumeIndex order within the page, and
+// a page that would be all 0 is never allocated.
+typedef struct _MCVOLUME {
+	const u8 *data;
+	u8 *alloc;      // storage owned by the volume, NULL if data is borrowed
+	int packed;
+	int cx, cy, cz;
+	int ox, oy, oz;
+	int map_cx, map_cy, map_cz; // size of the whole map
+	u8 **param2;    // NULL if every param2 is 0
+	int pcx, pcz;   // pages along X and Z
+} MCVOLUME, *LPMCVOLUME;
+
+#define VOLUME_PAGE_SIZE 16
+
+static inline size_t VolumeIndex(const MCVOLUME *vol, int x, int y, int z) {
+	return (x - vol->ox) +
+		   (size_t)(y - vol->oy) * vol->cx * vol->cz +
+		   (size_t)(z - vol->oz) * vol->cx;
+}
+
+// Every Classic node ID fits in 6 bits.  Nodes are stored in VolumeIndex
+// order, least significant bits first, so four nodes fill three bytes and
+// each row, being a multiple of 16 nodes, starts on a byte boundary.
+#define VOLUME_PACKED_BITS 6
+#define VOLUME_PACKED_MASK 0x3F
+
+static inline u8 PackedGet(const u8 *packed, size_t i) {
+	size_t bit = i * VOLUME_PACKED_BITS;
+	unsigned int v = packed[bit >> 3] | (packed[(bit >> 3) + 1] << 8);
+	
+	return (v >> (bit & 7)) & VOLUME_PACKED_MASK;
+}
+
+void VolumeUnpack(const u8 *packed, size_t first, size_t n, u8 *out);
+void VolumePack(u8 *packed, size_t first, const u8 *src, size_t n);
+
+// Only touches the bytes holding node i, so threads may set nodes in
+// different rows at once
+static inline void PackedSet(u8 *packed, size_t i, u8 id) {
+	size_t bit = i * VOLUME_PACKED_BITS;
+	unsigned int v = packed[bit >> 3] | (packed[(bit >> 3) + 1] << 8);
+	
+	v = (v & ~(VOLUME_PACKED_MASK << (bit & 7))) | (id << (bit & 7));
+	packed[bit >> 3] = v;
+	if ((bit & 7) + VOLUME_PACKED_BITS > 8)
+		packed[(bit >> 3) + 1] = v >> 8;
+}
+
+static inline u8 VolumeNode(const MCVOLUME *vol, int x, int y, int z) {
+	size_t i = VolumeIndex(vol, x, y, z);
+	
+	return vol->packed ? PackedGet(vol->alloc, i) : vol->data[i];
+}
+
+// The volume must own its storage
+static inline void VolumeSetNode(LPMCVOLUME vol, int x, int y, int z, u8 id) {
+	size_t i = VolumeIndex(vol, x, y, z);
+	
+	if (vol->packed)
+		PackedSet(vol->alloc, i, id);
+	else
+		vol->alloc[i] = id;
+}
+
+static inline size_t VolumePage(const MCVOLUME *vol, int x, int y, int z) {
+	return (size_t)((y - vol->oy) / VOLUME_PAGE_SIZE) * vol->pcx * vol->pcz +
+		   ((z - vol->oz) / VOLUME_PAGE_SIZE) * vol->pcx +
+		   (x - vol->ox) / VOLUME_PAGE_SIZE;
+}
+
+static inline int VolumePageOffset(const MCVOLUME *vol, int x, int y, int z) {
+	return ((x - vol->ox) % VOLUME_PAGE_SIZE) +
+		   ((y - vol->oy) % VOLUME_PAGE_SIZE) * VOLUME_PAGE_SIZE * VOLUME_PAGE_SIZE +
+		   ((z - vol->oz) % VOLUME_PAGE_SIZE) * VOLUME_PAGE_SIZE;
+}
+
+static inline u8 VolumeParam2(const MCVOLUME *vol, int x, int y, int z) {
+	const u8 *page;
+	
+	if (!vol->param2)
+		return 0;
+	page = vol->param2[VolumePage(vol, x, y, z)];
+	return page ? page[VolumePageOffset(vol, x, y, z)] : 0;
+}
+
+// n nodes running along +X from (x, y, z).  A packed volume unpacks them
+// into buf, which must have room for n nodes; otherwise the volume's own
+// storage is returned and buf is untouched.
+static inline const u8 *VolumeRow(const MCVOLUME *vol, int x, int y, int z,
+								size_t n, u8 *buf) {
+	size_t i = VolumeIndex(vol, x, y, z);
+	
+	if (!vol->packed)
+		return vol->data + i;
+	
+	VolumeUnpack(vol->alloc, i, n, buf);
+	return buf;
+}
+
+// Index of a node within the map file's node array
+static inline size_t MapIndex(const MAPINFO *info, int x, int y, int z) {
+	return x + (size_t)y * info->cx * info->cz + (size_t)z * info->cx;
+}
+
+void VolumeFullBox(LPBLOCKBOX box, const MAPINFO *info);
+int VolumeClipBox(LPBLOCKBOX box, const MAPINFO *info);
+void VolumeWrap(LPMCVOLUME vol, const u8 *mcdata, const MAPINFO *info);
+int VolumeReadFile(LPMCVOLUME vol, int fd, const MAPINFO *info,
+					const BLOCKBOX *box, int packed);
+int VolumeReadStream(LPMCVOLUME vol, MCCREADPROC reader, void *arg,
+					const MAPINFO *info, const BLOCKBOX *box, int packed);
+int VolumeMakeWritable(LPMCVOLUME vol);
+int VolumeSetParam2(LPMCVOLUME vol, int x, int y, int z, u8 param2);
+int VolumeRangeEqual(const MCVOLUME *a, const MCVOLUME *b,
+					int x0, int y0, int z0, int nx, int ny, int nz);
+void VolumeFree(LPMCVOLUME vol);
+
+#endif // VOLUME_HEADER
@@ -0,0 +1,251 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * watch.c -
+ *    Keeps a world in step with a map that's saved over and over, such as a
+ *    Classic server's autosave.  After each save the map is read again and
+ *    only the blocks that changed since the last one are rewritten, in one
+ *    short transaction.  The time from the save to those blocks being
+ *    committed is printed for every sync.
+ *
+ *    On Linux the map's directory is watched with inotify, which sees saves
+ *    written in place as well as those renamed over the map.  Elsewhere the
+ *    map is polled.
+ */
+
+#include "mcconvert.h"
+#include "watch.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+static volatile sig_atomic_t stopping;
+
+static void WatchSignalHandler(int sig);
+static int WatchOpen(LPWATCHER w, const char *filename);
+static int WatchWait(LPWATCHER w);
+static void WatchClose(LPWATCHER w);
+static int WatchSync(LPMCCONTEXT ctx, const char *filename);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Runs until interrupted; returns 0 if the map couldn't be watched or the
+// first conversion failed.  Later failures are reported and the next save
+// waited for.
+int WatchRun(LPMCCONTEXT ctx, const char *filename) {
+	struct sigaction sa;
+	WATCHER w;
+	int success;
+	
+	// No SA_RESTART, so that waiting returns once we're told to stop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = WatchSignalHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	
+	// Watching starts first so a save made during the first conversion
+	// isn't missed
+	if (!WatchOpen(&w, filename))
+		return 0;
+	
+	success = WatchSync(ctx, filename);
+	if (success)
+		printf("Watching %s\n", filename);
+	while (success && !stopping && WatchWait(&w))
+		WatchSync(ctx, filename);
+	
+	WatchClose(&w);
+	MCCFinish(ctx);
+	return success;
+}
+
+
+static void WatchSignalHandler(int sig) {
+	stopping = 1;
+}
+
+
+static int WatchSync(LPMCCONTEXT ctx, const char *filename) {
+	MCCSTATS stats;
+	struct stat st;
+	struct timespec now;
+	double started = TimeNow();
+	double lag;
+	
+	if (stat(filename, &st) == -1) {
+		perror("Could not stat input file");
+		return 0;
+	}
+	
+	if (!MCCSyncFile(ctx, filename)) {
+		fprintf(stderr, "Sync failed, waiting for the next save\n");
+		return 0;
+	}
+	
+	clock_gettime(CLOCK_REALTIME, &now);
+	lag = (now.tv_sec - st.st_mtim.tv_sec) + (now.tv_nsec - st.st_mtim.tv_nsec) / 1e9;
+	
+	MCCGetStats(ctx, &stats);
+	printf("%lu blocks synced in %.0f ms, %.0f ms after the save\n",
+		stats.nblocks, (TimeNow() - started) * 1000.0, lag * 1000.0);
+	fflush(stdout);
+	return 1;
+}
+
+
+#ifdef __linux__
+
+static int WatchOpen(LPWATCHER w, const char *filename) {
+	const char *slash = strrchr(filename, '/');
+	
+	w->filename = filename;
+	w->dir  = slash ? strndup(filename, slash - filename + 1) : strdup(".");
+	w->name = slash ? slash + 1 : filename;
+	
+	w->fd = inotify_init1(IN_CLOEXEC);
+	if (w->fd == -1) {
+		perror("inotify_init1");
+		free(w->dir);
+		return 0;
+	}
+	
+	// The directory rather than the map, which a save may replace
+	if (inotify_add_watch(w->fd, w->dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		perror("Could not watch the input file's directory");
+		WatchClose(w);
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+// Returns once the map has been saved and left alone for WATCH_QUIET_MS, or
+// 0 when stopping
+static int WatchWait(LPWATCHER w) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	double deadline = 0.0;
+	ssize_t len;
+	char *p;
+	int n, timeout;
+	
+	pfd.fd     = w->fd;
+	pfd.events = POLLIN;
+	
+	while (!stopping) {
+		timeout = -1;
+		if (deadline > 0.0) {
+			timeout = (deadline - TimeNow()) * 1000.0;
+			if (timeout <= 0)
+				return 1;
+		}
+		
+		n = poll(&pfd, 1, timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 0;
+		}
+		if (!n)
+			return 1;
+		
+		len = read(w->fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len == -1 && errno == EINTR)
+				continue;
+			perror("Could not read inotify events");
+			return 0;
+		}
+		
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len && !strcmp(ev->name, w->name))
+				deadline = TimeNow() + WATCH_QUIET_MS / 1000.0;
+		}
+	}
+	
+	return 0;
+}
+
+
+static void WatchClose(LPWATCHER w) {
+	close(w->fd);
+	free(w->dir);
+}
+
+#else
+
+static int WatchOpen(LPWATCHER w, const char *filename) {
+	w->filename = filename;
+	w->dir  = NULL;
+	w->name = filename;
+	w->fd   = -1;
+	
+	if (stat(filename, &w->st) == -1) {
+		perror("Could not stat input file");
+		return 0;
+	}
+	
+	return 1;
+}
+
+
+// A change is only taken once the map looks the same on two polls in a row
+static int WatchWait(LPWATCHER w) {
+	struct stat st;
+	int changed = 0;
+	
+	while (!stopping) {
+		usleep(WATCH_POLL_MS * 1000);
+		if (stat(w->filename, &st) == -1)
+			continue;
+		
+		if (st.st_mtime != w->st.st_mtime || st.st_size != w->st.st_size ||
+			st.st_ino != w->st.st_ino) {
+			w->st = st;
+			changed = 1;
+		} else if (changed) {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+
+static void WatchClose(LPWATCHER w) {
+}
+
+#endif
@@ -0,0 +1,191 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* 
+ * workpool.c -
+ *    A fixed set of threads that split a batch of independent items between
+ *    them.  The calling thread works on the batch too and WorkPoolRun returns
+ *    once every item is done.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "workpool.h"
+
+typedef struct _WORKERARG {
+	LPWORKPOOL pool;
+	int index;
+} WORKERARG;
+
+static void *WorkPoolThreadProc(void *arg);
+static void WorkPoolDrain(LPWORKPOOL pool, int worker);
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Returns NULL if out of memory.  Threads that can't be started are done
+// without, down to just the calling thread.
+LPWORKPOOL WorkPoolCreate(int nthreads) {
+	LPWORKPOOL pool;
+	WORKERARG *wa;
+	int i;
+	
+	if (nthreads < 1)
+		nthreads = 1;
+	
+	pool = calloc(1, sizeof(WORKPOOL));
+	if (!pool)
+		return NULL;
+	pool->nthreads = nthreads;
+	pool->threads  = calloc(nthreads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	
+	for (i = 1; i < nthreads; i++) {
+		wa = malloc(sizeof(WORKERARG));
+		if (!wa) {
+			pool->nthreads = i;
+			break;
+		}
+		wa->pool  = pool;
+		wa->index = i;
+		if (pthread_create(&pool->threads[i], NULL, WorkPoolThreadProc, wa)) {
+			free(wa);
+			pool->nthreads = i;
+			break;
+		}
+	}
+	
+	return pool;
+}
+
+
+void WorkPoolRun(LPWORKPOOL pool, WORKPROC proc, void *arg, int nitems) {
+	int i;
+	
+	if (pool->nthreads == 1 || nitems == 1) {
+		for (i = 0; i != nitems; i++)
+			proc(arg, i, 0);
+		return;
+	}
+	
+	pthread_mutex_lock(&pool->lock);
+	pool->proc      = proc;
+	pool->arg       = arg;
+	pool->nitems    = nitems;
+	pool->next_item = 0;
+	pool->nbusy     = pool->nthreads - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+	
+	WorkPoolDrain(pool, 0);
+	
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nbusy)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+void WorkPoolDestroy(LPWORKPOOL pool) {
+	int i;
+	
+	if (!pool)
+		return;
+	
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+	
+	for (i = 1; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+	
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+
+int WorkPoolDefaultThreads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	return (n > 0) ? n : 1;
+}
+
+
+static void *WorkPoolThreadProc(void *arg) {
+	WORKERARG *wa = arg;
+	LPWORKPOOL pool = wa->pool;
+	int index = wa->index;
+	unsigned long seen = 0;
+	
+	free(wa);
+	
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+		if (pool->quit) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		
+		WorkPoolDrain(pool, index);
+		
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->nbusy)
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	
+	return NULL;
+}
+
+
+static void WorkPoolDrain(LPWORKPOOL pool, int worker) {
+	int item;
+	
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		item = pool->next_item;
+		if (item < pool->nitems)
+			pool->next_item++;
+		pthread_mutex_unlock(&pool->lock);
+		
+		if (item >= pool->nitems)
+			break;
+		pool->proc(pool->arg, item, worker);
+	}
+}
@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2013 Ryan Kwolek <kwolekr@minetest.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are
+ * permitted provided that the following conditions are met:
+ *  1. Redistributions of source code must retain the above copyright notice, this list of
+ *     conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright notice, this list
+ *     of conditions and the following disclaimer in the documentation and/or other materials
+ *     provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORKPOOL_HEADER
+#define WORKPOOL_HEADER
+
+#include <pthread.h>
+
+// Called once per item; worker is the index of the calling thread, 0 being
+// the thread that called WorkPoolRun
+typedef void (*WORKPROC)(void *arg, int item, int worker);
+
+typedef struct _WORKPOOL {
+	int nthreads; // including the calling thread
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	
+	WORKPROC proc;
+	void *arg;
+	int nitems;
+	int next_item;
+	int nbusy;
+	unsigned long generation;
+	int quit;
+} WORKPOOL, *LPWORKPOOL;
+
+LPWORKPOOL WorkPoolCreate(int nthreads);
+void WorkPoolRun(LPWORKPOOL pool, WORKPROC proc, void *arg, int nitems);
+void WorkPoolDestroy(LPWORKPOOL pool);
+int WorkPoolDefaultThreads(void);
+
+#endif // WORKPOOL_HEADER